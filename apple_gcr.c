@@ -7,17 +7,47 @@
 
 #include "apple_gcr.h"
 #include <string.h>
+#include <pthread.h>
+
+#if CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
 
 #define DOS_VOLUME_NUMBER           254
 #define TRACK_LEADER_SYNC_COUNT     64
-#define SECTORS_PER_TRACK           16
+#define SECTORS_PER_TRACK           GCR_SECTORS_PER_TRACK
 #define BYTES_PER_SECTOR            256
-#define GCR_SECTOR_ENCODED_SIZE     343
 
-static size_t bits_write_byte(uint8_t * buffer, size_t index, int value);
-static size_t bits_write_4_and_4(uint8_t * buffer, size_t index, int value);
-static size_t bits_write_sync(uint8_t * buffer, size_t index);
-static void encode_6_and_2(uint8_t * dest, const uint8_t * src);
+#define SYNC_WORD                   0x3FC       // 0xFF and then two zero bits
+#define SYNC_WORD_BITS              10
+
+// Collects bits most significant first in a 64-bit accumulator, and stores them out four
+// whole bytes at a time. Bytes are stored rather than ORed in, except that a partial
+// byte at the start keeps the bits already there, and one at the end can be merged
+// with what follows it (see bit_writer_end()).
+typedef struct _bit_writer {
+    uint8_t * start;
+    uint8_t * next;         // Where the next whole bytes are stored
+    uint64_t bits;          // Pending bits, left-aligned
+    int count;              // How many bits are pending; under 32 between calls
+} bit_writer;
+
+static size_t encode_track_layout(uint8_t * dest, const uint8_t * src, int track_number,
+                                  dsk_sector_format sector_format, gcr_track_template * template);
+static void bit_writer_begin(bit_writer * writer, uint8_t * buffer, size_t bit_index);
+static size_t bit_writer_end(bit_writer * writer, int merge_last_byte);
+static void bit_writer_put_bytes(bit_writer * writer, const uint8_t * bytes, size_t count);
+static void bit_writer_put_syncs(bit_writer * writer, int count);
+static void bit_writer_put_zeros(bit_writer * writer, size_t bit_count);
+static void bit_writer_put_4_and_4(bit_writer * writer, int value);
+static void encode_6_and_2_scalar(uint8_t * dest, const uint8_t * src);
+#if CPU_FEATURES_X86
+static void encode_6_and_2_sse4_1(uint8_t * dest, const uint8_t * src);
+#endif
+static void choose_best_6_and_2(void);
+
+static gcr_6_and_2_fn best_6_and_2 = NULL;
+static pthread_once_t best_6_and_2_once = PTHREAD_ONCE_INIT;
 
 //
 // Track encoding and writing routines
@@ -25,13 +55,63 @@ static void encode_6_and_2(uint8_t * dest, const uint8_t * src);
 
 size_t gcr_encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number, dsk_sector_format sector_format)
 {
-    size_t bit_index = 0;
-    memset(dest, 0, GCR_ENCODED_TRACK_SIZE);
+    return encode_track_layout(dest, src, track_number, sector_format, NULL);
+}
 
-    // Write 64 sync words
-    for (int i = 0; i < TRACK_LEADER_SYNC_COUNT; i++) {
-        bit_index = bits_write_sync(dest, bit_index);
+void gcr_prepare_track_template(gcr_track_template * template, int track_number, dsk_sector_format sector_format)
+{
+    template->bit_count = encode_track_layout(template->bits, NULL, track_number, sector_format, template);
+}
+
+size_t gcr_encode_track_from_template(uint8_t * dest, const gcr_track_template * template, const uint8_t * src)
+{
+    memcpy(dest, template->bits, GCR_ENCODED_TRACK_SIZE);
+    for (int s = 0; s < SECTORS_PER_TRACK; s++) {
+        uint8_t encoded_contents[GCR_ENCODED_SECTOR_SIZE];
+        gcr_encode_6_and_2(encoded_contents, &src[template->logical_sectors[s] * BYTES_PER_SECTOR]);
+        bit_writer writer;
+        bit_writer_begin(&writer, dest, template->data_field_bit_offsets[s]);
+        bit_writer_put_bytes(&writer, encoded_contents, GCR_ENCODED_SECTOR_SIZE);
+        bit_writer_end(&writer, 1);
     }
+    return template->bit_count;
+}
+
+void gcr_encode_sector_at(uint8_t * bits, size_t bit_index, const uint8_t * src)
+{
+    // Clear the old field first, since the writer only ORs in its partial end bytes.
+    size_t end_index = bit_index + GCR_ENCODED_SECTOR_SIZE * 8;
+    size_t first = bit_index >> 3;
+    size_t last = end_index >> 3;
+    bits[first] &= (uint8_t)(0xFF00 >> (bit_index & 7));
+    memset(&bits[first + 1], 0, last - first - 1);
+    if (end_index & 7) {
+        bits[last] &= 0xFF >> (end_index & 7);
+    }
+
+    uint8_t encoded_contents[GCR_ENCODED_SECTOR_SIZE];
+    gcr_encode_6_and_2(encoded_contents, src);
+    bit_writer writer;
+    bit_writer_begin(&writer, bits, bit_index);
+    bit_writer_put_bytes(&writer, encoded_contents, GCR_ENCODED_SECTOR_SIZE);
+    bit_writer_end(&writer, 1);
+}
+
+//
+// Lays out a whole track. If template is NULL, the sector data is encoded from src as
+// it goes. Otherwise src isn't used: each data field is left as zero bits, and its
+// position and logical sector are recorded in the template instead.
+//
+
+static
+size_t encode_track_layout(uint8_t * dest, const uint8_t * src, int track_number,
+                           dsk_sector_format sector_format, gcr_track_template * template)
+{
+    bit_writer writer;
+    bit_writer_begin(&writer, dest, 0);
+
+    // Write 64 sync words
+    bit_writer_put_syncs(&writer, TRACK_LEADER_SYNC_COUNT);
 
     // Write out the sectors in physical order. We will select the appopriate logical
     // input data for each physical output sector.
@@ -42,34 +122,29 @@ size_t gcr_encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number
         //
 
         // Prologue
-        bit_index = bits_write_byte(dest, bit_index, 0xD5);
-        bit_index = bits_write_byte(dest, bit_index, 0xAA);
-        bit_index = bits_write_byte(dest, bit_index, 0x96);
+        const uint8_t address_prologue[] = { 0xD5, 0xAA, 0x96 };
+        bit_writer_put_bytes(&writer, address_prologue, sizeof(address_prologue));
 
         // Volume, track, sector and checksum, all in 4-and-4 format
-        bit_index = bits_write_4_and_4(dest, bit_index, DOS_VOLUME_NUMBER);
-        bit_index = bits_write_4_and_4(dest, bit_index, track_number);
-        bit_index = bits_write_4_and_4(dest, bit_index, s);
-        bit_index = bits_write_4_and_4(dest, bit_index, DOS_VOLUME_NUMBER ^ track_number ^ s);
+        bit_writer_put_4_and_4(&writer, DOS_VOLUME_NUMBER);
+        bit_writer_put_4_and_4(&writer, track_number);
+        bit_writer_put_4_and_4(&writer, s);
+        bit_writer_put_4_and_4(&writer, DOS_VOLUME_NUMBER ^ track_number ^ s);
 
         // Epilogue
-        bit_index = bits_write_byte(dest, bit_index, 0xDE);
-        bit_index = bits_write_byte(dest, bit_index, 0xAA);
-        bit_index = bits_write_byte(dest, bit_index, 0xEB);
+        const uint8_t epilogue[] = { 0xDE, 0xAA, 0xEB };
+        bit_writer_put_bytes(&writer, epilogue, sizeof(epilogue));
 
         // Write 7 sync words.
-        for (int i = 0; i < 7; i++) {
-            bit_index = bits_write_sync(dest, bit_index);
-        }
+        bit_writer_put_syncs(&writer, 7);
 
         //
         // Sector body
         //
 
         // Prologue
-        bit_index = bits_write_byte(dest, bit_index, 0xD5);
-        bit_index = bits_write_byte(dest, bit_index, 0xAA);
-        bit_index = bits_write_byte(dest, bit_index, 0xAD);
+        const uint8_t data_prologue[] = { 0xD5, 0xAA, 0xAD };
+        bit_writer_put_bytes(&writer, data_prologue, sizeof(data_prologue));
 
         // Figure out which logical sector goes into this physical sector.
         int logical_sector;
@@ -81,85 +156,215 @@ size_t gcr_encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number
         }
 
         // Finally, the actual contents! Encode the buffer, then write them.
-        uint8_t encoded_contents[GCR_SECTOR_ENCODED_SIZE];
-        encode_6_and_2(encoded_contents, &src[logical_sector * BYTES_PER_SECTOR]);
-        for (int i = 0; i < GCR_SECTOR_ENCODED_SIZE; i++) {
-            bit_index = bits_write_byte(dest, bit_index, encoded_contents[i]);
+        if (template) {
+            template->data_field_bit_offsets[s] = (writer.next - writer.start) * 8 + writer.count;
+            template->logical_sectors[s] = logical_sector;
+            bit_writer_put_zeros(&writer, GCR_ENCODED_SECTOR_SIZE * 8);
+        } else {
+            uint8_t encoded_contents[GCR_ENCODED_SECTOR_SIZE];
+            gcr_encode_6_and_2(encoded_contents, &src[logical_sector * BYTES_PER_SECTOR]);
+            bit_writer_put_bytes(&writer, encoded_contents, GCR_ENCODED_SECTOR_SIZE);
         }
 
         // Epilogue
-        bit_index = bits_write_byte(dest, bit_index, 0xDE);
-        bit_index = bits_write_byte(dest, bit_index, 0xAA);
-        bit_index = bits_write_byte(dest, bit_index, 0xEB);
+        bit_writer_put_bytes(&writer, epilogue, sizeof(epilogue));
 
         // Conclude the track
         if (s < (SECTORS_PER_TRACK - 1)) {
             // Write 16 sync words
-            for (int i = 0; i < 16; i++) {
-                bit_index = bits_write_sync(dest, bit_index);
-            }
+            bit_writer_put_syncs(&writer, 16);
         } else {
-            bit_index = bits_write_byte(dest, bit_index, 0xFF);
+            const uint8_t final_byte = 0xFF;
+            bit_writer_put_bytes(&writer, &final_byte, 1);
         }
     }
 
-    // Any remaining bytes in the destination buffer will remain cleared to zero and
-    // function as padding to the nearest 512-byte block.
+    // The rest of the destination buffer is cleared to zero, as padding to the nearest
+    // 512-byte block.
+    size_t bit_index = bit_writer_end(&writer, 0);
+    size_t used_bytes = (bit_index + 7) / 8;
+    memset(&dest[used_bytes], 0, GCR_ENCODED_TRACK_SIZE - used_bytes);
 
     // Return the current bit index, which is equal to the number of valid written bits
     return bit_index;
 }
 
 //
-// Helper routines.
+// Bit writer.
 //
 
+static inline
+void store_be32(uint8_t * p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+// Appends the low bit_count (1 to 32) bits of value, which must have no others set.
+static inline
+void bit_writer_put(bit_writer * writer, uint32_t value, int bit_count)
+{
+    writer->bits |= (uint64_t)value << (64 - writer->count - bit_count);
+    writer->count += bit_count;
+    if (writer->count >= 32) {
+        store_be32(writer->next, (uint32_t)(writer->bits >> 32));
+        writer->next += 4;
+        writer->bits <<= 32;
+        writer->count -= 32;
+    }
+}
+
+// Stores out whole pending bytes, leaving under 8 bits pending.
+static inline
+void bit_writer_flush_bytes(bit_writer * writer)
+{
+    while (writer->count >= 8) {
+        *writer->next++ = writer->bits >> 56;
+        writer->bits <<= 8;
+        writer->count -= 8;
+    }
+}
+
 static
-size_t bits_write_byte(uint8_t * buffer, size_t index, int value)
+void bit_writer_begin(bit_writer * writer, uint8_t * buffer, size_t bit_index)
 {
-    size_t shift = index & 7;
-    size_t byte_position = index >> 3;
+    writer->start = buffer;
+    writer->next = &buffer[bit_index >> 3];
+    writer->count = bit_index & 7;
+    writer->bits = writer->count ? (uint64_t)(*writer->next & (0xFF00 >> writer->count)) << 56 : 0;
+}
 
-    buffer[byte_position] |= value >> shift;
-    if (shift) {
-        buffer[byte_position + 1] |= value << (8 - shift);
+// Stores everything pending and returns the bit index the writer got to. A final
+// partial byte is ORed into the buffer if merge_last_byte is set, and otherwise it's
+// stored with its unused low bits as zeros.
+static
+size_t bit_writer_end(bit_writer * writer, int merge_last_byte)
+{
+    size_t bit_index = (writer->next - writer->start) * 8 + writer->count;
+    bit_writer_flush_bytes(writer);
+    if (writer->count > 0) {
+        if (merge_last_byte) {
+            *writer->next |= writer->bits >> 56;
+        } else {
+            *writer->next = writer->bits >> 56;
+        }
     }
-    
-    return index + 8;
+    return bit_index;
 }
 
-// Writes a byte in 4-and-4
 static
-size_t bits_write_4_and_4(uint8_t * buffer, size_t index, int value)
+void bit_writer_put_bytes(bit_writer * writer, const uint8_t * bytes, size_t count)
 {
-    index = bits_write_byte(buffer, index, (value >> 1) | 0xAA);
-    index = bits_write_byte(buffer, index, value | 0xAA);
-    return index;
+    // Byte-aligned spans are copied straight through.
+    if ((writer->count & 7) == 0) {
+        bit_writer_flush_bytes(writer);
+        memcpy(writer->next, bytes, count);
+        writer->next += count;
+        return;
+    }
+    // Otherwise every output byte straddles two input bytes, by a fixed shift, so the
+    // span is shifted eight bytes at a time as big-endian words.
+    bit_writer_flush_bytes(writer);
+    if (count == 0) {
+        return;
+    }
+    int shift = writer->count;
+    uint8_t * out = writer->next;
+    uint8_t carry = writer->bits >> 56;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, &bytes[i], 8);
+        word = __builtin_bswap64(word);
+        word = (word >> shift) | ((uint64_t)carry << 56);
+        carry = (uint8_t)(bytes[i + 7] << (8 - shift));
+        word = __builtin_bswap64(word);
+        memcpy(&out[i], &word, 8);
+    }
+    for (; i < count; i++) {
+        out[i] = carry | (bytes[i] >> shift);
+        carry = (uint8_t)(bytes[i] << (8 - shift));
+    }
+    writer->next += count;
+    writer->bits = (uint64_t)carry << 56;
+}
+
+// Writes 6-and-2 sync words: 0xFF followed by two zero bits.
+static
+void bit_writer_put_syncs(bit_writer * writer, int count)
+{
+    // Three at a time.
+    const uint32_t three_syncs = (SYNC_WORD << (2 * SYNC_WORD_BITS)) | (SYNC_WORD << SYNC_WORD_BITS) | SYNC_WORD;
+    for (; count >= 3; count -= 3) {
+        bit_writer_put(writer, three_syncs, 3 * SYNC_WORD_BITS);
+    }
+    for (; count > 0; count--) {
+        bit_writer_put(writer, SYNC_WORD, SYNC_WORD_BITS);
+    }
+}
+
+static
+void bit_writer_put_zeros(bit_writer * writer, size_t bit_count)
+{
+    for (; bit_count >= 32; bit_count -= 32) {
+        bit_writer_put(writer, 0, 32);
+    }
+    if (bit_count > 0) {
+        bit_writer_put(writer, 0, (int)bit_count);
+    }
 }
 
-// Writes a 6-and-2 sync word
+// Writes a byte in 4-and-4
 static
-size_t bits_write_sync(uint8_t * buffer, size_t index)
+void bit_writer_put_4_and_4(bit_writer * writer, int value)
 {
-    index = bits_write_byte(buffer, index, 0xFF);
-    return index + 2; // Skip two bits, i.e. leave them as 0s.
+    bit_writer_put(writer, (((value >> 1) | 0xAA) << 8) | (value | 0xAA), 16);
 }
 
+//
+// 6-and-2 sector encoding. Every version produces exactly the same bytes; the fastest
+// one the CPU supports is picked at runtime.
+//
+
+static const uint8_t six_and_two_mapping[64] = {
+    0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
+    0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
+    0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
+    0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde,
+    0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
+    0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+    0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
 // Encodes a 256-byte sector buffer into a 343 byte 6-and-2 encoding of same
+void gcr_encode_6_and_2(uint8_t * dest, const uint8_t * src)
+{
+    pthread_once(&best_6_and_2_once, choose_best_6_and_2);
+    best_6_and_2(dest, src);
+}
+
+gcr_6_and_2_fn gcr_6_and_2_for_level(simd_level level)
+{
+#if CPU_FEATURES_X86
+    if (level >= simd_level_sse4_1) {
+        return encode_6_and_2_sse4_1;
+    }
+#endif
+    return encode_6_and_2_scalar;
+}
+
 static
-void encode_6_and_2(uint8_t * dest, const uint8_t * src)
-{
-    const uint8_t six_and_two_mapping[] = {
-        0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
-        0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
-        0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
-        0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
-        0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde,
-        0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
-        0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
-        0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
-    };
+void choose_best_6_and_2(void)
+{
+    best_6_and_2 = gcr_6_and_2_for_level(cpu_simd_level());
+}
 
+static
+void encode_6_and_2_scalar(uint8_t * dest, const uint8_t * src)
+{
     // Fill in byte values: the first 86 bytes contain shuffled
     // and combined copies of the bottom two bits of the sector
     // contents; the 256 bytes afterwards are the remaining
@@ -196,3 +401,76 @@ void encode_6_and_2(uint8_t * dest, const uint8_t * src)
     }
 }
 
+#if CPU_FEATURES_X86
+
+// 16 bytes at a time, in three steps:
+//
+// - The bottom two bits of each source byte, swapped, come from a pshufb lookup, one
+//   for each of the three thirds of the sector, pre-shifted into place. The third
+//   third is two bytes short, so its last block is loaded two bytes early and shifted
+//   down, which leaves zeros for those bytes, as in the scalar version.
+// - The "exclusive OR each byte with the one before it" step doesn't chain: each
+//   output byte is the XOR of two adjacent unencoded bytes. So it's a single XOR with
+//   the same buffer loaded one byte back, with a zero before the start and after the
+//   end.
+// - The 64-entry mapping is four 16-entry pshufb lookups, selected by the top two of
+//   the six bits.
+__attribute__((target("sse4.1")))
+static
+void encode_6_and_2_sse4_1(uint8_t * dest, const uint8_t * src)
+{
+    // The unencoded bytes go at raw[16]. raw[15] and everything from raw[16 + 342]
+    // is zero.
+    uint8_t raw[16 + 352] __attribute__((aligned(16)));
+    uint8_t * unencoded = &raw[16];
+    _mm_store_si128((__m128i *)&raw[0], _mm_setzero_si128());
+    _mm_storeu_si128((__m128i *)&unencoded[352 - 16], _mm_setzero_si128());
+
+    const __m128i low_bits = _mm_set1_epi8(3);
+    const __m128i swapped_0 = _mm_setr_epi8(0, 2, 1, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i swapped_2 = _mm_slli_epi16(swapped_0, 2);
+    const __m128i swapped_4 = _mm_slli_epi16(swapped_0, 4);
+    const int starts[6] = { 0, 16, 32, 48, 64, 70 };
+    for (int i = 0; i < 6; i++) {
+        int c = starts[i];
+        __m128i a = _mm_loadu_si128((const __m128i *)&src[c]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&src[c + 86]);
+        __m128i d = (c + 172 + 16 <= 256) ? _mm_loadu_si128((const __m128i *)&src[c + 172]) :
+                    _mm_srli_si128(_mm_loadu_si128((const __m128i *)&src[240]), 2);
+        __m128i aux = _mm_or_si128(_mm_shuffle_epi8(swapped_0, _mm_and_si128(a, low_bits)),
+                      _mm_or_si128(_mm_shuffle_epi8(swapped_2, _mm_and_si128(b, low_bits)),
+                                   _mm_shuffle_epi8(swapped_4, _mm_and_si128(d, low_bits))));
+        _mm_storeu_si128((__m128i *)&unencoded[c], aux);
+    }
+    const __m128i six_bits = _mm_set1_epi8(0x3F);
+    for (int c = 0; c < 256; c += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[c]);
+        _mm_storeu_si128((__m128i *)&unencoded[86 + c], _mm_and_si128(_mm_srli_epi16(v, 2), six_bits));
+    }
+
+    const __m128i map_0 = _mm_loadu_si128((const __m128i *)&six_and_two_mapping[0]);
+    const __m128i map_1 = _mm_loadu_si128((const __m128i *)&six_and_two_mapping[16]);
+    const __m128i map_2 = _mm_loadu_si128((const __m128i *)&six_and_two_mapping[32]);
+    const __m128i map_3 = _mm_loadu_si128((const __m128i *)&six_and_two_mapping[48]);
+    const __m128i sixteen = _mm_set1_epi8(16);
+    const __m128i thirty_two = _mm_set1_epi8(32);
+    const __m128i forty_eight = _mm_set1_epi8(48);
+    for (int c = 0; c < GCR_ENCODED_SECTOR_SIZE; c += 16) {
+        // The last block overlaps the one before it, to end exactly at 343.
+        if (c > GCR_ENCODED_SECTOR_SIZE - 16) {
+            c = GCR_ENCODED_SECTOR_SIZE - 16;
+        }
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&unencoded[c]),
+                                  _mm_loadu_si128((const __m128i *)&unencoded[c - 1]));
+        __m128i in_1 = _mm_cmpgt_epi8(sixteen, v);
+        __m128i in_2 = _mm_cmpgt_epi8(thirty_two, v);
+        __m128i in_3 = _mm_cmpgt_epi8(forty_eight, v);
+        __m128i mapped = _mm_shuffle_epi8(map_3, v);
+        mapped = _mm_blendv_epi8(mapped, _mm_shuffle_epi8(map_2, v), in_3);
+        mapped = _mm_blendv_epi8(mapped, _mm_shuffle_epi8(map_1, v), in_2);
+        mapped = _mm_blendv_epi8(mapped, _mm_shuffle_epi8(map_0, v), in_1);
+        _mm_storeu_si128((__m128i *)&dest[c], mapped);
+    }
+}
+
+#endif
@@ -12,15 +12,42 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include "cpu_features.h"
 
 #define GCR_RAW_TRACK_SIZE          (16 * 256)  // Input to encode is expected to be this size
 #define GCR_ENCODED_TRACK_SIZE      (13 * 512)  // Output buffer should be at least this large
+#define GCR_ENCODED_SECTOR_SIZE     343         // Nibbles in one 6-and-2 encoded sector
+#define GCR_SECTORS_PER_TRACK       16
 
 typedef enum _dsk_sector_format {
     dsk_sector_format_dos_3_3 = 0,
     dsk_sector_format_prodos = 1
 } dsk_sector_format;
 
+// Everything on a track but the sector data (sync words, address fields, prologues and
+// epilogues) depends only on the track number and sector format. A template holds
+// that fixed bitstream, with zero bits where each sector's data field goes.
+typedef struct _gcr_track_template {
+    size_t bit_count;
+    size_t data_field_bit_offsets[GCR_SECTORS_PER_TRACK];  // By physical sector
+    int logical_sectors[GCR_SECTORS_PER_TRACK];             // Source sector for each physical one
+    uint8_t bits[GCR_ENCODED_TRACK_SIZE];
+} gcr_track_template;
+
+// Returns the number of valid bits written. The rest of the 13-block buffer is zeroed.
 size_t gcr_encode_bits_for_track(uint8_t * dest, uint8_t * src, int track_number, dsk_sector_format sector_format);
 
+// Same output as gcr_encode_bits_for_track(), but from a prepared template, so only the
+// sector data is encoded.
+void gcr_prepare_track_template(gcr_track_template * template, int track_number, dsk_sector_format sector_format);
+size_t gcr_encode_track_from_template(uint8_t * dest, const gcr_track_template * template, const uint8_t * src);
+// Re-encodes one sector's data field in place, at bit_index in bits, leaving the bits on
+// either side of it alone. With a template, bit_index is one of its data field offsets.
+void gcr_encode_sector_at(uint8_t * bits, size_t bit_index, const uint8_t * src);
+// Encodes one 256-byte sector into GCR_ENCODED_SECTOR_SIZE nibbles, with the fastest
+// version this CPU supports. All versions give the same result.
+typedef void (*gcr_6_and_2_fn)(uint8_t * dest, const uint8_t * src);
+void gcr_encode_6_and_2(uint8_t * dest, const uint8_t * src);
+gcr_6_and_2_fn gcr_6_and_2_for_level(simd_level level);
+
 #endif /* apple_gcr_h */
@@ -0,0 +1,1024 @@
+//
+// bench.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// Micro-benchmarks for the hot paths. Build and run with "make bench". All inputs are
+// synthetic and deterministic, so numbers are comparable between builds. Every
+// vectorized routine is checked against its scalar version before it is timed.
+//
+// USAGE: picturedsk-bench [--json] [filter]
+//
+// Only benchmarks whose name contains the filter string are run. With --json, the
+// results are printed as a JSON array instead of a table, for comparing builds.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "bitmap.h"
+#include "bmp_bitmap.h"
+#include "polar_map.h"
+#include "track_kernel.h"
+#include "dither.h"
+#include "cpu_features.h"
+#include "crc32.h"
+#include "apple_gcr.h"
+#include "woz_image.h"
+#include "woz_reader.h"
+#include "picturedsk.h"
+
+#define BENCH_TRACK_COUNT       45
+#define BENCH_TRACK_SIZE        (13 * 512)
+#define BENCH_MIN_SECONDS       0.25
+#define BENCH_SCREEN_DIMENSION  147
+#define BENCH_ROW_CHECK_WIDTH   67      // Widest row the vector BMP decoders are checked on
+
+typedef void (*bench_fn)(void * context);
+
+static int json_output = 0;
+static int report_count = 0;
+static const char * name_filter = NULL;
+
+static void run_bench(const char * name, const char * variant, bench_fn fn, void * context, double units_per_op, const char * unit);
+static int bench_selected(const char * name);
+static double now_seconds(void);
+static uint32_t next_random(uint32_t * state);
+static void fill_random(uint8_t * buffer, size_t size, uint32_t seed);
+static luma_bitmap * create_synthetic_luma(int width, int height);
+static uint8_t * create_synthetic_bmp(int width, int height, int bits_per_pixel, size_t * size);
+static woz_file * create_synthetic_woz(void);
+static void report(const char * name, const char * variant, double seconds, long ops, double units_per_op, const char * unit);
+static void fail(const char * name, const char * variant, const char * message);
+static void remove_directory(const char * path);
+static void check_truecolor_rows(const char * name, int bits_per_pixel);
+static void bench_sample(int dimension);
+static void bench_polar_map(int dimension);
+static void bench_track_kernel(int dimension);
+static void bench_gcr(void);
+static void bench_crc32(size_t size);
+static void bench_bmp_load(int dimension, int bits_per_pixel);
+static void bench_write_woz(void);
+static void bench_end_to_end(int dimension);
+static void bench_restamp(void);
+static void bench_verify_woz(void);
+static void bench_preview(int size);
+
+int main(int argc, const char * argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json_output = 1;
+        } else {
+            name_filter = argv[i];
+        }
+    }
+
+    if (json_output) {
+        printf("[");
+    } else {
+        printf("%-28s %-10s %14s %14s\n", "benchmark", "variant", "ns/op", "rate");
+    }
+    bench_sample(256);
+    bench_sample(2048);
+    bench_polar_map(256);
+    bench_polar_map(2048);
+    bench_track_kernel(256);
+    bench_track_kernel(1024);
+    bench_track_kernel(4096);
+    bench_gcr();
+    bench_crc32(64);
+    bench_crc32(BENCH_TRACK_SIZE);
+    bench_crc32(300 * 1024);
+    const int depths[] = { 1, 4, 8, 24, 32 };
+    for (int i = 0; i < 5; i++) {
+        bench_bmp_load(256, depths[i]);
+        bench_bmp_load(1024, depths[i]);
+    }
+    bench_write_woz();
+    bench_end_to_end(256);
+    bench_end_to_end(1024);
+    bench_restamp();
+    bench_verify_woz();
+    bench_preview(512);
+    if (json_output) {
+        printf("\n]\n");
+    }
+    return 0;
+}
+
+//
+// Benchmarks
+//
+
+typedef struct _sample_context {
+    bitmap * bitmap;
+    luma_bitmap * luma;
+    double sum;
+} sample_context;
+
+static
+void sample_rgba_op(void * context)
+{
+    sample_context * sample = context;
+    for (int y = 0; y < BENCH_SCREEN_DIMENSION; y++) {
+        for (int x = 0; x < BENCH_SCREEN_DIMENSION; x++) {
+            sample->sum += sample_bitmap_greyscale(sample->bitmap, x / (float)BENCH_SCREEN_DIMENSION,
+                                                   y / (float)BENCH_SCREEN_DIMENSION);
+        }
+    }
+}
+
+static
+void sample_luma_op(void * context)
+{
+    sample_context * sample = context;
+    for (int y = 0; y < BENCH_SCREEN_DIMENSION; y++) {
+        for (int x = 0; x < BENCH_SCREEN_DIMENSION; x++) {
+            sample->sum += sample_luma_bitmap(sample->luma, x / (float)BENCH_SCREEN_DIMENSION,
+                                              y / (float)BENCH_SCREEN_DIMENSION) >= LUMA_THRESHOLD;
+        }
+    }
+}
+
+// Box sampling as the library does it, including building the summed-area table.
+static
+void sample_box_op(void * context)
+{
+    sample_context * sample = context;
+    luma_sums * sums = create_luma_sums(sample->luma);
+    if (!sums) {
+        fail("sample_hgr", "box", "Out of memory.");
+    }
+    int width = sample->luma->width;
+    int height = sample->luma->height;
+    for (int y = 0; y < BENCH_SCREEN_DIMENSION; y++) {
+        int y0 = y * height / BENCH_SCREEN_DIMENSION;
+        int y1 = (y + 1) * height / BENCH_SCREEN_DIMENSION;
+        if (y1 <= y0) { y1 = y0 + 1; }
+        for (int x = 0; x < BENCH_SCREEN_DIMENSION; x++) {
+            int x0 = x * width / BENCH_SCREEN_DIMENSION;
+            int x1 = (x + 1) * width / BENCH_SCREEN_DIMENSION;
+            if (x1 <= x0) { x1 = x0 + 1; }
+            sample->sum += sample_luma_sums(sums, x0, y0, x1, y1) >= LUMA_THRESHOLD;
+        }
+    }
+    free_luma_sums(sums);
+}
+
+// One op is the whole HGR screen's worth of samples, taken the way the library does.
+static
+void bench_sample(int dimension)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "sample_hgr/%dx%d", dimension, dimension);
+    if (!bench_selected(name)) {
+        return;
+    }
+    sample_context sample;
+    sample.bitmap = create_bitmap(dimension, dimension);
+    sample.luma = create_synthetic_luma(dimension, dimension);
+    sample.sum = 0;
+    if (!sample.bitmap || !sample.luma) {
+        fail(name, "", "Out of memory.");
+    }
+    fill_random(sample.bitmap->rgba_pixels, (size_t)dimension * dimension * 4, 0x5A3B1E);
+
+    double samples = BENCH_SCREEN_DIMENSION * BENCH_SCREEN_DIMENSION;
+    run_bench(name, "rgba", sample_rgba_op, &sample, samples, "samples/s");
+    run_bench(name, "luma", sample_luma_op, &sample, samples, "samples/s");
+    run_bench(name, "box", sample_box_op, &sample, samples, "samples/s");
+    free_bitmap(sample.bitmap);
+    free_luma_bitmap(sample.luma);
+}
+
+typedef struct _polar_map_context {
+    polar_geometry geometry;
+    int dimension;
+} polar_map_context;
+
+static
+void polar_map_op(void * context)
+{
+    polar_map_context * polar = context;
+    polar_map_cache * maps = create_polar_map_cache(NULL);
+    if (!maps || !polar_map_for_image(maps, &polar->geometry, polar->dimension, polar->dimension)) {
+        fail("polar_map", "", "Out of memory.");
+    }
+    free_polar_map_cache(maps);
+}
+
+// Building the sample position map from scratch, as a cold process (or a new image
+// size) has to.
+static
+void bench_polar_map(int dimension)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "polar_map/%dx%d", dimension, dimension);
+    if (!bench_selected(name)) {
+        return;
+    }
+    polar_map_context polar;
+    polar.geometry.ring_count = BENCH_TRACK_COUNT;
+    polar.geometry.samples_per_ring = BENCH_TRACK_SIZE;
+    polar.geometry.outer_radius = 0.5;
+    polar.geometry.inner_radius = 0.1415;
+    polar.geometry.sampling = polar_sampling_point;
+    polar.dimension = dimension;
+    run_bench(name, "build", polar_map_op, &polar, (double)BENCH_TRACK_COUNT * BENCH_TRACK_SIZE, "nibbles/s");
+    polar.geometry.sampling = polar_sampling_box;
+    run_bench(name, "build box", polar_map_op, &polar, (double)BENCH_TRACK_COUNT * BENCH_TRACK_SIZE, "nibbles/s");
+}
+
+// Renders all the flux tracks of one disk per op, through the polar map.
+static
+void bench_track_kernel(int dimension)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "track_kernel/%dx%d", dimension, dimension);
+    if (!bench_selected(name)) {
+        return;
+    }
+
+    polar_geometry geometry;
+    geometry.ring_count = BENCH_TRACK_COUNT;
+    geometry.samples_per_ring = BENCH_TRACK_SIZE;
+    geometry.outer_radius = 0.5;
+    geometry.inner_radius = 0.1415;
+    geometry.sampling = polar_sampling_point;
+
+    luma_bitmap * luma = create_synthetic_luma(dimension, dimension);
+    luma_sums * sums = luma ? create_luma_sums(luma) : NULL;
+    polar_map_cache * maps = create_polar_map_cache(NULL);
+    const polar_map * map = maps ? polar_map_for_image(maps, &geometry, dimension, dimension) : NULL;
+    geometry.sampling = polar_sampling_box;
+    const polar_map * box_map = maps ? polar_map_for_image(maps, &geometry, dimension, dimension) : NULL;
+    size_t nibbles = (size_t)BENCH_TRACK_COUNT * BENCH_TRACK_SIZE;
+    uint8_t * expected = malloc(nibbles);
+    uint8_t * actual = malloc(nibbles);
+    uint8_t * thresholds = malloc(nibbles);
+    if (!luma || !sums || !map || !box_map || !expected || !actual || !thresholds) {
+        fail(name, "", "Out of memory.");
+    }
+
+    // Every version is checked with the plain threshold and with a dither mask, and then
+    // timed with the mask.
+    for (int mode = dither_mode_none; mode <= dither_mode_bayer; mode++) {
+        for (int track = 0; track < BENCH_TRACK_COUNT; track++) {
+            dither_threshold_row(mode, track, &thresholds[track * BENCH_TRACK_SIZE], BENCH_TRACK_SIZE);
+        }
+        track_kernel_for_level(simd_level_scalar)(expected, luma->pixels, map->offsets, thresholds, nibbles);
+        for (int level = 0; level <= (int)cpu_simd_level(); level++) {
+            memset(actual, 0, nibbles);
+            track_kernel_for_level(level)(actual, luma->pixels, map->offsets, thresholds, nibbles);
+            if (memcmp(expected, actual, nibbles) != 0) {
+                fail(name, simd_level_name(level), "MISMATCH against scalar output");
+            }
+        }
+    }
+
+    for (int level = 0; level <= (int)cpu_simd_level(); level++) {
+        track_kernel_fn kernel = track_kernel_for_level(level);
+
+        long ops = 0;
+        double start = now_seconds();
+        double elapsed = 0;
+        do {
+            for (int track = 0; track < BENCH_TRACK_COUNT; track++) {
+                kernel(&actual[track * BENCH_TRACK_SIZE], luma->pixels, POLAR_MAP_RING(map, track),
+                       &thresholds[track * BENCH_TRACK_SIZE], BENCH_TRACK_SIZE);
+            }
+            ops++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < BENCH_MIN_SECONDS);
+
+        report(name, simd_level_name(level), elapsed, ops, nibbles, "nibbles/s");
+    }
+
+    long ops = 0;
+    double start = now_seconds();
+    double elapsed = 0;
+    do {
+        for (int track = 0; track < BENCH_TRACK_COUNT; track++) {
+            track_kernel_render_boxes(&actual[track * BENCH_TRACK_SIZE], sums->sums, LUMA_SUMS_STRIDE(sums),
+                                      POLAR_MAP_BOX_RING(box_map, track), &thresholds[track * BENCH_TRACK_SIZE],
+                                      BENCH_TRACK_SIZE);
+        }
+        ops++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    report(name, "box", elapsed, ops, nibbles, "nibbles/s");
+
+    free(expected);
+    free(actual);
+    free(thresholds);
+    free_luma_sums(sums);
+    free_luma_bitmap(luma);
+    free_polar_map_cache(maps);
+}
+
+typedef struct _gcr_context {
+    uint8_t sectors[GCR_RAW_TRACK_SIZE];
+    uint8_t encoded[GCR_ENCODED_TRACK_SIZE];
+    gcr_track_template template;
+    gcr_6_and_2_fn sector_fn;
+} gcr_context;
+
+static
+void gcr_track_op(void * context)
+{
+    gcr_context * gcr = context;
+    gcr_encode_bits_for_track(gcr->encoded, gcr->sectors, 0, dsk_sector_format_dos_3_3);
+}
+
+static
+void gcr_template_op(void * context)
+{
+    gcr_context * gcr = context;
+    gcr_encode_track_from_template(gcr->encoded, &gcr->template, gcr->sectors);
+}
+
+static
+void gcr_sector_op(void * context)
+{
+    gcr_context * gcr = context;
+    gcr->sector_fn(gcr->encoded, gcr->sectors);
+}
+
+static
+void bench_gcr(void)
+{
+    static gcr_context gcr;
+    fill_random(gcr.sectors, sizeof(gcr.sectors), 0xD5AA96);
+    if (bench_selected("gcr_encode_track")) {
+        // The template route has to match encoding the whole track, for any track and
+        // either sector order.
+        uint8_t expected[GCR_ENCODED_TRACK_SIZE];
+        for (int track = 0; track < 35; track++) {
+            for (int format = 0; format < 2; format++) {
+                fill_random(gcr.sectors, sizeof(gcr.sectors), 0xD5AA96 + track * 2 + format);
+                size_t expected_bits = gcr_encode_bits_for_track(expected, gcr.sectors, track, format);
+                gcr_prepare_track_template(&gcr.template, track, format);
+                memset(gcr.encoded, 0xA5, sizeof(gcr.encoded));
+                if (gcr_encode_track_from_template(gcr.encoded, &gcr.template, gcr.sectors) != expected_bits ||
+                    memcmp(gcr.encoded, expected, sizeof(expected)) != 0) {
+                    fail("gcr_encode_track", "template", "MISMATCH against full track encoding");
+                }
+            }
+        }
+        fill_random(gcr.sectors, sizeof(gcr.sectors), 0xD5AA96);
+        gcr_prepare_track_template(&gcr.template, 0, dsk_sector_format_dos_3_3);
+        run_bench("gcr_encode_track", "full", gcr_track_op, &gcr, GCR_ENCODED_TRACK_SIZE, "nibbles/s");
+        run_bench("gcr_encode_track", "template", gcr_template_op, &gcr, GCR_ENCODED_TRACK_SIZE, "nibbles/s");
+    }
+    if (bench_selected("encode_6_and_2")) {
+        // Every vector version is checked against the scalar one with every byte value
+        // in every position of a random sector, plus every uniform sector.
+        gcr_6_and_2_fn scalar = gcr_6_and_2_for_level(simd_level_scalar);
+        for (int level = 1; level <= (int)cpu_simd_level(); level++) {
+            gcr_6_and_2_fn vector = gcr_6_and_2_for_level(level);
+            uint8_t sector[256];
+            uint8_t expected[GCR_ENCODED_SECTOR_SIZE];
+            uint8_t actual[GCR_ENCODED_SECTOR_SIZE];
+            for (int position = -1; position < 256; position++) {
+                for (int value = 0; value < 256; value++) {
+                    if (position < 0) {
+                        memset(sector, value, sizeof(sector));
+                    } else {
+                        fill_random(sector, sizeof(sector), 0x6A2 + position);
+                        sector[position] = value;
+                    }
+                    scalar(expected, sector);
+                    vector(actual, sector);
+                    if (memcmp(expected, actual, sizeof(expected)) != 0) {
+                        fail("encode_6_and_2", simd_level_name(level), "MISMATCH against scalar output");
+                    }
+                }
+            }
+        }
+        for (int level = 0; level <= (int)cpu_simd_level(); level++) {
+            gcr.sector_fn = gcr_6_and_2_for_level(level);
+            run_bench("encode_6_and_2", simd_level_name(level), gcr_sector_op, &gcr, GCR_ENCODED_SECTOR_SIZE, "nibbles/s");
+        }
+    }
+}
+
+static
+void bench_crc32(size_t size)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "crc32/%zu", size);
+    if (!bench_selected(name)) {
+        return;
+    }
+    uint8_t * buffer = malloc(size);
+    if (!buffer) {
+        fail(name, "", "Out of memory.");
+    }
+    fill_random(buffer, size, 0xC0FFEE);
+
+    uint32_t expected = crc32_update_with_engine(crc32_engine_bytewise, 0, buffer, size);
+    for (int engine = 0; engine < CRC32_ENGINE_COUNT; engine++) {
+        if (engine == crc32_engine_pclmul && !cpu_supports_pclmul()) {
+            continue;
+        }
+        if (crc32_update_with_engine(engine, 0, buffer, size) != expected) {
+            fail(name, crc32_engine_name(engine), "MISMATCH against bytewise CRC");
+        }
+        long ops = 0;
+        double start = now_seconds();
+        double elapsed = 0;
+        uint32_t crc = 0;
+        do {
+            crc = crc32_update_with_engine(engine, crc, buffer, size);
+            ops++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < BENCH_MIN_SECONDS);
+        report(name, crc32_engine_name(engine), elapsed, ops, size / 1e6, "MB/s");
+    }
+
+    // And through the WOZ module's entry point, which uses the best engine.
+    if (woz_crc32(buffer, size) != expected) {
+        fail(name, "woz_crc32", "MISMATCH against bytewise CRC");
+    }
+    long ops = 0;
+    double start = now_seconds();
+    double elapsed = 0;
+    uint32_t sum = 0;
+    do {
+        sum += woz_crc32(buffer, size);
+        ops++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    report(name, "woz_crc32", elapsed, ops, size / 1e6, "MB/s");
+    free(buffer);
+}
+
+typedef struct _bmp_context {
+    uint8_t * bmp;
+    size_t size;
+} bmp_context;
+
+static
+void bmp_rgba_op(void * context)
+{
+    bmp_context * bmp = context;
+    bitmap * bitmap = load_bmp_bytes_into_bitmap(bmp->bmp, bmp->size, NULL);
+    if (!bitmap) {
+        fail("bmp_load", "rgba", "Decode failed.");
+    }
+    free_bitmap(bitmap);
+}
+
+static
+void bmp_luma_op(void * context)
+{
+    bmp_context * bmp = context;
+    luma_bitmap * luma = load_bmp_bytes_into_luma_bitmap(bmp->bmp, bmp->size, NULL);
+    if (!luma) {
+        fail("bmp_load", "luma", "Decode failed.");
+    }
+    free_luma_bitmap(luma);
+}
+
+// Decoding from memory, so the numbers aren't about the file system. Loading from a
+// file only adds the mmap.
+// Every vector row decoder is checked against the scalar one on random rows of every
+// width up to a few vectors, so each way of finishing off a row is covered. The source
+// rows are allocated to size, so a sanitizer build also catches reads past their end,
+// and the bytes after each output row must be left alone.
+static
+void check_truecolor_rows(const char * name, int bits_per_pixel)
+{
+    int bytes_per_pixel = bits_per_pixel / 8;
+    bmp_truecolor_row_fn scalar = bmp_truecolor_row_for_level(simd_level_scalar, bits_per_pixel);
+    uint8_t expected[BENCH_ROW_CHECK_WIDTH * 4 + 32];
+    uint8_t actual[BENCH_ROW_CHECK_WIDTH * 4 + 32];
+    for (int level = 1; level <= (int)cpu_simd_level(); level++) {
+        bmp_truecolor_row_fn vector = bmp_truecolor_row_for_level(level, bits_per_pixel);
+        for (int width = 1; width <= BENCH_ROW_CHECK_WIDTH; width++) {
+            uint8_t * row = malloc((size_t)width * bytes_per_pixel);
+            if (!row) {
+                fail(name, simd_level_name(level), "Out of memory.");
+            }
+            fill_random(row, (size_t)width * bytes_per_pixel, 0xB6A + width);
+            memset(expected, 0xA5, sizeof(expected));
+            memset(actual, 0xA5, sizeof(actual));
+            scalar(expected, row, width);
+            vector(actual, row, width);
+            if (memcmp(expected, actual, sizeof(expected)) != 0) {
+                fail(name, simd_level_name(level), "MISMATCH against scalar output");
+            }
+            free(row);
+        }
+    }
+}
+
+static
+void bench_bmp_load(int dimension, int bits_per_pixel)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "bmp_load/%dbpp/%dx%d", bits_per_pixel, dimension, dimension);
+    if (!bench_selected(name)) {
+        return;
+    }
+    bmp_context bmp;
+    bmp.bmp = create_synthetic_bmp(dimension, dimension, bits_per_pixel, &bmp.size);
+    if (!bmp.bmp) {
+        fail(name, "", "Out of memory.");
+    }
+    if (bits_per_pixel >= 24) {
+        check_truecolor_rows(name, bits_per_pixel);
+    }
+    run_bench(name, "rgba", bmp_rgba_op, &bmp, bmp.size / 1e6, "MB/s");
+    run_bench(name, "luma", bmp_luma_op, &bmp, bmp.size / 1e6, "MB/s");
+    free(bmp.bmp);
+}
+
+typedef struct _write_woz_context {
+    woz_file * woz;
+    const char * path;
+    uint8_t * buffer;
+    size_t size;
+} write_woz_context;
+
+static
+void write_woz_file_op(void * context)
+{
+    write_woz_context * write = context;
+    if (write_woz_to_file(write->woz, write->path) != 0) {
+        fail("write_woz", "file", "Write failed.");
+    }
+}
+
+static
+void write_woz_buffer_op(void * context)
+{
+    write_woz_context * write = context;
+    if (write_woz_to_buffer(write->woz, write->buffer, write->size) != 0) {
+        fail("write_woz", "buffer", "Write failed.");
+    }
+}
+
+// A full-size disk image, with the file CRC, to a temporary file and to memory.
+static
+void bench_write_woz(void)
+{
+    const char * name = "write_woz";
+    if (!bench_selected(name)) {
+        return;
+    }
+    char path[256];
+    const char * temp_dir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/picturedsk-bench-%d.woz", temp_dir ? temp_dir : "/tmp", (int)getpid());
+
+    write_woz_context write;
+    write.woz = create_synthetic_woz();
+    write.path = path;
+    write.size = write.woz ? woz_size_on_disk(write.woz) : 0;
+    write.buffer = malloc(write.size);
+    if (!write.woz || !write.buffer) {
+        fail(name, "", "Out of memory.");
+    }
+    run_bench(name, "file", write_woz_file_op, &write, write.size / 1e6, "MB/s");
+    run_bench(name, "buffer", write_woz_buffer_op, &write, write.size / 1e6, "MB/s");
+    unlink(path);
+    free(write.buffer);
+    free_woz_file(write.woz);
+}
+
+typedef struct _end_to_end_context {
+    picturedsk_context * context;
+    picturedsk_filter filter;
+    picturedsk_dither dither;
+    bmp_context bmp;
+    uint8_t * woz;
+    size_t woz_capacity;
+} end_to_end_context;
+
+static
+void end_to_end_op(void * context)
+{
+    end_to_end_context * run = context;
+    size_t woz_size;
+    picturedsk_options options;
+    picturedsk_default_options(&options);
+    options.message = "BENCHMARK";
+    options.filter = run->filter;
+    options.dither = run->dither;
+    if (picturedsk_bmp_to_woz(run->context, run->bmp.bmp, run->bmp.size, &options,
+                              run->woz, run->woz_capacity, &woz_size) != picturedsk_ok) {
+        fail("picturedsk", "", "Conversion failed.");
+    }
+}
+
+// A whole disk from a 24-bit BMP in memory, with warm caches, as the server makes them.
+static
+void bench_end_to_end(int dimension)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "picturedsk/%dx%d", dimension, dimension);
+    if (!bench_selected(name)) {
+        return;
+    }
+    end_to_end_context run;
+    run.context = picturedsk_create_context(NULL, 1);
+    run.bmp.bmp = create_synthetic_bmp(dimension, dimension, 24, &run.bmp.size);
+    run.woz_capacity = picturedsk_woz_size();
+    run.woz = malloc(run.woz_capacity);
+    if (!run.context || !run.bmp.bmp || !run.woz) {
+        fail(name, "", "Out of memory.");
+    }
+    run.filter = picturedsk_filter_nearest;
+    run.dither = picturedsk_dither_none;
+    run_bench(name, "1 thread", end_to_end_op, &run, 1, "disks/s");
+    run.filter = picturedsk_filter_box;
+    run_bench(name, "1 thread box", end_to_end_op, &run, 1, "disks/s");
+    run.filter = picturedsk_filter_nearest;
+    run.dither = picturedsk_dither_bayer;
+    run_bench(name, "1 thread bayer", end_to_end_op, &run, 1, "disks/s");
+    run.dither = picturedsk_dither_diffusion;
+    run_bench(name, "1 thread diffuse", end_to_end_op, &run, 1, "disks/s");
+
+    // The same disk over and over from a disk cache, checked against making it.
+    char cache_dir[256];
+    const char * temp_dir = getenv("TMPDIR");
+    snprintf(cache_dir, sizeof(cache_dir), "%s/picturedsk-bench-%d.cache", temp_dir ? temp_dir : "/tmp", (int)getpid());
+    run.dither = picturedsk_dither_none;
+    end_to_end_op(&run);
+    uint8_t * expected = malloc(run.woz_capacity);
+    if (!expected) {
+        fail(name, "", "Out of memory.");
+    }
+    memcpy(expected, run.woz, run.woz_capacity);
+    if (picturedsk_set_woz_cache(run.context, cache_dir, 64 * 1024 * 1024) != picturedsk_ok) {
+        fail(name, "cached", "Could not create the cache directory.");
+    }
+    end_to_end_op(&run);
+    memset(run.woz, 0, run.woz_capacity);
+    end_to_end_op(&run);
+    if (memcmp(run.woz, expected, run.woz_capacity) != 0) {
+        fail(name, "cached", "Cached disk differs from a made one.");
+    }
+    run_bench(name, "cached", end_to_end_op, &run, 1, "disks/s");
+    remove_directory(cache_dir);
+    free(expected);
+    free(run.woz);
+    free(run.bmp.bmp);
+    picturedsk_free_context(run.context);
+}
+
+typedef struct _restamp_context {
+    uint8_t * woz;
+    size_t woz_size;
+    const char * path;
+    long count;
+} restamp_context;
+
+static
+void restamp_op(void * context)
+{
+    restamp_context * run = context;
+    const char * message = (run->count++ & 1) ? "BENCHMARK" : "RESTAMPED";
+    if (picturedsk_restamp_woz(run->woz, run->woz_size, message) != picturedsk_ok) {
+        fail("restamp", "", "Restamp failed.");
+    }
+}
+
+static
+void restamp_file_op(void * context)
+{
+    restamp_context * run = context;
+    const char * message = (run->count++ & 1) ? "BENCHMARK" : "RESTAMPED";
+    if (picturedsk_restamp_woz_file(run->path, message) != picturedsk_ok) {
+        fail("restamp", "file", "Restamp failed.");
+    }
+}
+
+// Changing the message of a disk that's already made. The result is checked against
+// making the disk again with the new message.
+static
+void bench_restamp(void)
+{
+    const char * name = "restamp";
+    if (!bench_selected(name)) {
+        return;
+    }
+    picturedsk_context * context = picturedsk_create_context(NULL, 1);
+    size_t bmp_size;
+    uint8_t * bmp = create_synthetic_bmp(256, 256, 24, &bmp_size);
+    uint8_t * expected = NULL;
+    size_t expected_size;
+    restamp_context run;
+    run.count = 0;
+    picturedsk_options options;
+    picturedsk_default_options(&options);
+    options.message = "BENCHMARK";
+    if (!context || !bmp ||
+        picturedsk_bmp_to_woz_alloc(context, bmp, bmp_size, &options, &run.woz, &run.woz_size) != picturedsk_ok) {
+        fail(name, "", "Conversion failed.");
+    }
+    options.message = "RESTAMPED";
+    if (picturedsk_bmp_to_woz_alloc(context, bmp, bmp_size, &options, &expected, &expected_size) != picturedsk_ok) {
+        fail(name, "", "Conversion failed.");
+    }
+    restamp_op(&run);
+    if (run.woz_size != expected_size || memcmp(run.woz, expected, expected_size) != 0) {
+        fail(name, "", "Restamped disk differs from a rebuilt one.");
+    }
+    run_bench(name, "in memory", restamp_op, &run, 1, "disks/s");
+
+    // The same in a file, which is only patched where the message and CRCs change.
+    char path[256];
+    const char * temp_dir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/picturedsk-bench-%d.woz", temp_dir ? temp_dir : "/tmp", (int)getpid());
+    FILE * file = fopen(path, "wb");
+    if (!file || fwrite(expected, 1, expected_size, file) != expected_size || fclose(file) != 0) {
+        fail(name, "file", "Could not write the disk.");
+    }
+    run.path = path;
+    run.count = 1;
+    restamp_file_op(&run);
+    file = fopen(path, "rb");
+    size_t read_size = file ? fread(run.woz, 1, run.woz_size, file) : 0;
+    if (file) {
+        fclose(file);
+    }
+    options.message = "BENCHMARK";
+    picturedsk_free_woz(expected);
+    expected = NULL;
+    if (picturedsk_bmp_to_woz_alloc(context, bmp, bmp_size, &options, &expected, &expected_size) != picturedsk_ok ||
+        read_size != expected_size || memcmp(run.woz, expected, expected_size) != 0) {
+        fail(name, "file", "Restamped file differs from a rebuilt disk.");
+    }
+    run_bench(name, "file", restamp_file_op, &run, 1, "disks/s");
+    unlink(path);
+    picturedsk_free_woz(expected);
+    picturedsk_free_woz(run.woz);
+    free(bmp);
+    picturedsk_free_context(context);
+}
+
+typedef struct _verify_context {
+    const uint8_t * woz;
+    size_t woz_size;
+} verify_context;
+
+static
+void verify_woz_op(void * context)
+{
+    verify_context * run = context;
+    woz_error error = woz_error_none;
+    woz_reader * reader = open_woz_reader_with_bytes(run->woz, run->woz_size, &error);
+    if (!reader || verify_woz_crcs(reader) != woz_error_none) {
+        fail("verify_woz", "", "A good disk failed to verify.");
+    }
+    close_woz_reader(reader);
+}
+
+// Parsing and checking every CRC of a whole disk, in memory.
+static
+void bench_verify_woz(void)
+{
+    const char * name = "verify_woz";
+    if (!bench_selected(name)) {
+        return;
+    }
+    picturedsk_context * context = picturedsk_create_context(NULL, 1);
+    size_t bmp_size;
+    uint8_t * bmp = create_synthetic_bmp(256, 256, 24, &bmp_size);
+    uint8_t * woz = NULL;
+    verify_context run;
+    if (!context || !bmp ||
+        picturedsk_bmp_to_woz_alloc(context, bmp, bmp_size, NULL, &woz, &run.woz_size) != picturedsk_ok) {
+        fail(name, "", "Conversion failed.");
+    }
+    run.woz = woz;
+    run_bench(name, "in memory", verify_woz_op, &run, run.woz_size / 1e6, "MB/s");
+    picturedsk_free_woz(woz);
+    free(bmp);
+    picturedsk_free_context(context);
+}
+
+typedef struct _preview_context {
+    picturedsk_context * context;
+    const uint8_t * woz;
+    size_t woz_size;
+    int size;
+    uint8_t * pixels;
+} preview_context;
+
+static
+void preview_op(void * context)
+{
+    preview_context * run = context;
+    if (picturedsk_woz_to_preview(run->context, run->woz, run->woz_size, run->size, run->pixels) != picturedsk_ok) {
+        fail("preview", "", "Preview failed.");
+    }
+}
+
+// Rendering a flux picture of a whole disk, in memory, on one thread.
+static
+void bench_preview(int size)
+{
+    const char * name = "preview";
+    if (!bench_selected(name)) {
+        return;
+    }
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d", size);
+    picturedsk_context * context = picturedsk_create_context(NULL, 1);
+    size_t bmp_size;
+    uint8_t * bmp = create_synthetic_bmp(256, 256, 24, &bmp_size);
+    uint8_t * woz = NULL;
+    preview_context run;
+    run.context = context;
+    run.size = size;
+    run.pixels = malloc((size_t)size * size);
+    if (!context || !bmp || !run.pixels ||
+        picturedsk_bmp_to_woz_alloc(context, bmp, bmp_size, NULL, &woz, &run.woz_size) != picturedsk_ok) {
+        fail(name, variant, "Conversion failed.");
+    }
+    run.woz = woz;
+    run_bench(name, variant, preview_op, &run, (double)size * size / 1e6, "Mpixels/s");
+    free(run.pixels);
+    picturedsk_free_woz(woz);
+    free(bmp);
+    picturedsk_free_context(context);
+}
+
+//
+// Helpers
+//
+
+static
+void remove_directory(const char * path)
+{
+    DIR * dir = opendir(path);
+    if (dir) {
+        struct dirent * dirent;
+        while ((dirent = readdir(dir)) != NULL) {
+            if (dirent->d_name[0] != '.') {
+                unlinkat(dirfd(dir), dirent->d_name, 0);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static
+void run_bench(const char * name, const char * variant, bench_fn fn, void * context, double units_per_op, const char * unit)
+{
+    // One untimed op first, so lazy setup and cold caches aren't counted.
+    fn(context);
+    long ops = 0;
+    double start = now_seconds();
+    double elapsed = 0;
+    do {
+        fn(context);
+        ops++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    report(name, variant, elapsed, ops, units_per_op, unit);
+}
+
+static
+int bench_selected(const char * name)
+{
+    return !name_filter || strstr(name, name_filter) != NULL;
+}
+
+static
+void report(const char * name, const char * variant, double seconds, long ops, double units_per_op, const char * unit)
+{
+    double ns_per_op = seconds * 1e9 / ops;
+    double rate = units_per_op * ops / seconds;
+    if (json_output) {
+        printf("%s\n  {\"benchmark\": \"%s\", \"variant\": \"%s\", \"ns_per_op\": %.1f, \"rate\": %.6g, \"unit\": \"%s\"}",
+               report_count ? "," : "", name, variant, ns_per_op, rate, unit);
+    } else {
+        printf("%-28s %-10s %14.1f %14.4g %s\n", name, variant, ns_per_op, rate, unit);
+    }
+    fflush(stdout);
+    report_count++;
+}
+
+// Errors go to stderr, so they can't be mistaken for part of the JSON.
+static
+void fail(const char * name, const char * variant, const char * message)
+{
+    fprintf(stderr, "%s %s: %s\n", name, variant, message);
+    exit(1);
+}
+
+static
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Small xorshift generator, so inputs are the same on every run and platform.
+static
+uint32_t next_random(uint32_t * state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static
+void fill_random(uint8_t * buffer, size_t size, uint32_t seed)
+{
+    uint32_t state = seed;
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = next_random(&state) & 0xFF;
+    }
+}
+
+static
+luma_bitmap * create_synthetic_luma(int width, int height)
+{
+    luma_bitmap * luma = create_luma_bitmap(width, height);
+    if (luma) {
+        fill_random(luma->pixels, (size_t)width * height, 0x2021BE11);
+    }
+    return luma;
+}
+
+static
+void store_le16(uint8_t * p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static
+void store_le32(uint8_t * p, uint32_t value)
+{
+    store_le16(p, value & 0xFFFF);
+    store_le16(p + 2, value >> 16);
+}
+
+// A bottom-up v3 BMP of random pixels, with a random palette for the indexed depths.
+static
+uint8_t * create_synthetic_bmp(int width, int height, int bits_per_pixel, size_t * size)
+{
+    int palette_entries = (bits_per_pixel <= 8) ? (1 << bits_per_pixel) : 0;
+    size_t bytes_per_line = (((size_t)width * bits_per_pixel + 31) / 32) * 4;
+    size_t bitmap_offset = 14 + 40 + palette_entries * 4;
+    *size = bitmap_offset + bytes_per_line * height;
+    uint8_t * bmp = calloc(*size, 1);
+    if (!bmp) {
+        return NULL;
+    }
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    store_le32(&bmp[2], (uint32_t)*size);
+    store_le32(&bmp[10], (uint32_t)bitmap_offset);
+    store_le32(&bmp[14], 40);
+    store_le32(&bmp[18], width);
+    store_le32(&bmp[22], height);
+    store_le16(&bmp[26], 1);
+    store_le16(&bmp[28], bits_per_pixel);
+    store_le32(&bmp[34], (uint32_t)(bytes_per_line * height));
+    fill_random(&bmp[54], palette_entries * 4, 0xBADA55);
+    fill_random(&bmp[bitmap_offset], bytes_per_line * height, 0xB17B17);
+    return bmp;
+}
+
+// Chunks the same size as a real disk's, with random contents.
+static
+woz_file * create_synthetic_woz(void)
+{
+    woz_file * woz = create_empty_woz_file();
+    uint8_t * track = malloc(BENCH_TRACK_SIZE);
+    if (!woz || !track) {
+        free_woz_file(woz);
+        free(track);
+        return NULL;
+    }
+    uint8_t info[60];
+    uint8_t tmap[160];
+    uint8_t writ[46 * 20];
+    fill_random(info, sizeof(info), 0x1F0);
+    fill_random(tmap, sizeof(tmap), 0x73A9);
+    fill_random(writ, sizeof(writ), 0x3717);
+    chunk_write_bytes(woz->info, info, sizeof(info));
+    chunk_write_bytes(woz->tmap, tmap, sizeof(tmap));
+    chunk_write_bytes(woz->writ, writ, sizeof(writ));
+    chunk_set_mark(woz->trks, 1280);
+    for (int i = 0; i < 46; i++) {
+        fill_random(track, BENCH_TRACK_SIZE, 0x1000 + i);
+        chunk_write_bytes(woz->trks, track, BENCH_TRACK_SIZE);
+    }
+    free(track);
+    return woz;
+}
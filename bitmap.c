@@ -5,53 +5,173 @@
 //
 
 #include "bitmap.h"
+#include "stats.h"
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
 
 static double sRGB_to_linear(double x);
 static double linear_to_sRGB(double x);
+static void prepare_luma_tables(void);
+static uint8_t linear_to_luma(double grey_linear);
+static uint8_t exact_rgb_to_luma(uint8_t r, uint8_t g, uint8_t b);
+
+// Per-channel sRGB value to weighted linear luma contribution.
+static double luma_weight_red[256];
+static double luma_weight_green[256];
+static double luma_weight_blue[256];
+
+// luma_thresholds[k] is the smallest linear grey value that encodes to sRGB luma k.
+static double luma_thresholds[256];
+static pthread_once_t luma_tables_once = PTHREAD_ONCE_INIT;
+
+// The same weights in fixed point, with LUMA_FIXED_BITS fraction bits. Their sum is
+// within 2 units of the double one, and its top bits index luma_buckets directly.
+// Each bucket holds the luma of every sum that can fall in it, or LUMA_BUCKET_EXACT
+// if a threshold is too close, in which case the pixel is done in doubles. That's
+// under 2% of buckets, and fewer of the pixels of most pictures.
+#define LUMA_FIXED_BITS             28
+#define LUMA_BUCKET_BITS            14
+#define LUMA_BUCKET_SHIFT           (LUMA_FIXED_BITS - LUMA_BUCKET_BITS)
+#define LUMA_BUCKET_COUNT           ((1 << LUMA_BUCKET_BITS) + 2)
+#define LUMA_BUCKET_EXACT           0x100
+static uint32_t luma_fixed_red[256];
+static uint32_t luma_fixed_green[256];
+static uint32_t luma_fixed_blue[256];
+static uint16_t luma_buckets[LUMA_BUCKET_COUNT];
+
+static inline
+uint8_t fast_rgb_to_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+    uint32_t sum = luma_fixed_red[r] + luma_fixed_green[g] + luma_fixed_blue[b];
+    uint16_t luma = luma_buckets[sum >> LUMA_BUCKET_SHIFT];
+    return (luma < LUMA_BUCKET_EXACT) ? (uint8_t)luma : exact_rgb_to_luma(r, g, b);
+}
+
+int bitmap_size_is_supported(int width, int height)
+{
+    return width > 0 && height > 0 &&
+           ((uint64_t)width + 1) * ((uint64_t)height + 1) <= BITMAP_MAX_PIXELS;
+}
 
 bitmap * create_bitmap(int width, int height)
 {
-    bitmap * bitmap = calloc(sizeof(bitmap) + (width * height * 4), 1);
+    bitmap * bitmap = calloc(sizeof(struct _bitmap) + (size_t)width * height * 4, 1);
     if (bitmap) {
         bitmap->width = width;
         bitmap->height = height;
+        STATS_ALLOC((uint64_t)width * height * 4);
     }
     return bitmap;
 }
 
 double sample_bitmap_greyscale(bitmap * bitmap, float u, float v)
 {
-    // u, v are texcoords in the [0, 1] range. tex coords at 1.0 don't overflow, they
-    // get clamped to the final value on that axis, and are equivalent to 1-epsilon.
-    if (u < 0.0) { u = 0.0; }
-    if (u > 1.0) { u = 1.0; }
-    if (v < 0.0) { v = 0.0; }
-    if (v > 1.0) { v = 1.0; }
-    int x = (int)(u * bitmap->width);
-    if (x == bitmap->width) { x = bitmap->width - 1; }
-    int y = (int)(v * bitmap->height);
-    if (y == bitmap->height) { y = bitmap->height - 1; }
-    
     // Alpha channel is just ignored in this operation.
-    int base = BITMAP_PIXEL_BASE(bitmap, x, y);
+    int base = bitmap_texcoord_offset(bitmap->width, bitmap->height, u, v) * 4;
     uint8_t r = bitmap->rgba_pixels[base];
     uint8_t g = bitmap->rgba_pixels[base + 1];
     uint8_t b = bitmap->rgba_pixels[base + 2];
-    
-    double r_linear = sRGB_to_linear(r/255.0);
-    double g_linear = sRGB_to_linear(g/255.0);
-    double b_linear = sRGB_to_linear(b/255.0);
-    double grey_linear = 0.2126 * r_linear + 0.7152 * g_linear + 0.0722 * b_linear;
 
-    return round(linear_to_sRGB(grey_linear));
+    // The sRGB grey value is rounded to the nearest of black or white.
+    return (rgb_to_luma(r, g, b) >= LUMA_THRESHOLD) ? 1.0 : 0.0;
 }
 
 void free_bitmap(bitmap * bitmap)
 {
+    if (bitmap) {
+        STATS_FREE((uint64_t)bitmap->width * bitmap->height * 4);
+    }
     free(bitmap);
 }
 
+luma_bitmap * create_luma_bitmap(int width, int height)
+{
+    luma_bitmap * luma = calloc(sizeof(luma_bitmap) + (size_t)width * height + LUMA_BITMAP_PADDING, 1);
+    if (luma) {
+        luma->width = width;
+        luma->height = height;
+        STATS_ALLOC((uint64_t)width * height + LUMA_BITMAP_PADDING);
+    }
+    return luma;
+}
+
+luma_bitmap * create_luma_bitmap_from_bitmap(bitmap * bitmap)
+{
+    luma_bitmap * luma = create_luma_bitmap(bitmap->width, bitmap->height);
+    if (!luma) {
+        return NULL;
+    }
+    size_t pixel_count = (size_t)bitmap->width * bitmap->height;
+    const uint8_t * rgba = &bitmap->rgba_pixels[0];
+    for (size_t i = 0; i < pixel_count; i++) {
+        luma->pixels[i] = rgb_to_luma(rgba[0], rgba[1], rgba[2]);
+        rgba += 4;
+    }
+    return luma;
+}
+
+void free_luma_bitmap(luma_bitmap * luma)
+{
+    if (luma) {
+        STATS_FREE((uint64_t)luma->width * luma->height + LUMA_BITMAP_PADDING);
+    }
+    free(luma);
+}
+
+luma_sums * create_luma_sums(const luma_bitmap * luma)
+{
+    size_t stride = (size_t)luma->width + 1;
+    size_t size = stride * ((size_t)luma->height + 1) * sizeof(uint32_t);
+    luma_sums * sums = malloc(sizeof(luma_sums) + size);
+    if (!sums) {
+        return NULL;
+    }
+    sums->width = luma->width;
+    sums->height = luma->height;
+    STATS_ALLOC(size);
+
+    // Each row is the running total along the row, plus the row above.
+    memset(sums->sums, 0, stride * sizeof(uint32_t));
+    for (int y = 0; y < luma->height; y++) {
+        const uint8_t * pixels = &luma->pixels[LUMA_PIXEL_BASE(luma, 0, y)];
+        const uint32_t * above = &sums->sums[(size_t)y * stride];
+        uint32_t * row = &sums->sums[(size_t)(y + 1) * stride];
+        uint32_t running = 0;
+        row[0] = 0;
+        for (int x = 0; x < luma->width; x++) {
+            running += pixels[x];
+            row[x + 1] = above[x + 1] + running;
+        }
+    }
+    return sums;
+}
+
+void free_luma_sums(luma_sums * sums)
+{
+    if (sums) {
+        STATS_FREE(((size_t)sums->width + 1) * ((size_t)sums->height + 1) * sizeof(uint32_t));
+    }
+    free(sums);
+}
+
+uint8_t rgb_to_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+    pthread_once(&luma_tables_once, prepare_luma_tables);
+    return fast_rgb_to_luma(r, g, b);
+}
+
+// Converts a row of pixels stored blue first (as in BMP files), with 3 or 4 bytes per
+// pixel, to luma. Any fourth byte is ignored.
+void bgr_row_to_luma(uint8_t * dest, const uint8_t * bgr, int width, int bytes_per_pixel)
+{
+    pthread_once(&luma_tables_once, prepare_luma_tables);
+    for (int x = 0; x < width; x++) {
+        dest[x] = fast_rgb_to_luma(bgr[2], bgr[1], bgr[0]);
+        bgr += bytes_per_pixel;
+    }
+}
+
 //
 // Private colorspace gamma conversion, see
 // https://en.wikipedia.org/wiki/Grayscale#Converting_color_to_grayscale
@@ -73,3 +193,66 @@ double linear_to_sRGB(double y) {
     return 1.055 * pow(y, 1.0 / 2.4) - 0.055;
 }
 
+// Builds the lookup tables that let us go from sRGB components to sRGB luma without
+// calling pow() per pixel. The linear thresholds are nudged to the exact double at
+// which linear_to_sRGB() crosses each rounding boundary, so a table lookup agrees
+// with rounding the result of the direct computation.
+static
+void prepare_luma_tables(void)
+{
+    for (int i = 0; i < 256; i++) {
+        double linear = sRGB_to_linear(i / 255.0);
+        luma_weight_red[i] = 0.2126 * linear;
+        luma_weight_green[i] = 0.7152 * linear;
+        luma_weight_blue[i] = 0.0722 * linear;
+    }
+
+    luma_thresholds[0] = -INFINITY;
+    for (int k = 1; k < 256; k++) {
+        double boundary = (k - 0.5) / 255.0;
+        double t = sRGB_to_linear(boundary);
+        while (t > 0.0 && linear_to_sRGB(nextafter(t, 0.0)) >= boundary) {
+            t = nextafter(t, 0.0);
+        }
+        while (linear_to_sRGB(t) < boundary) {
+            t = nextafter(t, 2.0);
+        }
+        luma_thresholds[k] = t;
+    }
+
+    // The fixed point sum is off by at most 1.5 units from rounding each weight, so a
+    // bucket is only trusted if the luma is the same a few units past both its ends.
+    const double scale = (double)(1 << LUMA_FIXED_BITS);
+    for (int i = 0; i < 256; i++) {
+        luma_fixed_red[i] = (uint32_t)lrint(luma_weight_red[i] * scale);
+        luma_fixed_green[i] = (uint32_t)lrint(luma_weight_green[i] * scale);
+        luma_fixed_blue[i] = (uint32_t)lrint(luma_weight_blue[i] * scale);
+    }
+    const double margin = 4.0 / scale;
+    for (int i = 0; i < LUMA_BUCKET_COUNT; i++) {
+        double low = (double)i / (1 << LUMA_BUCKET_BITS) - margin;
+        double high = (double)(i + 1) / (1 << LUMA_BUCKET_BITS) + margin;
+        uint8_t luma = linear_to_luma(low);
+        luma_buckets[i] = (linear_to_luma(high) == luma) ? luma : LUMA_BUCKET_EXACT;
+    }
+}
+
+static
+uint8_t exact_rgb_to_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+    double grey_linear = luma_weight_red[r] + luma_weight_green[g] + luma_weight_blue[b];
+    return linear_to_luma(grey_linear);
+}
+
+static
+uint8_t linear_to_luma(double grey_linear)
+{
+    // Binary search for the largest k whose threshold is at or below the value.
+    int k = 0;
+    for (int step = 128; step > 0; step >>= 1) {
+        if (grey_linear >= luma_thresholds[k + step]) {
+            k += step;
+        }
+    }
+    return k;
+}
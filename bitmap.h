@@ -4,7 +4,9 @@
 // Copyright (c) 2021 by Ben Zotto
 //
 // This module provides a generic RGBA "bitmap" object, with the ability to sample
-// the image in the manner of a texture map.
+// the image in the manner of a texture map. It also provides a single-channel "luma"
+// bitmap, which is a precomputed greyscale version of an RGBA bitmap that's much
+// cheaper to sample repeatedly, and a summed-area table of one for area sampling.
 //
 
 #ifndef bitmap_h
@@ -27,8 +29,104 @@ typedef struct _bitmap {
 #define BITMAP_BYTES_PER_LINE(b)    ((b)->width * 4)
 #define BITMAP_PIXEL_BASE(b, x, y)  (((y) * BITMAP_BYTES_PER_LINE(b)) + (x) * 4)
 
+// Pixel offsets are ints (and unsigned 32-bit in the polar maps, whose gathers take
+// them as signed), scaled by 4 for RGBA bitmaps, and summed-area tables have an entry
+// more on each side. Images that can't be addressed like that are refused.
+#define BITMAP_MAX_PIXELS           (INT32_MAX / 4)
+
+int bitmap_size_is_supported(int width, int height);
 bitmap * create_bitmap(int width, int height);
 double sample_bitmap_greyscale(bitmap * bitmap, float u, float v);
 void free_bitmap(bitmap * bitmap);
 
+//
+// Greyscale bitmap, in basic y rows of x pixels, one byte per pixel. Each value is the
+// sRGB-encoded luma (0-255) of the original color pixel. Values at or above
+// LUMA_THRESHOLD are "white" when reducing the image to 1-bit.
+//
+
+typedef struct _luma_bitmap {
+    int width;
+    int height;
+    uint8_t pixels[0];
+} luma_bitmap;
+
+#define LUMA_THRESHOLD              128
+#define LUMA_PIXEL_BASE(b, x, y)    (((y) * (b)->width) + (x))
+
+// Luma bitmaps are allocated with this much zeroed slack after the last pixel, so that
+// vectorized samplers can safely load a whole word at any pixel offset.
+#define LUMA_BITMAP_PADDING         4
+
+luma_bitmap * create_luma_bitmap(int width, int height);
+luma_bitmap * create_luma_bitmap_from_bitmap(bitmap * bitmap);
+void free_luma_bitmap(luma_bitmap * luma);
+uint8_t rgb_to_luma(uint8_t r, uint8_t g, uint8_t b);
+void bgr_row_to_luma(uint8_t * dest, const uint8_t * bgr, int width, int bytes_per_pixel);
+
+// Maps (u, v) texcoords in the [0, 1] range to the offset of the nearest pixel in a
+// width x height image. Coords outside the range are clamped, and coords at 1.0 are
+// equivalent to 1-epsilon. This is shared by every sampler so they all agree.
+static inline
+int bitmap_texcoord_offset(int width, int height, float u, float v)
+{
+    if (u < 0.0) { u = 0.0; }
+    if (u > 1.0) { u = 1.0; }
+    if (v < 0.0) { v = 0.0; }
+    if (v > 1.0) { v = 1.0; }
+    int x = (int)(u * width);
+    if (x == width) { x = width - 1; }
+    int y = (int)(v * height);
+    if (y == height) { y = height - 1; }
+    return (y * width) + x;
+}
+
+static inline
+uint8_t sample_luma_bitmap(const luma_bitmap * luma, float u, float v)
+{
+    return luma->pixels[bitmap_texcoord_offset(luma->width, luma->height, u, v)];
+}
+
+//
+// Summed-area table of a luma bitmap, for box filtering. sums has (width + 1) x (height
+// + 1) entries: entry (x, y) is the total luma of the pixels above and to the left of
+// pixel (x, y), so row 0 and column 0 are zero. The sum over any box is then four
+// lookups, whatever its size.
+//
+// The totals are kept modulo 2^32. They overflow for big images, but the differences
+// taken for a box are still exact as long as the box itself totals less than 2^32,
+// which holds for any box of up to 16 million pixels.
+//
+
+typedef struct _luma_sums {
+    int width;
+    int height;
+    uint32_t sums[0];
+} luma_sums;
+
+#define LUMA_SUMS_STRIDE(s)         ((s)->width + 1)
+
+luma_sums * create_luma_sums(const luma_bitmap * luma);
+void free_luma_sums(luma_sums * sums);
+
+// The total luma of the box_width x box_height pixels whose top left pixel's sums
+// entry is at origin.
+static inline
+uint32_t luma_sums_box_total(const uint32_t * sums, size_t stride, uint32_t origin, int box_width, int box_height)
+{
+    const uint32_t * top = &sums[origin];
+    const uint32_t * bottom = &sums[origin + (size_t)box_height * stride];
+    return bottom[box_width] - bottom[0] - top[box_width] + top[0];
+}
+
+// The mean luma over the pixels from (x0, y0) up to but not including (x1, y1), rounded
+// down, so that it's light exactly when the total is at least LUMA_THRESHOLD per pixel.
+static inline
+uint8_t sample_luma_sums(const luma_sums * sums, int x0, int y0, int x1, int y1)
+{
+    size_t stride = LUMA_SUMS_STRIDE(sums);
+    uint32_t total = luma_sums_box_total(sums->sums, stride, y0 * stride + x0, x1 - x0, y1 - y0);
+    return total / ((uint32_t)(x1 - x0) * (uint32_t)(y1 - y0));
+}
+
 #endif /* bitmap_h */
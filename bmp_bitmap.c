@@ -6,7 +6,13 @@
 
 #include <stdint.h>
 #include "bmp_bitmap.h"
-#include "buffered_reader.h"
+#include "mapped_reader.h"
+#include "cpu_features.h"
+#include "stats.h"
+
+#if CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
 
 typedef struct _bmp_file_header {
     uint16_t file_type;
@@ -64,27 +70,249 @@ typedef struct _bmp_header {
     uint32_t reserved;
 } bmp_header;
 
-typedef struct _bmp_palette_element {
-    uint8_t blue;
-    uint8_t green;
-    uint8_t red;
-    uint8_t reserved;
-} bmp_palette_element;
+// A validated file's pixel rows, still in the file's own format, and its palette.
+typedef struct _bmp_pixels {
+    int width;
+    int height;
+    int is_flipped;
+    int bits_per_pixel;
+    size_t bytes_per_line;
+    const uint8_t * data;
+    uint8_t palette[256 * 4];           // RGBA, for indexed formats
+} bmp_pixels;
+
+// Everything a row decoder needs to turn one line of file pixels into RGBA pixels.
+typedef struct _bmp_row_context {
+    const uint8_t * palette;            // RGBA, for indexed formats
+    uint8_t expansion[256 * 8 * 4];     // RGBA pixels for every possible byte, for 1 and 4 bpp
+    bmp_truecolor_row_fn truecolor;     // For 24 and 32 bpp
+} bmp_row_context;
+
+// ... and into luma pixels.
+typedef struct _bmp_luma_row_context {
+    uint8_t palette[256];               // Luma of each palette entry, for indexed formats
+    uint8_t expansion[256 * 8];         // Luma pixels for every possible byte, for 1 and 4 bpp
+} bmp_luma_row_context;
 
-bitmap * load_bmp_into_bitmap(const char * bmp_path)
+typedef void (*bmp_row_decoder)(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context);
+typedef void (*bmp_luma_row_decoder)(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context);
+
+static bitmap * decode_bitmap(mapped_reader * reader, bmp_error * error);
+static luma_bitmap * decode_luma_bitmap(mapped_reader * reader, bmp_error * error);
+static int locate_bmp_pixels(mapped_reader * reader, bmp_pixels * pixels, bmp_error * error);
+static void set_bmp_error(bmp_error * error, bmp_error value);
+static void store_bmp_uint16(uint8_t * p, uint16_t value);
+static void store_bmp_uint32(uint8_t * p, uint32_t value);
+static const uint8_t * bmp_pixels_row(const bmp_pixels * pixels, int y);
+static bmp_row_decoder prepare_row_decoder(bmp_row_context * context, const bmp_pixels * pixels);
+static void decode_row_1(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context);
+static void decode_row_4(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context);
+static void decode_row_8(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context);
+static void decode_row_truecolor(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context);
+static void decode_row_24(uint8_t * dest, const uint8_t * src, int width);
+static void decode_row_32(uint8_t * dest, const uint8_t * src, int width);
+#if CPU_FEATURES_X86
+static void decode_row_24_ssse3(uint8_t * dest, const uint8_t * src, int width);
+static void decode_row_32_ssse3(uint8_t * dest, const uint8_t * src, int width);
+static void decode_row_24_avx2(uint8_t * dest, const uint8_t * src, int width);
+static void decode_row_32_avx2(uint8_t * dest, const uint8_t * src, int width);
+#endif
+static bmp_luma_row_decoder prepare_luma_row_decoder(bmp_luma_row_context * context, const bmp_pixels * pixels);
+static void decode_luma_row_1(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context);
+static void decode_luma_row_4(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context);
+static void decode_luma_row_8(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context);
+static void decode_luma_row_24(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context);
+static void decode_luma_row_32(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context);
+
+bitmap * load_bmp_into_bitmap(const char * bmp_path, bmp_error * error)
 {
-    bitmap * bitmap = NULL;
-    uint8_t * raw_bitmap_data = NULL;
-    
-    buffered_reader * reader = open_buffered_reader(bmp_path, file_endianness_little);
+    mapped_reader * reader = open_mapped_reader(bmp_path, file_endianness_little);
+    if (!reader) {
+        set_bmp_error(error, bmp_error_open_failed);
+        return NULL;
+    }
+    bitmap * bitmap = decode_bitmap(reader, error);
+    close_mapped_reader(reader);
+    return bitmap;
+}
+
+luma_bitmap * load_bmp_into_luma_bitmap(const char * bmp_path, bmp_error * error)
+{
+    mapped_reader * reader = open_mapped_reader(bmp_path, file_endianness_little);
+    if (!reader) {
+        set_bmp_error(error, bmp_error_open_failed);
+        return NULL;
+    }
+    luma_bitmap * luma = decode_luma_bitmap(reader, error);
+    close_mapped_reader(reader);
+    return luma;
+}
+
+bitmap * load_bmp_bytes_into_bitmap(const void * bytes, size_t size, bmp_error * error)
+{
+    mapped_reader * reader = open_mapped_reader_with_bytes(bytes, size, file_endianness_little);
+    if (!reader) {
+        set_bmp_error(error, bmp_error_out_of_memory);
+        return NULL;
+    }
+    bitmap * bitmap = decode_bitmap(reader, error);
+    close_mapped_reader(reader);
+    return bitmap;
+}
+
+luma_bitmap * load_bmp_bytes_into_luma_bitmap(const void * bytes, size_t size, bmp_error * error)
+{
+    mapped_reader * reader = open_mapped_reader_with_bytes(bytes, size, file_endianness_little);
     if (!reader) {
-        printf("Could not open file %s\n", bmp_path);
+        set_bmp_error(error, bmp_error_out_of_memory);
+        return NULL;
+    }
+    luma_bitmap * luma = decode_luma_bitmap(reader, error);
+    close_mapped_reader(reader);
+    return luma;
+}
+
+const char * bmp_error_string(bmp_error error)
+{
+    switch (error) {
+        case bmp_error_none:
+            return "No error";
+        case bmp_error_open_failed:
+            return "Could not open file";
+        case bmp_error_invalid_file:
+            return "Invalid BMP file";
+        case bmp_error_unsupported_version:
+            return "Unsupported BMP version";
+        case bmp_error_unsupported_depth:
+            return "Unsupported BMP bit depth (1, 4, 8, 24 and 32 are supported)";
+        case bmp_error_unsupported_format:
+            return "Unsupported BMP format (only uncompressed, or 32-bit ordered bitfields)";
+        case bmp_error_too_large:
+            return "BMP image is too large";
+        case bmp_error_out_of_memory:
+            return "Failed to allocate bitmap";
+    }
+    return "Unknown error";
+}
+
+// An 8-bit BMP with a grey ramp for its palette, so each pixel's luma is its index.
+// Rows are stored bottom row first, each padded to a multiple of 4 bytes.
+int write_luma_bitmap_to_bmp(const luma_bitmap * luma, const char * bmp_path)
+{
+    FILE * file = fopen(bmp_path, "wb");
+    if (!file) {
+        return -1;
+    }
+    const uint32_t headers_size = 14 + 40 + 256 * 4;
+    uint32_t row_size = ((uint32_t)luma->width + 3) & ~3U;
+    uint32_t image_size = row_size * luma->height;
+    uint8_t headers[14 + 40 + 256 * 4];
+    memset(headers, 0, sizeof(headers));
+    uint8_t * p = headers;
+    const uint32_t fields[] = {
+        // File header: file size, reserved, pixel offset
+        headers_size + image_size, 0, headers_size,
+        // Info header: size, width, height (positive for bottom up)
+        40, luma->width, luma->height,
+    };
+    *p++ = 'B';
+    *p++ = 'M';
+    for (int i = 0; i < 6; i++) {
+        store_bmp_uint32(p, fields[i]);
+        p += 4;
+    }
+    store_bmp_uint16(p, 1);             // Planes
+    store_bmp_uint16(p + 2, 8);         // Bits per pixel
+    store_bmp_uint32(p + 4, 0);         // Uncompressed
+    store_bmp_uint32(p + 8, image_size);
+    store_bmp_uint32(p + 12, 2835);     // 72 DPI, in pixels per meter
+    store_bmp_uint32(p + 16, 2835);
+    store_bmp_uint32(p + 20, 256);      // Palette entries
+    store_bmp_uint32(p + 24, 0);        // All of them important
+    p += 28;
+    for (int i = 0; i < 256; i++) {
+        p[0] = p[1] = p[2] = i;
+        p += 4;
+    }
+
+    int ok = fwrite(headers, 1, sizeof(headers), file) == sizeof(headers);
+    const uint8_t padding[3] = { 0, 0, 0 };
+    for (int y = luma->height - 1; y >= 0 && ok; y--) {
+        ok = fwrite(&luma->pixels[LUMA_PIXEL_BASE(luma, 0, y)], 1, luma->width, file) == (size_t)luma->width &&
+             fwrite(padding, 1, row_size - luma->width, file) == row_size - luma->width;
+    }
+    ok = (fclose(file) == 0) && ok;
+    return ok ? 0 : -2;
+}
+
+//
+// Decoding, from a reader over the whole file.
+//
+
+static
+bitmap * decode_bitmap(mapped_reader * reader, bmp_error * error)
+{
+    STATS_PHASE_START(start);
+    bmp_pixels pixels;
+    if (!locate_bmp_pixels(reader, &pixels, error)) {
         return NULL;
     }
 
+    bitmap * bitmap = create_bitmap(pixels.width, pixels.height);
+    if (!bitmap) {
+        set_bmp_error(error, bmp_error_out_of_memory);
+        return NULL;
+    }
+
+    // Pick the row decoder for this pixel format once, up front.
+    bmp_row_context context;
+    bmp_row_decoder decode_row = prepare_row_decoder(&context, &pixels);
+    for (int y = 0; y < pixels.height; y++) {
+        decode_row(&bitmap->rgba_pixels[(size_t)y * BITMAP_BYTES_PER_LINE(bitmap)],
+                   bmp_pixels_row(&pixels, y), pixels.width, &context);
+    }
+    STATS_PHASE_END(start, stats_phase_bmp_decode, reader->total_size);
+    return bitmap;
+}
+
+static
+luma_bitmap * decode_luma_bitmap(mapped_reader * reader, bmp_error * error)
+{
+    STATS_PHASE_START(start);
+    bmp_pixels pixels;
+    if (!locate_bmp_pixels(reader, &pixels, error)) {
+        return NULL;
+    }
+
+    luma_bitmap * luma = create_luma_bitmap(pixels.width, pixels.height);
+    if (!luma) {
+        set_bmp_error(error, bmp_error_out_of_memory);
+        return NULL;
+    }
+
+    bmp_luma_row_context context;
+    bmp_luma_row_decoder decode_row = prepare_luma_row_decoder(&context, &pixels);
+    for (int y = 0; y < pixels.height; y++) {
+        decode_row(&luma->pixels[LUMA_PIXEL_BASE(luma, (size_t)0, (size_t)y)],
+                   bmp_pixels_row(&pixels, y), pixels.width, &context);
+    }
+    STATS_PHASE_END(start, stats_phase_bmp_decode, reader->total_size);
+    return luma;
+}
+
+//
+// Header parsing, shared by both kinds of output.
+//
+
+// Validates the file, and locates its palette and pixel rows. The rows point into the
+// reader's bytes, so it must stay open while they're in use. Returns 1 on success, or 0
+// (with the reason in *error) if the file can't be used.
+static
+int locate_bmp_pixels(mapped_reader * reader, bmp_pixels * pixels, bmp_error * error)
+{
     // Ensure the file header
-    if (!buffered_reader_ensure_remaining(reader, 18)) {
-        printf("Invalid BMP file\n");
+    if (!mapped_reader_ensure_remaining(reader, 18)) {
+        set_bmp_error(error, bmp_error_invalid_file);
         goto Error;
     }
     
@@ -96,14 +324,14 @@ bitmap * load_bmp_into_bitmap(const char * bmp_path)
     file_header.bitmap_offset = read_uint32(reader);
     
     // Ensure the entire file size
-    if (!buffered_reader_ensure_remaining(reader, file_header.file_size - 18)) {
-        printf("Invalid BMP file\n");
+    if (!mapped_reader_ensure_remaining(reader, file_header.file_size - 18)) {
+        set_bmp_error(error, bmp_error_invalid_file);
         goto Error;
     }
     
     // "BM" (as chars, not a little-endian uint16, so compare to a flipped version)
     if (file_header.file_type != 0x4D42 || file_header.file_size != reader->total_size) {
-        printf("Invalid BMP file\n");
+        set_bmp_error(error, bmp_error_invalid_file);
         goto Error;
     }
         
@@ -111,7 +339,7 @@ bitmap * load_bmp_into_bitmap(const char * bmp_path)
     if (bitmap_header_size != BMP_HEADER_SIZE_V3 &&
         bitmap_header_size != BMP_HEADER_SIZE_V4 &&
         bitmap_header_size != BMP_HEADER_SIZE_V5) {
-        printf("Unsupported BMP version\n");
+        set_bmp_error(error, bmp_error_unsupported_version);
         goto Error;
     }
     
@@ -172,7 +400,7 @@ bitmap * load_bmp_into_bitmap(const char * bmp_path)
     if (header.bits_per_pixel != 1 && header.bits_per_pixel != 4 &&
         header.bits_per_pixel != 8 && header.bits_per_pixel != 24 &&
         header.bits_per_pixel != 32) {
-        printf("%d-bit BMP not supported\n", header.bits_per_pixel);
+        set_bmp_error(error, bmp_error_unsupported_depth);
         goto Error;
     }
     
@@ -180,16 +408,16 @@ bitmap * load_bmp_into_bitmap(const char * bmp_path)
     // 32-bit "bitfields" format.
     if (header.compression == bmp_compression_bitfields) {
         if (header.bits_per_pixel != 32) {
-            printf("Unsupported BMP format (%d-bit bitfields)\n", header.bits_per_pixel);
+            set_bmp_error(error, bmp_error_unsupported_format);
             goto Error;
         }
         if (header.red_mask != 0x00FF0000 || header.green_mask != 0x0000FF00 ||
             header.blue_mask != 0x000000FF || header.alpha_mask != 0xFF000000) {
-            printf("Unsupported BMP format (unordered bitfields)\n");
+            set_bmp_error(error, bmp_error_unsupported_format);
             goto Error;
         }
     } else if (header.compression != bmp_compression_none) {
-        printf("Only uncompressed BMP formats supported\n");
+        set_bmp_error(error, bmp_error_unsupported_format);
         goto Error;
     }
     
@@ -203,157 +431,370 @@ bitmap * load_bmp_into_bitmap(const char * bmp_path)
         }
     }
     
-    // 256 is the max number of possible palette entries (= 8pp),
-    // only palette_entries will be valid.
-    bmp_palette_element palette[256];
+    // 256 is the max number of possible palette entries (= 8pp). Entries past
+    // palette_entries stay zero, which is what an out-of-range pixel index decodes to.
+    if (palette_entries > 256) {
+        palette_entries = 256;
+    }
+    memset(pixels->palette, 0, sizeof(pixels->palette));
     for (int i = 0; i < palette_entries; i++) {
-        palette[i].blue = read_uint8(reader);
-        palette[i].green = read_uint8(reader);
-        palette[i].red = read_uint8(reader);
-        palette[i].reserved = read_uint8(reader);
+        uint8_t blue = read_uint8(reader);
+        uint8_t green = read_uint8(reader);
+        uint8_t red = read_uint8(reader);
+        /* reserved */ read_uint8(reader);
+        pixels->palette[i * 4 + 0] = red;
+        pixels->palette[i * 4 + 1] = green;
+        pixels->palette[i * 4 + 2] = blue;
+        pixels->palette[i * 4 + 3] = 0xFF;
     }
     
     // Fast forward to the bitmap data itself. We're usually already pointing at it,
     // but on the off chance this is v5 bitmap that has some embedded color profile
     // data, and they chose to stick it between the header and the bitmap data, well,
     // this should skip over it.
-    buffered_reader_advance_to_offset(reader, file_header.bitmap_offset);
+    mapped_reader_advance_to_offset(reader, file_header.bitmap_offset);
     
     // We are now pointing at the bitmap data itself. Walk the lines, and unpack
     // indexed colors as necessary.
     int width = header.width;
-    int height = (header.height > 0) ? header.height : header.height * -1;
+    // INT32_MIN has no positive counterpart, so it's as invalid as zero.
+    int height = (header.height > 0) ? header.height : (header.height > INT32_MIN) ? header.height * -1 : 0;
     int is_flipped = header.height < 0;
+    if (width <= 0 || height <= 0) {
+        set_bmp_error(error, bmp_error_invalid_file);
+        goto Error;
+    }
+    if (!bitmap_size_is_supported(width, height)) {
+        set_bmp_error(error, bmp_error_too_large);
+        goto Error;
+    }
 
     // Figure out how many bytes in one "scan line" (stride) of the image data. Always
     // aligned to 4-byte boundaries.
-    int bits_per_line = header.bits_per_pixel * width;
+    size_t bits_per_line = (size_t)header.bits_per_pixel * width;
     if (bits_per_line % 32 != 0) {
         bits_per_line += (32 - bits_per_line % 32);
     }
     
-    int bytes_per_line = bits_per_line / 8;
+    size_t bytes_per_line = bits_per_line / 8;
 
     // Final sanity check to make sure that enough bytes remain in the file to meet
-    // our needs here.
+    // our needs here. The pixel rows are then decoded in place, straight out of the file.
     size_t raw_bitmap_size = bytes_per_line * height;
-    if (!buffered_reader_ensure_remaining(reader, raw_bitmap_size)) {
-        printf("Invalid BMP file\n");
-        close_buffered_reader(reader);
-        return NULL;
-    }
-    
-    // Yank out the whole bitmap region.
-    raw_bitmap_data = malloc(raw_bitmap_size);
+    const uint8_t * raw_bitmap_data = read_span(reader, raw_bitmap_size);
     if (!raw_bitmap_data) {
-        printf("Failed to allocate bitmap data\n");
+        set_bmp_error(error, bmp_error_invalid_file);
         goto Error;
-
     }
-    read_bytes(reader, raw_bitmap_data, raw_bitmap_size);
     
-    bitmap = create_bitmap(width, height);
-    if (!bitmap) {
-        printf("Failed to allocate bitmap\n");
-        goto Error;
+    pixels->width = width;
+    pixels->height = height;
+    pixels->is_flipped = is_flipped;
+    pixels->bits_per_pixel = header.bits_per_pixel;
+    pixels->bytes_per_line = bytes_per_line;
+    pixels->data = raw_bitmap_data;
+    return 1;
+
+Error:
+    return 0;
+}
+
+static
+void set_bmp_error(bmp_error * error, bmp_error value)
+{
+    if (error) {
+        *error = value;
     }
+}
 
-    // Loop through the bitmap. Note that this is looping through the *output* pixels,
-    // and the bitmap file may not be "flipped" (ie, first line first)
-    for (int y = 0; y < height; y++) {
-        uint8_t * line_base = is_flipped ? (raw_bitmap_data + (y * bytes_per_line)) :
-            (raw_bitmap_data + ((height - 1 - y) * bytes_per_line));
-        uint8_t * next_pixel_start = line_base;
-        int x = 0;
-        while (x < width) {
-            uint8_t byte = *next_pixel_start;
-            uint8_t pixel_palette_indexes[8];          // only used for 1, 4, 8 bit
-            uint8_t rgba[4];                           // only used for 24, 32 bit.
-            switch (header.bits_per_pixel) {
-                case 1:
-                {
-                    for (int p = 7; p >= 0; p--) {
-                        pixel_palette_indexes[p] = (byte >> p) & 0x01;
-                    }
-                    next_pixel_start++;
-                    break;
-                }
-                case 4:
-                {
-                    pixel_palette_indexes[0] = (byte >> 4) & 0x0F;
-                    pixel_palette_indexes[1] = byte & 0x0F;
-                    next_pixel_start++;
-                    break;
-                }
-                case 8:
-                {
-                    pixel_palette_indexes[0] = byte;
-                    next_pixel_start++;
-                    break;
-                }
-                case 24:
-                {
-                    // Stored in BGR order
-                    rgba[3] = 0xFF;
-                    rgba[2] = *(next_pixel_start + 0);
-                    rgba[1] = *(next_pixel_start + 1);
-                    rgba[0] = *(next_pixel_start + 2);
-                    next_pixel_start += 3;
-                    break;
-                }
-                case 32:
-                {
-                    // We expect this to be in BGRA order, which is the default in the non-compressed
-                    // format as well as the only "bitfields" ordering we support.
-                    rgba[2] = *(next_pixel_start + 0);
-                    rgba[1] = *(next_pixel_start + 1);
-                    rgba[0] = *(next_pixel_start + 2);
-                    rgba[3] = *(next_pixel_start + 3);
-                    next_pixel_start += 4;
-                    break;
-                }
-                default:
-                    // Unreachable. We already validated the value set above.
-                    break;
-            }
-            
-            if (header.bits_per_pixel < 16) {
-                // We have one or more palette indexes to indirect through.
-                for (int i = 0; i < (8 / header.bits_per_pixel); i++) {
-                    uint8_t index = pixel_palette_indexes[i];
-                    if (index < palette_entries) {
-                        int pixel_base = BITMAP_PIXEL_BASE(bitmap, x, y);
-                        bitmap->rgba_pixels[pixel_base] = palette[index].red;
-                        bitmap->rgba_pixels[pixel_base + 1] = palette[index].green;
-                        bitmap->rgba_pixels[pixel_base + 2] = palette[index].blue;
-                        bitmap->rgba_pixels[pixel_base + 3] = 0xFF;
-                    }
-                    // Advance the destination past this pixel and continue with this
-                    // cluster.
-                    x++;
+static
+void store_bmp_uint16(uint8_t * p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static
+void store_bmp_uint32(uint8_t * p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+// Returns the file row for output row y. The file rows are bottom-up unless the
+// bitmap is "flipped" (ie, first line first).
+static
+const uint8_t * bmp_pixels_row(const bmp_pixels * pixels, int y)
+{
+    int file_row = pixels->is_flipped ? y : (pixels->height - 1 - y);
+    return pixels->data + ((size_t)file_row * pixels->bytes_per_line);
+}
+
+//
+// Row decoders. Each one converts one line of file pixels, in the file's own format, to
+// a line of RGBA output pixels.
+//
+
+static
+bmp_row_decoder prepare_row_decoder(bmp_row_context * context, const bmp_pixels * pixels)
+{
+    int bits_per_pixel = pixels->bits_per_pixel;
+    context->palette = pixels->palette;
+    switch (bits_per_pixel) {
+        case 1:
+        case 4:
+        {
+            // Precompute the pixels each possible byte expands to, leftmost pixel in the
+            // most significant bits.
+            int pixels_per_byte = 8 / bits_per_pixel;
+            int index_mask = (1 << bits_per_pixel) - 1;
+            for (int byte = 0; byte < 256; byte++) {
+                uint8_t * entry = &context->expansion[byte * pixels_per_byte * 4];
+                for (int p = 0; p < pixels_per_byte; p++) {
+                    int index = (byte >> (8 - bits_per_pixel * (p + 1))) & index_mask;
+                    memcpy(&entry[p * 4], &context->palette[index * 4], 4);
                 }
-            } else {
-                // We have computed the value of one pixel, write it.
-                int pixel_base = BITMAP_PIXEL_BASE(bitmap, x, y);
-                bitmap->rgba_pixels[pixel_base] = rgba[0];
-                bitmap->rgba_pixels[pixel_base + 1] = rgba[1];
-                bitmap->rgba_pixels[pixel_base + 2] = rgba[2];
-                bitmap->rgba_pixels[pixel_base + 3] = rgba[3];
-                x++;
             }
+            return (bits_per_pixel == 1) ? decode_row_1 : decode_row_4;
         }
+        case 8:
+            return decode_row_8;
+        default:
+            context->truecolor = bmp_truecolor_row_for_level(cpu_simd_level(), bits_per_pixel);
+            return decode_row_truecolor;
     }
-    
-    goto Done;
-    
-Error:
-    if (bitmap) {
-        free_bitmap(bitmap);
+}
+
+bmp_truecolor_row_fn bmp_truecolor_row_for_level(simd_level level, int bits_per_pixel)
+{
+#if CPU_FEATURES_X86
+    switch (level) {
+        case simd_level_avx2:
+            return (bits_per_pixel == 24) ? decode_row_24_avx2 : decode_row_32_avx2;
+        case simd_level_sse4_1:
+            return (bits_per_pixel == 24) ? decode_row_24_ssse3 : decode_row_32_ssse3;
+        default:
+            break;
+    }
+#else
+    (void)level;
+#endif
+    return (bits_per_pixel == 24) ? decode_row_24 : decode_row_32;
+}
+
+// Copies whole expanded bytes, then just the pixels that are left over in the last one.
+static inline
+void expand_packed_row(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context, int pixels_per_byte)
+{
+    int entry_size = pixels_per_byte * 4;
+    int whole_bytes = width / pixels_per_byte;
+    for (int i = 0; i < whole_bytes; i++) {
+        memcpy(&dest[i * entry_size], &context->expansion[src[i] * entry_size], entry_size);
     }
-Done:
-    if (raw_bitmap_data) {
-        free(raw_bitmap_data);
+    int remaining = width % pixels_per_byte;
+    if (remaining) {
+        memcpy(&dest[whole_bytes * entry_size], &context->expansion[src[whole_bytes] * entry_size], remaining * 4);
     }
-    close_buffered_reader(reader);
-    return bitmap;
+}
+
+static
+void decode_row_1(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context)
+{
+    expand_packed_row(dest, src, width, context, 8);
+}
+
+static
+void decode_row_4(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context)
+{
+    expand_packed_row(dest, src, width, context, 2);
+}
+
+static
+void decode_row_8(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context)
+{
+    for (int x = 0; x < width; x++) {
+        memcpy(&dest[x * 4], &context->palette[src[x] * 4], 4);
+    }
+}
+
+static
+void decode_row_truecolor(uint8_t * dest, const uint8_t * src, int width, const bmp_row_context * context)
+{
+    context->truecolor(dest, src, width);
+}
+
+static
+void decode_row_24(uint8_t * dest, const uint8_t * src, int width)
+{
+    // Stored in BGR order
+    for (int x = 0; x < width; x++) {
+        dest[x * 4 + 0] = src[x * 3 + 2];
+        dest[x * 4 + 1] = src[x * 3 + 1];
+        dest[x * 4 + 2] = src[x * 3 + 0];
+        dest[x * 4 + 3] = 0xFF;
+    }
+}
+
+static
+void decode_row_32(uint8_t * dest, const uint8_t * src, int width)
+{
+    // We expect this to be in BGRA order, which is the default in the non-compressed
+    // format as well as the only "bitfields" ordering we support.
+    for (int x = 0; x < width; x++) {
+        dest[x * 4 + 0] = src[x * 4 + 2];
+        dest[x * 4 + 1] = src[x * 4 + 1];
+        dest[x * 4 + 2] = src[x * 4 + 0];
+        dest[x * 4 + 3] = src[x * 4 + 3];
+    }
+}
+
+#if CPU_FEATURES_X86
+
+// The vector decoders do the bulk of the row with byte shuffles, and let the scalar
+// decoders finish off the last few pixels. The 24-bit versions load 16 bytes for every
+// 12 they use, so they stop early enough that they never read past the end of the row.
+
+#define BGR_TO_RGBA_SHUFFLE     2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+#define BGRA_TO_RGBA_SHUFFLE    2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+
+__attribute__((target("ssse3")))
+static
+void decode_row_24_ssse3(uint8_t * dest, const uint8_t * src, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(BGR_TO_RGBA_SHUFFLE);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    int x = 0;
+    for (; x + 6 <= width; x += 4) {
+        __m128i bgr = _mm_loadu_si128((const __m128i *)&src[x * 3]);
+        __m128i rgba = _mm_or_si128(_mm_shuffle_epi8(bgr, shuffle), alpha);
+        _mm_storeu_si128((__m128i *)&dest[x * 4], rgba);
+    }
+    decode_row_24(&dest[x * 4], &src[x * 3], width - x);
+}
+
+__attribute__((target("ssse3")))
+static
+void decode_row_32_ssse3(uint8_t * dest, const uint8_t * src, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(BGRA_TO_RGBA_SHUFFLE);
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i bgra = _mm_loadu_si128((const __m128i *)&src[x * 4]);
+        _mm_storeu_si128((__m128i *)&dest[x * 4], _mm_shuffle_epi8(bgra, shuffle));
+    }
+    decode_row_32(&dest[x * 4], &src[x * 4], width - x);
+}
+
+__attribute__((target("avx2")))
+static
+void decode_row_24_avx2(uint8_t * dest, const uint8_t * src, int width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(BGR_TO_RGBA_SHUFFLE, BGR_TO_RGBA_SHUFFLE);
+    const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+    int x = 0;
+    for (; x + 10 <= width; x += 8) {
+        // Four pixels into each 128-bit lane, since the shuffle can't cross lanes.
+        __m128i low = _mm_loadu_si128((const __m128i *)&src[x * 3]);
+        __m128i high = _mm_loadu_si128((const __m128i *)&src[x * 3 + 12]);
+        __m256i bgr = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        __m256i rgba = _mm256_or_si256(_mm256_shuffle_epi8(bgr, shuffle), alpha);
+        _mm256_storeu_si256((__m256i *)&dest[x * 4], rgba);
+    }
+    decode_row_24(&dest[x * 4], &src[x * 3], width - x);
+}
+
+__attribute__((target("avx2")))
+static
+void decode_row_32_avx2(uint8_t * dest, const uint8_t * src, int width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(BGRA_TO_RGBA_SHUFFLE, BGRA_TO_RGBA_SHUFFLE);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i bgra = _mm256_loadu_si256((const __m256i *)&src[x * 4]);
+        _mm256_storeu_si256((__m256i *)&dest[x * 4], _mm256_shuffle_epi8(bgra, shuffle));
+    }
+    decode_row_32(&dest[x * 4], &src[x * 4], width - x);
+}
+
+#endif
+
+//
+// Luma row decoders. Each one converts one line of file pixels straight to a line of
+// luma pixels, without going through RGBA.
+//
+
+static
+bmp_luma_row_decoder prepare_luma_row_decoder(bmp_luma_row_context * context, const bmp_pixels * pixels)
+{
+    int bits_per_pixel = pixels->bits_per_pixel;
+    if (bits_per_pixel > 8) {
+        return (bits_per_pixel == 24) ? decode_luma_row_24 : decode_luma_row_32;
+    }
+
+    // Indexed images only ever have 256 colors at most, so convert those once.
+    for (int i = 0; i < 256; i++) {
+        const uint8_t * rgba = &pixels->palette[i * 4];
+        context->palette[i] = rgb_to_luma(rgba[0], rgba[1], rgba[2]);
+    }
+    if (bits_per_pixel == 8) {
+        return decode_luma_row_8;
+    }
+    int pixels_per_byte = 8 / bits_per_pixel;
+    int index_mask = (1 << bits_per_pixel) - 1;
+    for (int byte = 0; byte < 256; byte++) {
+        for (int p = 0; p < pixels_per_byte; p++) {
+            int index = (byte >> (8 - bits_per_pixel * (p + 1))) & index_mask;
+            context->expansion[byte * pixels_per_byte + p] = context->palette[index];
+        }
+    }
+    return (bits_per_pixel == 1) ? decode_luma_row_1 : decode_luma_row_4;
+}
+
+static inline
+void expand_packed_luma_row(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context, int pixels_per_byte)
+{
+    int whole_bytes = width / pixels_per_byte;
+    for (int i = 0; i < whole_bytes; i++) {
+        memcpy(&dest[i * pixels_per_byte], &context->expansion[src[i] * pixels_per_byte], pixels_per_byte);
+    }
+    int remaining = width % pixels_per_byte;
+    if (remaining) {
+        memcpy(&dest[whole_bytes * pixels_per_byte], &context->expansion[src[whole_bytes] * pixels_per_byte], remaining);
+    }
+}
+
+static
+void decode_luma_row_1(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context)
+{
+    expand_packed_luma_row(dest, src, width, context, 8);
+}
+
+static
+void decode_luma_row_4(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context)
+{
+    expand_packed_luma_row(dest, src, width, context, 2);
+}
+
+static
+void decode_luma_row_8(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context)
+{
+    for (int x = 0; x < width; x++) {
+        dest[x] = context->palette[src[x]];
+    }
+}
+
+static
+void decode_luma_row_24(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context)
+{
+    (void)context;
+    bgr_row_to_luma(dest, src, width, 3);
+}
+
+static
+void decode_luma_row_32(uint8_t * dest, const uint8_t * src, int width, const bmp_luma_row_context * context)
+{
+    (void)context;
+    bgr_row_to_luma(dest, src, width, 4);
 }
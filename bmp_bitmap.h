@@ -4,10 +4,11 @@
 // Copyright (c) 2021 by Ben Zotto
 //
 // This module provides basic functionality for reading Windows-style BMP bitmap
-// image files and producing a plain RGBA buffer of pixel values. Only a subset of
+// image files and producing a plain RGBA buffer of pixel values, or (more cheaply)
+// a greyscale luma buffer directly. Only a subset of
 // BMP formats are supported: 1, 4, 8, 24, 32 bits per pixel, uncompressed, in the
 // BMP v3 or v4 file format styles. This covers most standard generic BMP conversion
-// output.
+// output. Luma bitmaps can also be written out, as 8-bit greyscale BMPs.
 //
 
 #ifndef bmp_bitmap_h
@@ -15,7 +16,33 @@
 
 #include <stdio.h>
 #include "bitmap.h"
+#include "cpu_features.h"
 
-bitmap * load_bmp_into_bitmap(const char * bmp_path);
+typedef enum _bmp_error {
+    bmp_error_none = 0,
+    bmp_error_open_failed,
+    bmp_error_invalid_file,
+    bmp_error_unsupported_version,
+    bmp_error_unsupported_depth,
+    bmp_error_unsupported_format,
+    bmp_error_too_large,
+    bmp_error_out_of_memory
+} bmp_error;
+
+// These return NULL on failure, with the reason in *error (if error is non-NULL). They
+// print nothing themselves, and are safe to call from several threads at once.
+bitmap * load_bmp_into_bitmap(const char * bmp_path, bmp_error * error);
+luma_bitmap * load_bmp_into_luma_bitmap(const char * bmp_path, bmp_error * error);
+bitmap * load_bmp_bytes_into_bitmap(const void * bytes, size_t size, bmp_error * error);
+luma_bitmap * load_bmp_bytes_into_luma_bitmap(const void * bytes, size_t size, bmp_error * error);
+const char * bmp_error_string(bmp_error error);
+
+// Converts a row of 24- or 32-bit BMP pixels (blue first) to RGBA, with the version of
+// the decoder for a SIMD level. All versions give the same result.
+typedef void (*bmp_truecolor_row_fn)(uint8_t * dest, const uint8_t * src, int width);
+bmp_truecolor_row_fn bmp_truecolor_row_for_level(simd_level level, int bits_per_pixel);
+
+// Returns 0 on success, -1 if the file couldn't be created, or -2 if writing it failed.
+int write_luma_bitmap_to_bmp(const luma_bitmap * luma, const char * bmp_path);
 
 #endif /* bmp_bitmap_h */
@@ -0,0 +1,43 @@
+//
+// cpu_features.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "cpu_features.h"
+
+simd_level cpu_simd_level(void)
+{
+#if CPU_FEATURES_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return simd_level_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3")) {
+        return simd_level_sse4_1;
+    }
+#endif
+    return simd_level_scalar;
+}
+
+int cpu_supports_pclmul(void)
+{
+#if CPU_FEATURES_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+    return 0;
+#endif
+}
+
+const char * simd_level_name(simd_level level)
+{
+    switch (level) {
+        case simd_level_avx2:
+            return "avx2";
+        case simd_level_sse4_1:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
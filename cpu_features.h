@@ -0,0 +1,33 @@
+//
+// cpu_features.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module detects, at runtime, which vector instruction sets the CPU supports, so
+// that hot loops can pick the best implementation available. Vectorized routines are
+// compiled per-function with target attributes, so the rest of the program still runs
+// on any CPU. On non-x86 builds everything falls back to the plain C versions.
+//
+
+#ifndef cpu_features_h
+#define cpu_features_h
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_FEATURES_X86    1
+#else
+#define CPU_FEATURES_X86    0
+#endif
+
+typedef enum _simd_level {
+    simd_level_scalar = 0,
+    simd_level_sse4_1 = 1,      // Also implies SSSE3
+    simd_level_avx2 = 2
+} simd_level;
+
+#define SIMD_LEVEL_COUNT    3
+
+simd_level cpu_simd_level(void);
+int cpu_supports_pclmul(void);
+const char * simd_level_name(simd_level level);
+
+#endif /* cpu_features_h */
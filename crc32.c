@@ -0,0 +1,380 @@
+//
+// crc32.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "crc32.h"
+#include "cpu_features.h"
+#include <pthread.h>
+
+#if CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
+
+// Buffers shorter than this aren't worth setting up the folding for.
+#define CRC32_PCLMUL_MIN_SIZE   64
+
+// The bit-reflected CRC-32 polynomial.
+#define CRC32_POLYNOMIAL        0xEDB88320
+
+static void prepare_slicing_tables(void);
+static void prepare_power_table(void);
+static void choose_best_engine(void);
+static uint32_t multiply_mod_p(uint32_t a, uint32_t b);
+static uint32_t x_to_8n_mod_p(size_t n);
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t * p, size_t size);
+static uint32_t crc32_slicing_8(uint32_t crc, const uint8_t * p, size_t size);
+static uint32_t crc32_slicing_16(uint32_t crc, const uint8_t * p, size_t size);
+#if CPU_FEATURES_X86
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t * p, size_t size);
+#endif
+
+#define LOAD_LE32(p)    ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+//
+// CRC table.
+// Gary S. Brown, 1986.
+// Copied from https://applesaucefdc.com/woz/reference2/
+//
+
+static const uint32_t crc32_tab[] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+// slicing_tab[k][i] is the CRC of byte i followed by k zero bytes. Table 0 is crc32_tab.
+static uint32_t slicing_tab[16][256];
+static pthread_once_t slicing_tables_once = PTHREAD_ONCE_INIT;
+
+// power_tab[k] is x^(2^k) mod P, for shifting a CRC register forward by whole bytes.
+static uint32_t power_tab[32];
+static pthread_once_t power_table_once = PTHREAD_ONCE_INIT;
+
+// Checked once, since the CPU can't change under us and the check isn't free.
+static int has_pclmul;
+static crc32_engine best_engine;
+static pthread_once_t best_engine_once = PTHREAD_ONCE_INIT;
+
+//
+// Public routines
+//
+
+uint32_t crc32_update(uint32_t crc, const void * buf, size_t size)
+{
+    pthread_once(&best_engine_once, choose_best_engine);
+    return crc32_update_with_engine(best_engine, crc, buf, size);
+}
+
+uint32_t crc32_update_with_engine(crc32_engine engine, uint32_t crc, const void * buf, size_t size)
+{
+    // Internally the engines work on the raw CRC register, which is the complement of
+    // the finished CRC value.
+    const uint8_t * p = buf;
+    uint32_t reg = crc ^ ~0U;
+    switch (engine) {
+#if CPU_FEATURES_X86
+        case crc32_engine_pclmul:
+            pthread_once(&best_engine_once, choose_best_engine);
+            if (has_pclmul) {
+                reg = crc32_pclmul(reg, p, size);
+                break;
+            }
+            // Without it, use the fastest table engine.
+            __attribute__((fallthrough));
+#endif
+        case crc32_engine_slicing_16:
+            reg = crc32_slicing_16(reg, p, size);
+            break;
+        case crc32_engine_slicing_8:
+            reg = crc32_slicing_8(reg, p, size);
+            break;
+        default:
+            reg = crc32_bytewise(reg, p, size);
+            break;
+    }
+    return reg ^ ~0U;
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2)
+{
+    // Appending size2 bytes multiplies the first CRC by x^(8 * size2); the register
+    // pre- and post-conditioning of the two halves cancel out against each other.
+    return multiply_mod_p(x_to_8n_mod_p(size2), crc1) ^ crc2;
+}
+
+uint32_t crc32_zeros(uint32_t crc, size_t count)
+{
+    // Zero bytes don't change the register except to shift it along.
+    return multiply_mod_p(x_to_8n_mod_p(count), crc ^ ~0U) ^ ~0U;
+}
+
+uint32_t crc32_patch(uint32_t crc, const void * old_bytes, const void * new_bytes, size_t size, size_t following)
+{
+    // The CRC is linear in the message bits, apart from its conditioning, which doesn't
+    // change when bytes are replaced. So the change in the CRC is the raw (unconditioned)
+    // CRC of old XOR new, shifted along by the bytes that follow. Bytes before the change
+    // are zeros in old XOR new, and a raw CRC ignores leading zeros.
+    const uint8_t * old_p = old_bytes;
+    const uint8_t * new_p = new_bytes;
+    uint8_t difference[256];
+    uint32_t delta = 0;
+    while (size > 0) {
+        size_t count = (size < sizeof(difference)) ? size : sizeof(difference);
+        for (size_t i = 0; i < count; i++) {
+            difference[i] = old_p[i] ^ new_p[i];
+        }
+        uint32_t raw = crc32_update(~0U, difference, count) ^ ~0U;
+        delta = crc32_combine(delta, raw, count);
+        old_p += count;
+        new_p += count;
+        size -= count;
+    }
+    return crc ^ crc32_combine(delta, 0, following);
+}
+
+crc32_engine crc32_best_engine(void)
+{
+    pthread_once(&best_engine_once, choose_best_engine);
+    return best_engine;
+}
+
+const char * crc32_engine_name(crc32_engine engine)
+{
+    switch (engine) {
+        case crc32_engine_pclmul:
+            return "pclmul";
+        case crc32_engine_slicing_16:
+            return "slicing16";
+        case crc32_engine_slicing_8:
+            return "slicing8";
+        default:
+            return "bytewise";
+    }
+}
+
+static
+void choose_best_engine(void)
+{
+    has_pclmul = cpu_supports_pclmul();
+    best_engine = has_pclmul ? crc32_engine_pclmul : crc32_engine_slicing_16;
+}
+
+//
+// Polynomial arithmetic modulo P, in the bit-reflected representation, where the most
+// significant bit is x^0. After zlib's crc32_combine().
+//
+
+static
+void prepare_power_table(void)
+{
+    uint32_t p = 1U << 30;  // x^1
+    power_tab[0] = p;
+    for (int k = 1; k < 32; k++) {
+        p = multiply_mod_p(p, p);
+        power_tab[k] = p;
+    }
+}
+
+static
+uint32_t multiply_mod_p(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t m = 1U << 31; m; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+static
+uint32_t x_to_8n_mod_p(size_t n)
+{
+    pthread_once(&power_table_once, prepare_power_table);
+    uint32_t p = 1U << 31;  // x^0
+    int k = 3;              // 8n = n * 2^3
+    while (n) {
+        if (n & 1) {
+            p = multiply_mod_p(power_tab[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+//
+// Engines. Each takes and returns the raw CRC register.
+//
+
+static
+void prepare_slicing_tables(void)
+{
+    for (int i = 0; i < 256; i++) {
+        slicing_tab[0][i] = crc32_tab[i];
+    }
+    for (int k = 1; k < 16; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t prev = slicing_tab[k - 1][i];
+            slicing_tab[k][i] = (prev >> 8) ^ crc32_tab[prev & 0xFF];
+        }
+    }
+}
+
+static
+uint32_t crc32_bytewise(uint32_t crc, const uint8_t * p, size_t size)
+{
+    while (size--) {
+        crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static
+uint32_t crc32_slicing_8(uint32_t crc, const uint8_t * p, size_t size)
+{
+    pthread_once(&slicing_tables_once, prepare_slicing_tables);
+    while (size >= 8) {
+        uint32_t one = LOAD_LE32(p) ^ crc;
+        uint32_t two = LOAD_LE32(p + 4);
+        crc = slicing_tab[7][one & 0xFF] ^ slicing_tab[6][(one >> 8) & 0xFF] ^
+              slicing_tab[5][(one >> 16) & 0xFF] ^ slicing_tab[4][one >> 24] ^
+              slicing_tab[3][two & 0xFF] ^ slicing_tab[2][(two >> 8) & 0xFF] ^
+              slicing_tab[1][(two >> 16) & 0xFF] ^ slicing_tab[0][two >> 24];
+        p += 8;
+        size -= 8;
+    }
+    return crc32_bytewise(crc, p, size);
+}
+
+static
+uint32_t crc32_slicing_16(uint32_t crc, const uint8_t * p, size_t size)
+{
+    pthread_once(&slicing_tables_once, prepare_slicing_tables);
+    while (size >= 16) {
+        uint32_t one = LOAD_LE32(p) ^ crc;
+        uint32_t two = LOAD_LE32(p + 4);
+        uint32_t three = LOAD_LE32(p + 8);
+        uint32_t four = LOAD_LE32(p + 12);
+        crc = slicing_tab[15][one & 0xFF] ^ slicing_tab[14][(one >> 8) & 0xFF] ^
+              slicing_tab[13][(one >> 16) & 0xFF] ^ slicing_tab[12][one >> 24] ^
+              slicing_tab[11][two & 0xFF] ^ slicing_tab[10][(two >> 8) & 0xFF] ^
+              slicing_tab[9][(two >> 16) & 0xFF] ^ slicing_tab[8][two >> 24] ^
+              slicing_tab[7][three & 0xFF] ^ slicing_tab[6][(three >> 8) & 0xFF] ^
+              slicing_tab[5][(three >> 16) & 0xFF] ^ slicing_tab[4][three >> 24] ^
+              slicing_tab[3][four & 0xFF] ^ slicing_tab[2][(four >> 8) & 0xFF] ^
+              slicing_tab[1][(four >> 16) & 0xFF] ^ slicing_tab[0][four >> 24];
+        p += 16;
+        size -= 16;
+    }
+    return crc32_slicing_8(crc, p, size);
+}
+
+#if CPU_FEATURES_X86
+
+// Folds a 128-bit accumulator forward over the following data, using the constant
+// pair x^(n+32) mod P and x^(n-32) mod P (bit-reflected) for a fold distance of n bits.
+__attribute__((target("pclmul,sse4.1")))
+static inline
+__m128i fold_128(__m128i acc, __m128i constants, __m128i data)
+{
+    __m128i lo = _mm_clmulepi64_si128(acc, constants, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(acc, constants, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), data);
+}
+
+// Carry-less multiply folding, after Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction". The buffer is folded four 128-bit lanes at
+// a time down to a single 128-bit remainder that's congruent to everything folded so
+// far. Instead of a Barrett reduction, that remainder is then run through the table
+// engine from a zero register, which yields the same CRC register as the whole input.
+__attribute__((target("pclmul,sse4.1")))
+static
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t * p, size_t size)
+{
+    if (size < CRC32_PCLMUL_MIN_SIZE) {
+        return crc32_slicing_16(crc, p, size);
+    }
+
+    const __m128i fold_by_4 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+    const __m128i fold_by_1 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+
+    __m128i x0 = _mm_loadu_si128((const __m128i *)(p + 0));
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+    p += 64;
+    size -= 64;
+
+    while (size >= 64) {
+        x0 = fold_128(x0, fold_by_4, _mm_loadu_si128((const __m128i *)(p + 0)));
+        x1 = fold_128(x1, fold_by_4, _mm_loadu_si128((const __m128i *)(p + 16)));
+        x2 = fold_128(x2, fold_by_4, _mm_loadu_si128((const __m128i *)(p + 32)));
+        x3 = fold_128(x3, fold_by_4, _mm_loadu_si128((const __m128i *)(p + 48)));
+        p += 64;
+        size -= 64;
+    }
+
+    x0 = fold_128(x0, fold_by_1, x1);
+    x0 = fold_128(x0, fold_by_1, x2);
+    x0 = fold_128(x0, fold_by_1, x3);
+    while (size >= 16) {
+        x0 = fold_128(x0, fold_by_1, _mm_loadu_si128((const __m128i *)p));
+        p += 16;
+        size -= 16;
+    }
+
+    uint8_t remainder[16];
+    _mm_storeu_si128((__m128i *)remainder, x0);
+    crc = crc32_slicing_16(0, remainder, 16);
+    return crc32_slicing_16(crc, p, size);
+}
+
+#endif
@@ -0,0 +1,43 @@
+//
+// crc32.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module computes the standard (zlib/PNG/WOZ) CRC-32. Several engines are
+// available: the classic byte-at-a-time table, slicing-by-8 and slicing-by-16 tables,
+// and carry-less multiply folding on CPUs with PCLMULQDQ. They all produce identical
+// results, and the fastest one available is chosen at runtime.
+//
+// CRCs chain like zlib's crc32(): start with 0, and pass the previous result back in
+// to continue a CRC over more data. CRCs of separate pieces can also be joined without
+// revisiting the data: crc32_combine() gives the CRC of two pieces back to back from
+// their individual CRCs, and crc32_zeros() extends a CRC over a run of zero bytes.
+// crc32_patch() updates a CRC for bytes changed in place, from just the changed bytes.
+//
+
+#ifndef crc32_h
+#define crc32_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum _crc32_engine {
+    crc32_engine_bytewise = 0,
+    crc32_engine_slicing_8,
+    crc32_engine_slicing_16,
+    crc32_engine_pclmul
+} crc32_engine;
+
+#define CRC32_ENGINE_COUNT  4
+
+uint32_t crc32_update(uint32_t crc, const void * buf, size_t size);
+uint32_t crc32_update_with_engine(crc32_engine engine, uint32_t crc, const void * buf, size_t size);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2);
+uint32_t crc32_zeros(uint32_t crc, size_t count);
+// The CRC of a message, given its old crc, once size bytes of it change from old_bytes to
+// new_bytes. following is the number of bytes after the changed ones.
+uint32_t crc32_patch(uint32_t crc, const void * old_bytes, const void * new_bytes, size_t size, size_t following);
+crc32_engine crc32_best_engine(void);
+const char * crc32_engine_name(crc32_engine engine);
+
+#endif /* crc32_h */
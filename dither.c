@@ -0,0 +1,117 @@
+//
+// dither.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "dither.h"
+#include "bitmap.h"
+#include <string.h>
+#include <pthread.h>
+
+static void prepare_tiles(void);
+
+// DITHER_TILE_SIZE rows of DITHER_TILE_SIZE thresholds each.
+static uint8_t bayer_tile[DITHER_TILE_SIZE * DITHER_TILE_SIZE];
+static uint8_t blue_noise_tile[DITHER_TILE_SIZE * DITHER_TILE_SIZE];
+static pthread_once_t tiles_once = PTHREAD_ONCE_INIT;
+
+//
+// Public routines
+//
+
+void dither_threshold_row(dither_mode mode, int y, uint8_t * thresholds, int width)
+{
+    const uint8_t * tile = NULL;
+    if (mode == dither_mode_bayer || mode == dither_mode_blue_noise) {
+        pthread_once(&tiles_once, prepare_tiles);
+        tile = (mode == dither_mode_bayer) ? bayer_tile : blue_noise_tile;
+    }
+    if (!tile) {
+        memset(thresholds, LUMA_THRESHOLD, width);
+        return;
+    }
+    const uint8_t * row = &tile[(y % DITHER_TILE_SIZE) * DITHER_TILE_SIZE];
+    for (int x = 0; x < width; x += DITHER_TILE_SIZE) {
+        int count = (width - x < DITHER_TILE_SIZE) ? width - x : DITHER_TILE_SIZE;
+        memcpy(&thresholds[x], row, count);
+    }
+}
+
+void init_error_diffuser(error_diffuser * diffuser, int width, int16_t * buffer)
+{
+    memset(buffer, 0, ERROR_DIFFUSER_BUFFER_COUNT(width) * sizeof(int16_t));
+    diffuser->width = width;
+    diffuser->row = 0;
+    diffuser->current = buffer;
+    diffuser->next = &buffer[width + 2];
+}
+
+// Errors are kept in sixteenths, which is what the Floyd-Steinberg weights are in. Each
+// buffer has a spare entry at either end, so the edge samples can spill into them
+// without checks. Odd rows are scanned right to left, which avoids the diagonal
+// "worm" patterns of always scanning the same way.
+void error_diffuse_row(error_diffuser * diffuser, const uint8_t * lumas, uint8_t * light)
+{
+    int width = diffuser->width;
+    int16_t * current = diffuser->current + 1;
+    int16_t * next = diffuser->next + 1;
+    memset(diffuser->next, 0, ((size_t)width + 2) * sizeof(int16_t));
+
+    int step = (diffuser->row & 1) ? -1 : 1;
+    int x = (step > 0) ? 0 : width - 1;
+    for (int i = 0; i < width; i++, x += step) {
+        int value = lumas[x] + ((current[x] + 8) >> 4);
+        int is_light = (value >= LUMA_THRESHOLD);
+        int error = value - (is_light ? 255 : 0);
+        light[x] = is_light;
+        current[x + step] += error * 7;
+        next[x - step] += error * 3;
+        next[x] += error * 5;
+        next[x + step] += error;
+    }
+
+    diffuser->current = diffuser->next;
+    diffuser->next = current - 1;
+    diffuser->row++;
+}
+
+//
+// Private routines
+//
+
+// The Bayer matrix is built up recursively from the 2x2 one, then repeated to fill the
+// tile. The blue noise mask is Martin Roberts' R2 sequence dither: the fractional part
+// of x / g + y / g^2, where g is the plastic number. Its thresholds are spread evenly
+// with no low-frequency structure, though it doesn't repeat exactly at the tile edges.
+// Both are scaled so that a flat luma of k comes out light on very nearly k / 256 of
+// the samples.
+static
+void prepare_tiles(void)
+{
+    int bayer[8][8];
+    bayer[0][0] = 0;
+    for (int size = 1; size < 8; size *= 2) {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int value = bayer[y][x] * 4;
+                bayer[y][x] = value;
+                bayer[y][x + size] = value + 2;
+                bayer[y + size][x] = value + 3;
+                bayer[y + size][x + size] = value + 1;
+            }
+        }
+    }
+
+    const double g = 1.32471795724474602596;
+    const double a1 = 1.0 / g;
+    const double a2 = 1.0 / (g * g);
+    for (int y = 0; y < DITHER_TILE_SIZE; y++) {
+        for (int x = 0; x < DITHER_TILE_SIZE; x++) {
+            bayer_tile[y * DITHER_TILE_SIZE + x] = bayer[y % 8][x % 8] * 4 + 2;
+            double r = 0.5 + x * a1 + y * a2;
+            r -= (int)r;
+            blue_noise_tile[y * DITHER_TILE_SIZE + x] = 1 + (int)(r * 255.0);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+//
+// dither.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module reduces rows of luma samples to 1-bit, light or dark. It works on any
+// grid of samples: the HGR screen's pixels, or the nibbles around each flux track with
+// one row per track. Ordered modes compare each sample against a tiled mask of
+// thresholds, so they cost the same as a plain threshold. Error diffusion carries each
+// sample's rounding error on to its neighbours, streaming one row at a time with two
+// rows of state.
+//
+
+#ifndef dither_h
+#define dither_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum _dither_mode {
+    dither_mode_none = 0,       // Every threshold is LUMA_THRESHOLD
+    dither_mode_bayer,          // Ordered, with an 8x8 Bayer matrix
+    dither_mode_blue_noise,     // Ordered, with a mask from the R2 low-discrepancy sequence
+    dither_mode_diffusion       // Floyd-Steinberg error diffusion, in serpentine order
+} dither_mode;
+
+// The ordered masks repeat every this many samples, in both directions.
+#define DITHER_TILE_SIZE    64
+
+// Fills thresholds with row y of the mode's mask, for width samples from column 0. A
+// sample is light when its luma is at or above its threshold. Error diffusion has no
+// mask, so it gets LUMA_THRESHOLD everywhere, the same as dither_mode_none.
+void dither_threshold_row(dither_mode mode, int y, uint8_t * thresholds, int width);
+
+// Error diffusion state for rows of width samples. The caller provides the buffer, of
+// ERROR_DIFFUSER_BUFFER_COUNT(width) entries, so that it can live on the stack.
+typedef struct _error_diffuser {
+    int width;
+    int row;
+    int16_t * current;          // Errors carried into the row being quantized
+    int16_t * next;             // And into the row after it
+} error_diffuser;
+
+#define ERROR_DIFFUSER_BUFFER_COUNT(width)  (2 * ((size_t)(width) + 2))
+
+void init_error_diffuser(error_diffuser * diffuser, int width, int16_t * buffer);
+// Quantizes the next row of lumas, setting light[x] to 1 for light and 0 for dark.
+// light may be the same buffer as lumas.
+void error_diffuse_row(error_diffuser * diffuser, const uint8_t * lumas, uint8_t * light);
+
+#endif /* dither_h */
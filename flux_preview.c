@@ -0,0 +1,154 @@
+//
+// flux_preview.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "flux_preview.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Densities at or below this are black, and all ones is white. picturedsk's dark
+// nibble (0x96) has four bits of eight set, and ordinary GCR data is not far above it.
+#define FLUX_PREVIEW_DARK_DENSITY   0.5
+
+// Each track's bits are summarized as running counts of one bits, a byte at a time, so
+// the density over any arc is two lookups.
+typedef struct _preview_track {
+    const uint32_t * ones;      // ones[i] is the number of one bits in the first i bytes
+    uint32_t byte_count;        // Bytes in one revolution; 0 if the track is missing
+} preview_track;
+
+struct _flux_preview {
+    flux_preview_geometry geometry;
+    int tracks_by_quarter_track[WOZ_QUARTER_TRACK_COUNT];   // TRKS index, or -1
+    preview_track tracks[WOZ_TRACK_COUNT];
+    uint32_t * counts;          // Storage for every track's ones
+};
+
+static uint32_t ones_in_range(const preview_track * track, long first, long end);
+
+//
+// Public routines
+//
+
+flux_preview * create_flux_preview(const woz_reader * reader, const flux_preview_geometry * geometry)
+{
+    flux_preview * preview = calloc(1, sizeof(flux_preview));
+    if (!preview) {
+        return NULL;
+    }
+    preview->geometry = *geometry;
+
+    size_t total = 0;
+    woz_track track;
+    for (int i = 0; i < WOZ_TRACK_COUNT; i++) {
+        if (woz_reader_track(reader, i, &track) && track.bit_count >= 8) {
+            total += (track.bit_count + 7) / 8 + 1;
+        }
+    }
+    preview->counts = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!preview->counts) {
+        free(preview);
+        return NULL;
+    }
+
+    // A last partial byte only counts its bits that are on the track.
+    uint32_t * ones = preview->counts;
+    for (int i = 0; i < WOZ_TRACK_COUNT; i++) {
+        if (!woz_reader_track(reader, i, &track) || track.bit_count < 8) {
+            continue;
+        }
+        uint32_t byte_count = (track.bit_count + 7) / 8;
+        ones[0] = 0;
+        for (uint32_t b = 0; b < byte_count; b++) {
+            uint8_t byte = track.bits[b];
+            if (b == byte_count - 1 && (track.bit_count & 7)) {
+                byte &= 0xFF << (8 - (track.bit_count & 7));
+            }
+            ones[b + 1] = ones[b] + __builtin_popcount(byte);
+        }
+        preview->tracks[i].ones = ones;
+        preview->tracks[i].byte_count = byte_count;
+        ones += byte_count + 1;
+    }
+    for (int q = 0; q < WOZ_QUARTER_TRACK_COUNT; q++) {
+        int index = woz_reader_track_index(reader, q);
+        preview->tracks_by_quarter_track[q] = (index >= 0 && preview->tracks[index].byte_count) ? index : -1;
+    }
+    return preview;
+}
+
+void free_flux_preview(flux_preview * preview)
+{
+    if (preview) {
+        free(preview->counts);
+        free(preview);
+    }
+}
+
+// The angles run as they do in polar_map: byte 0 of every track is at 12 o'clock, and
+// the bytes go on clockwise. Each pixel takes the bytes within half a pixel's width of
+// it along its ring, and at least the one nearest it.
+void render_flux_preview_rows(const flux_preview * preview, uint8_t * pixels, int width, int height,
+                              int first_row, int row_count)
+{
+    const flux_preview_geometry * geometry = &preview->geometry;
+    const double pixel_size = 1.0 / width;
+    for (int y = first_row; y < first_row + row_count; y++) {
+        uint8_t * row = &pixels[(size_t)y * width];
+        double dy = 0.5 - (y + 0.5) / height;
+        for (int x = 0; x < width; x++) {
+            double dx = (x + 0.5) / width - 0.5;
+            double r = sqrt(dx * dx + dy * dy);
+            double position = geometry->outer_quarter_track + (geometry->outer_radius - r) / geometry->quarter_track_spacing;
+            int quarter_track = (int)floor(position + 0.5);
+            int index = (quarter_track >= 0 && quarter_track < WOZ_QUARTER_TRACK_COUNT) ?
+                        preview->tracks_by_quarter_track[quarter_track] : -1;
+            if (index < 0) {
+                row[x] = 0;
+                continue;
+            }
+
+            const preview_track * track = &preview->tracks[index];
+            double turn = (M_PI_2 - atan2(dy, dx)) / (2.0 * M_PI);
+            turn -= floor(turn);
+            double center = turn * track->byte_count;
+            double half_width = (r > 0.0) ? 0.5 * track->byte_count * pixel_size / (2.0 * M_PI * r) : track->byte_count;
+            long first = (long)floor(center - half_width + 0.5);
+            long end = (long)floor(center + half_width + 0.5);
+            if (end <= first) {
+                first = (long)floor(center + 0.5);
+                end = first + 1;
+            }
+            if (end - first > (long)track->byte_count) {
+                end = first + track->byte_count;
+            }
+            double density = (double)ones_in_range(track, first, end) / (8.0 * (end - first));
+            double grey = (density - FLUX_PREVIEW_DARK_DENSITY) / (1.0 - FLUX_PREVIEW_DARK_DENSITY);
+            row[x] = (grey <= 0.0) ? 0 : (grey >= 1.0) ? 255 : (uint8_t)(grey * 255.0 + 0.5);
+        }
+    }
+}
+
+//
+// Private routines
+//
+
+// The ones in bytes [first, end) of the track, where the range may wrap past either end.
+static
+uint32_t ones_in_range(const preview_track * track, long first, long end)
+{
+    long count = track->byte_count;
+    long length = end - first;
+    first %= count;
+    if (first < 0) {
+        first += count;
+    }
+    end = first + length;
+    if (end <= count) {
+        return track->ones[end] - track->ones[first];
+    }
+    return (track->ones[count] - track->ones[first]) + track->ones[end - count];
+}
@@ -0,0 +1,40 @@
+//
+// flux_preview.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module renders what a disk's flux looks like, as Applesauce's flux imager would
+// show it: each quarter-track is a ring, and the density of flux transitions along it
+// is the brightness. It's polar_map run backwards. Each preview pixel finds its ring
+// from its radius and its place around the ring from its angle, and takes the density
+// of the bits under it, over an arc as wide as the pixel.
+//
+
+#ifndef flux_preview_h
+#define flux_preview_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "woz_reader.h"
+
+// Where the quarter-tracks are, in the same texcoord units as polar_geometry: the
+// preview spans [0, 1] in both directions, around a center at (0.5, 0.5).
+typedef struct _flux_preview_geometry {
+    double outer_radius;            // The radius of outer_quarter_track
+    int outer_quarter_track;
+    double quarter_track_spacing;   // The radius shrinks by this much with each quarter-track in
+} flux_preview_geometry;
+
+typedef struct _flux_preview flux_preview;
+
+// Counts the bits of every track in the reader, which must outlive the preview.
+flux_preview * create_flux_preview(const woz_reader * reader, const flux_preview_geometry * geometry);
+void free_flux_preview(flux_preview * preview);
+
+// Renders rows [first_row, first_row + row_count) of a width x height preview into
+// pixels, which has rows of width greys, top row first. Rows can be rendered in any
+// order, from any number of threads at once.
+void render_flux_preview_rows(const flux_preview * preview, uint8_t * pixels, int width, int height,
+                              int first_row, int row_count);
+
+#endif /* flux_preview_h */
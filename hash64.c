@@ -0,0 +1,116 @@
+//
+// hash64.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "hash64.h"
+#include <string.h>
+
+#define PRIME64_1   0x9E3779B185EBCA87ULL
+#define PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3   0x165667B19E3779F9ULL
+#define PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define PRIME64_5   0x27D4EB2F165667C5ULL
+
+static uint64_t rotate_left(uint64_t value, int count);
+static uint64_t hash_round(uint64_t accumulator, uint64_t input);
+static uint64_t merge_round(uint64_t hash, uint64_t accumulator);
+static uint64_t load_64(const uint8_t * p);
+static uint32_t load_32(const uint8_t * p);
+
+//
+// Public routines
+//
+
+// Four independent lanes take 32 bytes per step, and the tail is folded in 8, 4 and
+// then 1 byte at a time. Inputs are read in native byte order, which is little endian
+// on everything we run on, so results match the reference XXH64.
+uint64_t hash64(const void * buf, size_t size, uint64_t seed)
+{
+    const uint8_t * p = buf;
+    const uint8_t * end = p + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = hash_round(v1, load_64(p));
+            v2 = hash_round(v2, load_64(p + 8));
+            v3 = hash_round(v3, load_64(p + 16));
+            v4 = hash_round(v4, load_64(p + 24));
+        }
+        hash = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+        hash = merge_round(hash, v1);
+        hash = merge_round(hash, v2);
+        hash = merge_round(hash, v3);
+        hash = merge_round(hash, v4);
+    } else {
+        hash = seed + PRIME64_5;
+    }
+    hash += (uint64_t)size;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= hash_round(0, load_64(p));
+        hash = rotate_left(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        hash ^= (uint64_t)load_32(p) * PRIME64_1;
+        hash = rotate_left(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME64_5;
+        hash = rotate_left(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+//
+// Private routines
+//
+
+static
+uint64_t rotate_left(uint64_t value, int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+static
+uint64_t hash_round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * PRIME64_2;
+    accumulator = rotate_left(accumulator, 31);
+    return accumulator * PRIME64_1;
+}
+
+static
+uint64_t merge_round(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= hash_round(0, accumulator);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+static
+uint64_t load_64(const uint8_t * p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static
+uint32_t load_32(const uint8_t * p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
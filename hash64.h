@@ -0,0 +1,19 @@
+//
+// hash64.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module computes XXH64, a fast non-cryptographic 64-bit hash, for naming things
+// by their contents. Hashes chain like CRCs do: pass one piece's hash in as the seed of
+// the next to hash several pieces together.
+//
+
+#ifndef hash64_h
+#define hash64_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+uint64_t hash64(const void * buf, size_t size, uint64_t seed);
+
+#endif /* hash64_h */
@@ -0,0 +1,279 @@
+//
+// loadgen.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// A load generator for "picturedsk --serve", for local testing. Each client thread
+// opens its own connection and sends the same image over and over, checking every
+// response. Reports throughput and latency percentiles at the end. Build with
+// "make picturedsk-loadgen".
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+typedef struct _loadgen {
+    const char * socket_path;
+    const uint8_t * request;        // One complete request, sent as is every time
+    size_t request_size;
+    int requests_per_client;
+    pthread_mutex_t lock;
+    uint8_t * first_woz;            // Every response is checked against the first one
+    size_t first_woz_size;
+    int failures;
+} loadgen;
+
+typedef struct _client {
+    loadgen * loadgen;
+    double * latencies;
+    int completed;
+} client;
+
+static void * client_main(void * arg);
+static int exchange(int fd, const loadgen * loadgen, uint32_t * status, uint8_t ** payload, size_t * payload_size);
+static int connect_to(const char * path);
+static uint8_t * read_file(const char * path, size_t * size);
+static int compare_doubles(const void * a, const void * b);
+static double now_seconds(void);
+static void store_le32(uint8_t * p, uint32_t value);
+static uint32_t load_le32(const uint8_t * p);
+
+int main(int argc, const char * argv[])
+{
+    if (argc < 3 || argc > 6) {
+        printf("USAGE: picturedsk-loadgen socket image.bmp [clients] [requests-per-client] [message]\n");
+        return -1;
+    }
+    int client_count = (argc > 3) ? atoi(argv[3]) : 4;
+    int requests_per_client = (argc > 4) ? atoi(argv[4]) : 100;
+    const char * message = (argc > 5) ? argv[5] : NULL;
+    if (client_count < 1 || requests_per_client < 1) {
+        printf("Need at least one client and one request.\n");
+        return -1;
+    }
+
+    size_t image_size = 0;
+    uint8_t * image = read_file(argv[2], &image_size);
+    if (!image) {
+        printf("Could not read %s\n", argv[2]);
+        return -1;
+    }
+    size_t message_length = message ? strlen(message) : 0;
+    size_t request_size = SERVER_REQUEST_HEADER_SIZE + message_length + image_size;
+    uint8_t * request = malloc(request_size);
+    if (!request) {
+        printf("Out of memory.\n");
+        return -1;
+    }
+    memcpy(request, SERVER_REQUEST_MAGIC, 4);
+    store_le32(&request[4], message ? SERVER_REQUEST_HAS_MESSAGE : 0);
+    store_le32(&request[8], (uint32_t)message_length);
+    store_le32(&request[12], (uint32_t)image_size);
+    memcpy(&request[SERVER_REQUEST_HEADER_SIZE], message ? message : "", message_length);
+    memcpy(&request[SERVER_REQUEST_HEADER_SIZE + message_length], image, image_size);
+    free(image);
+
+    loadgen loadgen;
+    memset(&loadgen, 0, sizeof(loadgen));
+    loadgen.socket_path = argv[1];
+    loadgen.request = request;
+    loadgen.request_size = request_size;
+    loadgen.requests_per_client = requests_per_client;
+    pthread_mutex_init(&loadgen.lock, NULL);
+
+    pthread_t * threads = calloc(client_count, sizeof(pthread_t));
+    client * clients = calloc(client_count, sizeof(client));
+    if (!threads || !clients) {
+        printf("Out of memory.\n");
+        return -1;
+    }
+    double start = now_seconds();
+    for (int i = 0; i < client_count; i++) {
+        clients[i].loadgen = &loadgen;
+        clients[i].latencies = calloc(requests_per_client, sizeof(double));
+        pthread_create(&threads[i], NULL, client_main, &clients[i]);
+    }
+    int completed = 0;
+    for (int i = 0; i < client_count; i++) {
+        pthread_join(threads[i], NULL);
+        completed += clients[i].completed;
+    }
+    double elapsed = now_seconds() - start;
+
+    double * latencies = malloc(sizeof(double) * (completed ? completed : 1));
+    int count = 0;
+    for (int i = 0; i < client_count; i++) {
+        memcpy(&latencies[count], clients[i].latencies, sizeof(double) * clients[i].completed);
+        count += clients[i].completed;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, count, sizeof(double), compare_doubles);
+
+    printf("%d requests from %d clients in %.3f s: %.1f requests/s\n", completed, client_count, elapsed, completed / elapsed);
+    if (count > 0) {
+        printf("latency ms: min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+               latencies[0] * 1e3, latencies[count / 2] * 1e3, latencies[count * 9 / 10] * 1e3,
+               latencies[count * 99 / 100] * 1e3, latencies[count - 1] * 1e3);
+    }
+    printf("%d failures\n", loadgen.failures);
+
+    free(latencies);
+    free(threads);
+    free(clients);
+    free(request);
+    free(loadgen.first_woz);
+    return loadgen.failures ? -2 : 0;
+}
+
+static
+void * client_main(void * arg)
+{
+    client * client = arg;
+    loadgen * loadgen = client->loadgen;
+    int fd = connect_to(loadgen->socket_path);
+    for (int i = 0; i < loadgen->requests_per_client; i++) {
+        uint32_t status = 0;
+        uint8_t * payload = NULL;
+        size_t payload_size = 0;
+        double start = now_seconds();
+        if (fd < 0 || exchange(fd, loadgen, &status, &payload, &payload_size) != 0) {
+            pthread_mutex_lock(&loadgen->lock);
+            loadgen->failures += loadgen->requests_per_client - i;
+            pthread_mutex_unlock(&loadgen->lock);
+            break;
+        }
+        client->latencies[client->completed++] = now_seconds() - start;
+
+        pthread_mutex_lock(&loadgen->lock);
+        if (status != picturedsk_ok) {
+            printf("Server error %u: %.*s\n", status, (int)payload_size, (const char *)payload);
+            loadgen->failures++;
+        } else if (!loadgen->first_woz) {
+            loadgen->first_woz = payload;
+            loadgen->first_woz_size = payload_size;
+            payload = NULL;
+        } else if (payload_size != loadgen->first_woz_size ||
+                   memcmp(payload, loadgen->first_woz, payload_size) != 0) {
+            printf("Response differs from the first one\n");
+            loadgen->failures++;
+        }
+        pthread_mutex_unlock(&loadgen->lock);
+        free(payload);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+// Sends the request and reads back the response. Returns 0 if a complete response
+// arrived (whatever its status).
+static
+int exchange(int fd, const loadgen * loadgen, uint32_t * status, uint8_t ** payload, size_t * payload_size)
+{
+    size_t sent = 0;
+    while (sent < loadgen->request_size) {
+        ssize_t count = send(fd, loadgen->request + sent, loadgen->request_size - sent, MSG_NOSIGNAL);
+        if (count <= 0) {
+            return -1;
+        }
+        sent += count;
+    }
+
+    uint8_t header[SERVER_RESPONSE_HEADER_SIZE];
+    if (recv(fd, header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+        memcmp(header, SERVER_RESPONSE_MAGIC, 4) != 0) {
+        return -1;
+    }
+    *status = load_le32(&header[4]);
+    *payload_size = load_le32(&header[8]);
+    *payload = malloc(*payload_size ? *payload_size : 1);
+    if (!*payload) {
+        return -1;
+    }
+    if (*payload_size > 0 && recv(fd, *payload, *payload_size, MSG_WAITALL) != (ssize_t)*payload_size) {
+        free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static
+int connect_to(const char * path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        printf("Could not connect to %s\n", path);
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static
+uint8_t * read_file(const char * path, size_t * size)
+{
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    uint8_t * bytes = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long length = ftell(file);
+        rewind(file);
+        bytes = (length >= 0) ? malloc(length ? length : 1) : NULL;
+        if (bytes && fread(bytes, 1, length, file) != (size_t)length) {
+            free(bytes);
+            bytes = NULL;
+        }
+        *size = length;
+    }
+    fclose(file);
+    return bytes;
+}
+
+static
+int compare_doubles(const void * a, const void * b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static
+void store_le32(uint8_t * p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static
+uint32_t load_le32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
@@ -3,330 +3,521 @@
 //
 // Copyright (c) 2021 by Ben Zotto
 //
+// The picturedsk command line tool. All of the real work is in the library (see
+// picturedsk.h); this handles the arguments, batch manifests and stats reports.
+//
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <math.h>
-#include "bmp_bitmap.h"
-#include "apple_gcr.h"
-#include "woz_image.h"
-
-#define SCREEN_BITMAP_DIMENSION     147
-#define SCREEN_BITMAP_STRIDE_BYTES  (SCREEN_BITMAP_DIMENSION / 7)
-#define DISPLAY_MESSAGE_OFFSET      177
+#include "picturedsk.h"
+#include "work_pool.h"
+#include "server.h"
+#include "verify.h"
+#include "stats.h"
 
-#define CREATOR_NAME        "PictureDSK"
-#define MAX_MESSAGE_LEN     40
+#define DEFAULT_CACHE_SIZE_MB   1024
+#define DEFAULT_PREVIEW_SIZE    512
 
-#define TRACKS_PER_DISK     46
-#define SECTORS_PER_TRACK   16
-#define BYTES_PER_SECTOR    256
-#define BYTES_PER_TRACK     (SECTORS_PER_TRACK * BYTES_PER_SECTOR)
+typedef struct _disk_job {
+    const char * image_path;
+    const char * output_path;
+    const char * message;       // NULL for the default message
+    int line_number;            // Manifest line, in batch mode
+    int result;                 // 0 on success, else the exit status for this failure
+    char error[512];            // What went wrong, if result is non-zero
+} disk_job;
 
-#define BITS_BLOCKS_PER_TRACK       13
-#define BITS_BLOCK_SIZE             512
-#define BITS_TRACK_SIZE             (BITS_BLOCKS_PER_TRACK * BITS_BLOCK_SIZE)
-#define BITS_SECTOR_CONTENTS_SIZE   343
+typedef struct _batch {
+    const char * manifest_path;
+    picturedsk_context * context;
+    const picturedsk_options * options;
+    FILE * stats_file;
+    disk_job * jobs;
+    int job_count;
+} batch;
 
-#define DOS_VOLUME_NUMBER           254
-#define TRACK_LEADER_SYNC_COUNT     64
+static int run_disk_job(disk_job * job, picturedsk_context * context, const picturedsk_options * options,
+                        FILE * stats_file);
+static int run_batch(const char * manifest_path, int thread_count, picturedsk_context * context,
+                     const picturedsk_options * options, FILE * stats_file);
+static int parse_filter(const char * name, picturedsk_filter * filter);
+static int parse_dither(const char * name, picturedsk_dither * dither);
+static void run_batch_job(void * context, int index);
+static int parse_manifest_line(char * line, disk_job * job);
+static char * read_manifest(const char * path);
+static void print_job_stats(FILE * file, const disk_job * job, const job_stats * stats);
+static void print_json_string(FILE * file, const char * string);
+static void print_usage(void);
 
 //
-// Helper types and routines.
+// Main program.
 //
 
-typedef struct _track_data {
-    size_t data_length;
-    int block_count;
-    uint8_t data[0];
-} track_data;
+int main(int argc, const char * argv[])
+{
+    // Options come first, then the positional arguments.
+    const char * map_cache_dir = NULL;
+    const char * manifest_path = NULL;
+    const char * socket_path = NULL;
+    const char * stats_path = NULL;
+    const char * restamp_path = NULL;
+    const char * verify_path = NULL;
+    const char * preview_path = NULL;
+    const char * woz_cache_dir = NULL;
+    long cache_size_mb = DEFAULT_CACHE_SIZE_MB;
+    int job_threads = 0;
+    int track_threads = 0;
+    picturedsk_options options;
+    picturedsk_default_options(&options);
+    int arg_index = 1;
+    while (arg_index < argc && strncmp(argv[arg_index], "--", 2) == 0) {
+        const char * option = argv[arg_index];
+        const char * value = (arg_index + 1 < argc) ? argv[arg_index + 1] : NULL;
+        if (strcmp(option, "--map-cache") == 0 && value) {
+            map_cache_dir = value;
+        } else if (strcmp(option, "--cache") == 0 && value) {
+            woz_cache_dir = value;
+        } else if (strcmp(option, "--cache-size") == 0 && value && atol(value) > 0) {
+            cache_size_mb = atol(value);
+        } else if (strcmp(option, "--batch") == 0 && value) {
+            manifest_path = value;
+        } else if (strcmp(option, "--serve") == 0 && value) {
+            socket_path = value;
+        } else if (strcmp(option, "--stats") == 0 && value) {
+            stats_path = value;
+        } else if (strcmp(option, "--restamp") == 0 && value) {
+            restamp_path = value;
+        } else if (strcmp(option, "--verify") == 0 && value) {
+            verify_path = value;
+        } else if (strcmp(option, "--preview") == 0 && value) {
+            preview_path = value;
+        } else if (strcmp(option, "--filter") == 0 && value) {
+            if (!parse_filter(value, &options.filter)) {
+                print_usage();
+                return -1;
+            }
+        } else if (strcmp(option, "--dither") == 0 && value) {
+            if (!parse_dither(value, &options.dither)) {
+                print_usage();
+                return -1;
+            }
+        } else if (strcmp(option, "--jobs") == 0 && value && atoi(value) > 0) {
+            job_threads = atoi(value);
+        } else if (strcmp(option, "--threads") == 0 && value && atoi(value) > 0) {
+            track_threads = atoi(value);
+        } else {
+            print_usage();
+            return -1;
+        }
+        arg_index += 2;
+    }
+    argc -= arg_index - 1;
+    argv += arg_index - 1;
+
+    // Restamping an existing disk needs no image, so no context either.
+    if (restamp_path) {
+        if (argc > 2 || manifest_path || socket_path || stats_path) {
+            print_usage();
+            return -1;
+        }
+        picturedsk_status status = picturedsk_restamp_woz_file(restamp_path, (argc == 2) ? argv[1] : NULL);
+        if (status != picturedsk_ok) {
+            printf("%s: %s\n", restamp_path, picturedsk_status_string(status));
+            return -2;
+        }
+        return 0;
+    }
+
+    // As is checking WOZ files. The rest of the arguments are more paths to check.
+    if (verify_path) {
+        if (restamp_path || manifest_path || socket_path || stats_path) {
+            print_usage();
+            return -1;
+        }
+        argv[0] = verify_path;
+        return verify_woz_paths(argv, argc, job_threads ? job_threads : default_thread_count());
+    }
 
-static track_data * create_track_data(size_t length);
-static void free_track_data(track_data * data);
+    // A preview is rendered on every CPU unless told otherwise.
+    if (preview_path) {
+        int size = (argc == 3) ? atoi(argv[2]) : DEFAULT_PREVIEW_SIZE;
+        if (argc < 2 || argc > 3 || size <= 0 || size > PICTUREDSK_MAX_PREVIEW_SIZE ||
+            restamp_path || verify_path || manifest_path || socket_path || stats_path) {
+            print_usage();
+            return -1;
+        }
+        picturedsk_context * context = picturedsk_create_context(NULL, track_threads ? track_threads : default_thread_count());
+        if (!context) {
+            printf("Out of memory.\n");
+            return -3;
+        }
+        picturedsk_status status = picturedsk_woz_file_to_preview_bmp_file(context, preview_path, argv[1], size);
+        picturedsk_free_context(context);
+        if (status != picturedsk_ok) {
+            printf("%s: %s\n", preview_path, picturedsk_status_string(status));
+            return -2;
+        }
+        return 0;
+    }
 
-static uint8_t boot_1_sector_0[BYTES_PER_SECTOR];
-static uint8_t boot_2_sector_F[BYTES_PER_SECTOR];
+    // Every job shares the one context, and so its sampling maps and track pool. In batch
+    // mode, a job that finds the track pool busy with another job's tracks just renders
+    // its own on its own thread.
+    picturedsk_context * context = picturedsk_create_context(map_cache_dir, track_threads ? track_threads : 1);
+    if (!context) {
+        printf("Out of memory.\n");
+        return -3;
+    }
+    if (woz_cache_dir &&
+        picturedsk_set_woz_cache(context, woz_cache_dir, (uint64_t)cache_size_mb * 1024 * 1024) != picturedsk_ok) {
+        printf("Could not create cache directory %s\n", woz_cache_dir);
+        picturedsk_free_context(context);
+        return -4;
+    }
+
+    // Stats are only kept when asked for, one JSON object per line for each disk.
+    FILE * stats_file = NULL;
+    if (stats_path && !socket_path) {
+        stats_file = (strcmp(stats_path, "-") == 0) ? stdout : fopen(stats_path, "w");
+        if (!stats_file) {
+            printf("Could not create %s\n", stats_path);
+            picturedsk_free_context(context);
+            return -4;
+        }
+    }
+
+    int result;
+    if (socket_path) {
+        if (argc != 1 || manifest_path || stats_path) {
+            print_usage();
+            picturedsk_free_context(context);
+            return -1;
+        }
+        result = serve_unix_socket(socket_path, context, &options, job_threads ? job_threads : default_thread_count());
+    } else if (manifest_path) {
+        if (argc != 1) {
+            result = -1;
+            print_usage();
+            goto Done;
+        }
+        if (job_threads == 0) {
+            job_threads = default_thread_count();
+        }
+        result = run_batch(manifest_path, job_threads, context, &options, stats_file);
+    } else {
+        if (argc < 3 || argc > 4) {
+            result = -1;
+            print_usage();
+            goto Done;
+        }
+        disk_job job;
+        memset(&job, 0, sizeof(job));
+        job.image_path = argv[1];
+        job.output_path = argv[2];
+        job.message = (argc == 4) ? argv[3] : NULL;
+        result = run_disk_job(&job, context, &options, stats_file);
+        if (result != 0) {
+            printf("%s\n", job.error);
+        }
+    }
+
+Done:
+    if (stats_file && stats_file != stdout) {
+        fclose(stats_file);
+    }
+    picturedsk_free_context(context);
+    return result;
+}
+
+// Makes one disk with the job's message and the given options, and fills in the job's
+// result and error message. If stats_file isn't NULL, the job's stats are written to it.
+static
+int run_disk_job(disk_job * job, picturedsk_context * context, const picturedsk_options * options,
+                 FILE * stats_file)
+{
+    picturedsk_options job_options = *options;
+    job_options.message = job->message;
+    job_stats stats;
+    job_stats * previous_stats = NULL;
+    if (stats_file) {
+        previous_stats = stats_begin_job(&stats);
+    }
+    picturedsk_status status = picturedsk_bmp_file_to_woz_file(context, job->image_path, job->output_path, &job_options);
+    if (stats_file) {
+        stats_end_job(&stats, previous_stats);
+    }
+    switch (status) {
+        case picturedsk_ok:
+            job->result = 0;
+            break;
+        case picturedsk_error_out_of_memory:
+            snprintf(job->error, sizeof(job->error), "Out of memory.");
+            job->result = -3;
+            break;
+        case picturedsk_error_output_open_failed:
+        case picturedsk_error_output_write_failed:
+            snprintf(job->error, sizeof(job->error), "%s: %s", job->output_path, picturedsk_status_string(status));
+            job->result = -4;
+            break;
+        default:
+            snprintf(job->error, sizeof(job->error), "%s: %s", job->image_path, picturedsk_status_string(status));
+            job->result = -2;
+            break;
+    }
+    if (stats_file) {
+        print_job_stats(stats_file, job, &stats);
+    }
+    return job->result;
+}
 
 //
-// Main program.
+// Batch mode. The manifest has one job per line: the input image, the output file, and
+// optionally the message, which is the rest of the line. Fields are separated by spaces,
+// or by tabs if the line has any (which allows for paths with spaces in them). Blank
+// lines and lines starting with # are ignored. The jobs run on a fixed pool of threads;
+// each failure is reported with its manifest line as it happens.
 //
 
-int main(int argc, const char * argv[])
+static
+int run_batch(const char * manifest_path, int thread_count, picturedsk_context * context,
+              const picturedsk_options * options, FILE * stats_file)
 {
-    if (argc < 3 || argc > 4) {
-        printf("USAGE: picturedsk image.bmp output.woz [message] \n");
-        return -1;
-    }
+    int result = -1;
+    batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.manifest_path = manifest_path;
+    batch.context = context;
+    batch.options = options;
+    batch.stats_file = stats_file;
+    work_pool * pool = NULL;
 
-    // Load the input bitmap.
-    bitmap * image = load_bmp_into_bitmap(argv[1]);
-    if (!image) {
-        // That routine will print its own granular error.
-        return -2;
+    char * manifest = read_manifest(manifest_path);
+    if (!manifest) {
+        printf("Could not read manifest %s\n", manifest_path);
+        goto Done;
     }
-    
-    //
-    // Sample the bitmap to create a version in the Apple high-res format.
-    //
-    
-    uint8_t a2_high_res_image[SCREEN_BITMAP_STRIDE_BYTES * SCREEN_BITMAP_DIMENSION];
-    uint8_t * a2_dest_ptr = &a2_high_res_image[0];
-    uint8_t shiftreg = 0x80;
-    int shiftreg_valid = 0;
-    for (int y = 0; y < SCREEN_BITMAP_DIMENSION; y++) {
-        for (int x = 0; x < SCREEN_BITMAP_DIMENSION; x++) {
-            float u = x / (float)SCREEN_BITMAP_DIMENSION;
-            float v = y / (float)SCREEN_BITMAP_DIMENSION;
-            double grey = sample_bitmap_greyscale(image, u, v);
-            uint8_t bit = 1 << shiftreg_valid;
-            if (grey >= 0.5) {
-                shiftreg |= bit;
-            }
-            if (++shiftreg_valid == 7) {
-                *a2_dest_ptr++ = shiftreg;
-                shiftreg = 0x80;
-                shiftreg_valid = 0;
-            }
+
+    int job_capacity = 0;
+    int line_number = 0;
+    char * line = manifest;
+    while (line) {
+        char * next_line = strchr(line, '\n');
+        if (next_line) {
+            *next_line++ = '\0';
         }
-    }
-    
-    //
-    // Build the .DSK-format data for the first (and sole valid) track on the disk.
-    // Shuffle the image data into the interleaved disk sectors, so it'll end
-    // up loaded consecutively at $B100. The boot1 boot loader goes in
-    // sector 0, and the boot2 code goes in sector F.
-    //
-
-    uint8_t track_0[SECTORS_PER_TRACK * BYTES_PER_SECTOR];
-    memset(track_0, 0, SECTORS_PER_TRACK * BYTES_PER_SECTOR);
-    memcpy(&track_0[0x000], boot_1_sector_0, BYTES_PER_SECTOR);
-    memcpy(&track_0[0x800], &a2_high_res_image[0x000], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x100], &a2_high_res_image[0x100], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x900], &a2_high_res_image[0x200], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x200], &a2_high_res_image[0x300], BYTES_PER_SECTOR);
-    memcpy(&track_0[0xA00], &a2_high_res_image[0x400], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x300], &a2_high_res_image[0x500], BYTES_PER_SECTOR);
-    memcpy(&track_0[0xB00], &a2_high_res_image[0x600], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x400], &a2_high_res_image[0x700], BYTES_PER_SECTOR);
-    memcpy(&track_0[0xC00], &a2_high_res_image[0x800], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x500], &a2_high_res_image[0x900], BYTES_PER_SECTOR);
-    memcpy(&track_0[0xD00], &a2_high_res_image[0xA00], BYTES_PER_SECTOR);
-    memcpy(&track_0[0x600], &a2_high_res_image[0xB00], BYTES_PER_SECTOR);
-    memcpy(&track_0[0xE00], &a2_high_res_image[0xC00], 15); // This is how many valid bytes are left in the image.
-    memcpy(&track_0[0xF00], boot_2_sector_F, BYTES_PER_SECTOR);
-    
-    // Fixup the custom display string if one is supplied
-    if (argc == 4) {
-        int message_len = (int)strlen(argv[3]);
-        if (message_len > MAX_MESSAGE_LEN) message_len = MAX_MESSAGE_LEN;
-        char * message_base = (char *)&track_0[0xF00 + DISPLAY_MESSAGE_OFFSET];
-        for (int i = 0; i < message_len; i++) {
-            char ch = argv[3][i];
-            if (ch >= 'a' && ch <= 'z') {
-                ch -= 0x20;
-            }
-            if (ch < ' ' || ch > '_') {
-                ch = ' ';
+        line_number++;
+
+        disk_job job;
+        memset(&job, 0, sizeof(job));
+        job.line_number = line_number;
+        int parsed = parse_manifest_line(line, &job);
+        if (parsed < 0) {
+            printf("%s:%d: expected an image path and an output path\n", manifest_path, line_number);
+            goto Done;
+        }
+        if (parsed > 0) {
+            if (batch.job_count == job_capacity) {
+                job_capacity = job_capacity ? job_capacity * 2 : 64;
+                disk_job * jobs = realloc(batch.jobs, sizeof(disk_job) * job_capacity);
+                if (!jobs) {
+                    printf("Out of memory.\n");
+                    goto Done;
+                }
+                batch.jobs = jobs;
             }
-            message_base[i] = ch;
+            batch.jobs[batch.job_count++] = job;
         }
-        // Two newlines and the terminal nul.
-        message_base[message_len] = 0x0D;
-        message_base[message_len + 1] = 0x0D;
-        message_base[message_len + 2] = 0x00;
+        line = next_line;
     }
-    
-    //
-    // Prepare the raw data for all of the disk's tracks.
-    //
-    
-    track_data * tracks[TRACKS_PER_DISK];
-    
-    // Encode the one "valid" outer track.
-    tracks[0] = create_track_data(BITS_TRACK_SIZE);
-    gcr_encode_bits_for_track(tracks[0]->data, track_0, 0, dsk_sector_format_dos_3_3);
-    
-    // Encode the remaining tracks by using a polar coordinate texture sampling of the
-    // input bitmap image. All tracks on the disk are the same size (13 WOZ blocks).
-    
-    // This is based on the output PNG files from the current version of Applesauce.
-    float radius_per_track = (0.5 - 0.1415) / (float)(TRACKS_PER_DISK - 1);
-    double arc_segment = (2.0 * M_PI) / (double)BITS_TRACK_SIZE;
-
-    for (int i = 1; i < TRACKS_PER_DISK; i++) {
-        float r = 0.5 - ((i - 1) * radius_per_track);
-        tracks[i] = create_track_data(BITS_TRACK_SIZE);
-        for (int track_byte_index = 0; track_byte_index < BITS_TRACK_SIZE; track_byte_index++) {
-            // Get a set of (u, v) texture map points from the angle.
-            float u = r * cosf(M_PI_2 + arc_segment * (BITS_TRACK_SIZE - track_byte_index));
-            float v = r * sinf(M_PI_2 + arc_segment * (BITS_TRACK_SIZE - track_byte_index));
-            // Translate (u,v) from the center, to the origin.
-            u += 0.5;
-            v = 0.5 - v;
-            double gray = sample_bitmap_greyscale(image, u, v);
-            tracks[i]->data[track_byte_index] = (gray > 0.5) ? 0xFF : 0x96;
-        }
+
+    if (thread_count > batch.job_count) {
+        thread_count = batch.job_count;
     }
-    
-    //
-    // Build the WOZ file from the track data.
-    //
-    
-    woz_file * woz = create_empty_woz_file();
-    if (!woz) {
+    pool = create_work_pool(thread_count);
+    if (!pool) {
         printf("Out of memory.\n");
-        return -3;
+        goto Done;
     }
-    
-    // Build INFO chunk
-    chunk_write_uint8(woz->info, 2); // INFO v2
-    chunk_write_uint8(woz->info, 1); // 5.25" image
-    chunk_write_uint8(woz->info, 1); // Write protected
-    chunk_write_uint8(woz->info, 1); // Synchronized
-    chunk_write_uint8(woz->info, 1); // Cleaned
-    chunk_write_utf8(woz->info, CREATOR_NAME, 32); // Creator
-    chunk_write_uint8(woz->info, 1); // 1 disk side
-    chunk_write_uint8(woz->info, 1); // 16-sector format
-    chunk_write_uint8(woz->info, 32); // 4uS standard bit timing
-    chunk_write_uint16(woz->info, 0x7F); // Should work on the whole ][ series (?)
-    chunk_write_uint16(woz->info, 64); // I think this requires 64k (?)
-    chunk_write_uint16(woz->info, BITS_BLOCKS_PER_TRACK); // Largest track size (all are same)
-    
-    // Build TMAP chunk
-    //
-    // Track 0 appears at its normal location with its normal bleed-over into 0.25, with the
-    // normal gap at 0.5. The rest of the tracks are all side-by-each starting at position 1.0,
-    // with no gap between the sets of three "detected" bits. The rest of the chunk gets the 0xFF
-    // nothing-marker (not zeros which would indicate something else).
-    chunk_write_uint8(woz->tmap, 0);
-    chunk_write_uint8(woz->tmap, 0);
-    chunk_write_uint8(woz->tmap, 0xFF);
-    int tmap_nominal_track = 0; // start at 0 so the first loop increments to 1
-    for (int i = 3; i < 160; i++) {
-        if (i % 3 == 0) tmap_nominal_track++;
-        if (tmap_nominal_track < TRACKS_PER_DISK) {
-            chunk_write_uint8(woz->tmap, tmap_nominal_track);
-        } else {
-            chunk_write_uint8(woz->tmap, 0xFF);
+    work_pool_run(pool, batch.job_count, run_batch_job, &batch);
+
+    int failures = 0;
+    for (int i = 0; i < batch.job_count; i++) {
+        if (batch.jobs[i].result != 0) {
+            failures++;
         }
     }
-    
-    // Build TRKS chunk
-    // !!! starting_block is relative to the start of the file !!! This means we rely on
-    // writing the chunks in a fixed order up to this point (INFO, TMAP, TRKS, ...).
-    uint16_t starting_block = 3;
-    for (int i = 0 ; i < TRACKS_PER_DISK; i++) {
-        chunk_write_uint16(woz->trks, starting_block);
-        chunk_write_uint16(woz->trks, tracks[i]->block_count);
-        chunk_write_uint32(woz->trks, (uint32_t)tracks[i]->data_length * 8);
-        starting_block += tracks[i]->block_count;
+    printf("%d of %d disks written.\n", batch.job_count - failures, batch.job_count);
+    result = failures ? -2 : 0;
+
+Done:
+    free_work_pool(pool);
+    free(batch.jobs);
+    free(manifest);
+    return result;
+}
+
+static
+void run_batch_job(void * context, int index)
+{
+    batch * batch = context;
+    disk_job * job = &batch->jobs[index];
+    if (run_disk_job(job, batch->context, batch->options, batch->stats_file) != 0) {
+        printf("%s:%d: %s\n", batch->manifest_path, job->line_number, job->error);
+    }
+}
+
+// Splits one manifest line in place. Returns 1 for a job, 0 for a line with nothing to
+// do, or -1 if the line is malformed.
+static
+int parse_manifest_line(char * line, disk_job * job)
+{
+    size_t length = strlen(line);
+    if (length > 0 && line[length - 1] == '\r') {
+        line[--length] = '\0';
+    }
+    while (*line == ' ' || *line == '\t') {
+        line++;
     }
-    chunk_set_mark(woz->trks, 1280);
-    for (int i = 0 ; i < TRACKS_PER_DISK; i++) {
-        chunk_write_bytes(woz->trks, tracks[i]->data, tracks[i]->data_length);
-        int empty_padding_length = (int)((tracks[i]->block_count * BITS_BLOCK_SIZE) - tracks[i]->data_length);
-        chunk_advance_mark(woz->trks, empty_padding_length);
+    if (*line == '\0' || *line == '#') {
+        return 0;
     }
 
-    // Build WRIT chunk
-    int subtrack_index = 0;
-    for (int i = 0; i < TRACKS_PER_DISK; i++) {
-        // Track 0 is written at subtrack 0.0. skip to track 1.0 for track 1, but then every 3
-        // after that.
-        chunk_write_uint8(woz->writ, subtrack_index);
-        subtrack_index += ((i == 0) ? 4 : 3);
-        chunk_write_uint8(woz->writ, 1);        // 1 command in this set
-        chunk_write_uint8(woz->writ, 0x01);     // Clear first
-        chunk_write_uint8(woz->writ, 0);        // Reserved (0)
-        size_t length_for_crc = (tracks[i]->data_length + 7) / 8;
-        uint32_t crc = woz_crc32(tracks[i]->data, length_for_crc);
-        chunk_write_uint32(woz->writ, crc);     // BITS checksum
-        chunk_write_uint32(woz->writ, 0);       // Don't write leader
-        chunk_write_uint32(woz->writ, (uint32_t)tracks[i]->data_length * 8);
-        chunk_write_uint8(woz->writ, 0x00);     // Leader nibble
-        chunk_write_uint8(woz->writ, 0);        // Leader nibble count
-        chunk_write_uint8(woz->writ, 0);        // Leader count
-        chunk_write_uint8(woz->writ, 0);        // Reserved (0)
+    const char * separators = strchr(line, '\t') ? "\t" : " ";
+    char * fields[2];
+    for (int i = 0; i < 2; i++) {
+        size_t field_length = strcspn(line, separators);
+        if (field_length == 0) {
+            return -1;
+        }
+        fields[i] = line;
+        line += field_length;
+        if (*line != '\0') {
+            *line++ = '\0';
+            line += strspn(line, separators);
+        }
     }
-    
-    //
-    // We have a complete WOZ built up in parts. Write the whole thing out to a single
-    // file buffer for writing to disk.
-    //
-    
-    write_woz_to_file(woz, argv[2]);
-    
-    // Cleanup like a good boy scout
-    free_woz_file(woz);
-    free_bitmap(image);
-    for (int i = 0; i < TRACKS_PER_DISK; i++) {
-        free_track_data(tracks[i]);
+    job->image_path = fields[0];
+    job->output_path = fields[1];
+    job->message = (*line != '\0') ? line : NULL;
+    return 1;
+}
+
+// Reads the whole manifest into a nul-terminated buffer.
+static
+char * read_manifest(const char * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
     }
+    size_t size = 0;
+    size_t capacity = 4096;
+    char * text = malloc(capacity);
+    while (text) {
+        size += fread(text + size, 1, capacity - size - 1, file);
+        if (size < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        char * larger = realloc(text, capacity);
+        if (!larger) {
+            free(text);
+        }
+        text = larger;
+    }
+    if (text) {
+        if (ferror(file)) {
+            free(text);
+            text = NULL;
+        } else {
+            text[size] = '\0';
+        }
+    }
+    fclose(file);
+    return text;
+}
 
-    return 0;
+// Returns 1 if name is a filter, which is stored in *filter.
+static
+int parse_filter(const char * name, picturedsk_filter * filter)
+{
+    if (strcmp(name, "nearest") == 0) {
+        *filter = picturedsk_filter_nearest;
+    } else if (strcmp(name, "box") == 0) {
+        *filter = picturedsk_filter_box;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Returns 1 if name is a dither mode, which is stored in *dither.
+static
+int parse_dither(const char * name, picturedsk_dither * dither)
+{
+    if (strcmp(name, "none") == 0) {
+        *dither = picturedsk_dither_none;
+    } else if (strcmp(name, "bayer") == 0) {
+        *dither = picturedsk_dither_bayer;
+    } else if (strcmp(name, "bluenoise") == 0) {
+        *dither = picturedsk_dither_blue_noise;
+    } else if (strcmp(name, "diffusion") == 0) {
+        *dither = picturedsk_dither_diffusion;
+    } else {
+        return 0;
+    }
+    return 1;
 }
 
 //
-//
+// Stats reports. Each job's stats are one JSON object on a line of their own, written
+// whole even when batch jobs finish at the same time.
 //
 
 static
-track_data * create_track_data(size_t length)
+void print_job_stats(FILE * file, const disk_job * job, const job_stats * stats)
 {
-    track_data * data = calloc(1, sizeof(track_data) + length);
-    if (data) {
-        data->data_length = length;
-        int block_count = (int)(length / BITS_BLOCK_SIZE);
-        if (length % BITS_BLOCK_SIZE > 0) {
-            block_count++;
-        }
-        data->block_count = block_count;
+    flockfile(file);
+    fprintf(file, "{\"image\": ");
+    print_json_string(file, job->image_path);
+    fprintf(file, ", \"output\": ");
+    print_json_string(file, job->output_path);
+    if (job->line_number > 0) {
+        fprintf(file, ", \"line\": %d", job->line_number);
     }
-    return data;
+    fprintf(file, ", \"result\": %d, ", job->result);
+    print_stats_json_members(file, stats);
+    fprintf(file, "}\n");
+    fflush(file);
+    funlockfile(file);
 }
 
 static
-void free_track_data(track_data * data)
+void print_json_string(FILE * file, const char * string)
 {
-    free(data);
+    fputc('"', file);
+    for (const unsigned char * p = (const unsigned char *)string; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(file, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(file, "\\u%04x", *p);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
 }
 
 static
-uint8_t boot_1_sector_0[BYTES_PER_SECTOR] = {
-    0x01, 0xA5, 0x27, 0xC9, 0x09, 0xD0, 0x18, 0xA5, 0x2B, 0x4A, 0x4A, 0x4A, 0x4A, 0x09, 0xC0, 0x85,
-    0x3F, 0xA9, 0x5C, 0x85, 0x3E, 0x18, 0xAD, 0x5C, 0x08, 0x6D, 0x5D, 0x08, 0x8D, 0x5C, 0x08, 0xAE,
-    0x5D, 0x08, 0x30, 0x15, 0xBD, 0x4B, 0x08, 0x85, 0x5D, 0xCE, 0x5D, 0x08, 0xAD, 0x5C, 0x08, 0x85,
-    0x27, 0xCE, 0x5C, 0x08, 0xA6, 0x2B, 0x6C, 0x3E, 0x00, 0xEE, 0x5C, 0x08, 0xEE, 0x5C, 0x08, 0x20,
-    0x89, 0xFE, 0x20, 0x93, 0xFE, 0x20, 0x2F, 0xFB, 0x4C, 0x00, 0xB0, 0x00, 0x0D, 0x0B, 0x09, 0x07,
-    0x05, 0x03, 0x01, 0x0E, 0x0C, 0x0A, 0x08, 0x06, 0x04, 0x02, 0x0F, 0x00, 0xB0, 0x0E, 0xB0, 0x0E,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x54, 0x68, 0x69, 0x73, 0x20, 0x69, 0x73, 0x20, 0x61, 0x20, 0x50, 0x69, 0x63, 0x74, 0x75, 0x72,
-    0x65, 0x44, 0x53, 0x4B, 0x20, 0x28, 0x74, 0x6D, 0x29, 0x20, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x43, 0x6F, 0x70, 0x79, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x28, 0x63, 0x29, 0x20, 0x42, 0x65,
-    0x6E, 0x20, 0x5A, 0x6F, 0x74, 0x74, 0x6F, 0x20, 0x32, 0x30, 0x32, 0x31, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-};
+void print_usage(void)
+{
+    printf("USAGE: picturedsk [options] [--stats file] image.bmp output.woz [message] \n");
+    printf("       picturedsk [options] [--jobs N] [--stats file] --batch manifest.txt\n");
+    printf("       picturedsk [options] [--jobs N] --serve socket\n");
+    printf("       picturedsk --restamp disk.woz [message]\n");
+    printf("       picturedsk [--jobs N] --verify disk.woz|directory [more...]\n");
+    printf("       picturedsk [--threads N] --preview disk.woz preview.bmp [size]\n");
+    printf("Options: [--map-cache dir] [--cache dir] [--cache-size MB] [--threads N] [--filter nearest|box] [--dither none|bayer|bluenoise|diffusion]\n");
+}
 
-static
-uint8_t boot_2_sector_F[BYTES_PER_SECTOR] = {
-    0xA2, 0x60, 0xBD, 0x88, 0xC0, 0xA2, 0x50, 0xBD, 0x88, 0xC0, 0xA9, 0x17, 0x85, 0x25, 0x20, 0xE2,
-    0xF3, 0xA2, 0x07, 0x20, 0xF0, 0xF6, 0x20, 0x57, 0xF4, 0x20, 0xF6, 0xF3, 0xA9, 0xB1, 0x85, 0x09,
-    0xA9, 0x00, 0x85, 0x08, 0x85, 0xFB, 0xAE, 0x52, 0xB0, 0x20, 0x53, 0xB0, 0xA0, 0x09, 0x84, 0xFA,
-    0xA4, 0xFB, 0xB1, 0x08, 0xC8, 0xD0, 0x03, 0xEE, 0x09, 0x00, 0x84, 0xFB, 0xA4, 0xFA, 0x91, 0x06,
-    0xC8, 0xC0, 0x1E, 0xD0, 0xE9, 0xEE, 0x52, 0xB0, 0xA0, 0x99, 0xCC, 0x52, 0xB0, 0xF0, 0x4E, 0x4C,
-    0x26, 0xB0, 0x06, 0x8A, 0x4A, 0x4A, 0x4A, 0x18, 0x0A, 0xA8, 0xB9, 0x75, 0xB0, 0x48, 0xC8, 0xB9,
-    0x75, 0xB0, 0x48, 0x8A, 0x29, 0x07, 0x18, 0x0A, 0x0A, 0x85, 0x07, 0x68, 0x18, 0x65, 0x07, 0x85,
-    0x07, 0x68, 0x85, 0x06, 0x60, 0x00, 0x20, 0x80, 0x20, 0x00, 0x21, 0x80, 0x21, 0x00, 0x22, 0x80,
-    0x22, 0x00, 0x23, 0x80, 0x23, 0x28, 0x20, 0xA8, 0x20, 0x28, 0x21, 0xA8, 0x21, 0x28, 0x22, 0xA8,
-    0x22, 0x28, 0x23, 0xA8, 0x23, 0x50, 0x20, 0xD0, 0x20, 0x50, 0x21, 0xD0, 0x21, 0xA2, 0x00, 0xBD,
-    0xB0, 0xB0, 0xF0, 0x09, 0x09, 0x80, 0x20, 0xF0, 0xFD, 0xE8, 0x4C, 0x9F, 0xB0, 0x4C, 0xAD, 0xB0,
-    0x0A, 0x46, 0x4C, 0x55, 0x58, 0x2D, 0x49, 0x4D, 0x41, 0x47, 0x45, 0x20, 0x54, 0x48, 0x49, 0x53,
-    0x20, 0x44, 0x49, 0x53, 0x4B, 0x20, 0x46, 0x4F, 0x52, 0x20, 0x41, 0x20, 0x53, 0x55, 0x52, 0x50,
-    0x52, 0x49, 0x53, 0x45, 0x0D, 0x3D, 0x29, 0x0D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A
-};
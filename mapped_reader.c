@@ -0,0 +1,215 @@
+//
+// mapped_reader.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "mapped_reader.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// Private declarations
+//
+
+static int read_whole_file(int fd, uint8_t ** bytes, size_t * size);
+
+//
+// Public routines
+//
+
+mapped_reader * open_mapped_reader(const char * path, file_endianness endianness)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    mapped_reader * reader = calloc(1, sizeof(mapped_reader));
+    if (!reader) {
+        close(fd);
+        return NULL;
+    }
+    reader->endianness = endianness;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void * mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            reader->mapping = mapping;
+            reader->bytes = mapping;
+            reader->total_size = st.st_size;
+        }
+    }
+    // Not everything can be mapped (pipes, for example), so fall back to reading it in.
+    if (!reader->mapping) {
+        uint8_t * buffer = NULL;
+        if (read_whole_file(fd, &buffer, &reader->total_size) != 0) {
+            free(reader);
+            close(fd);
+            return NULL;
+        }
+        reader->owned_buffer = buffer;
+        reader->bytes = buffer;
+    }
+    close(fd);
+    return reader;
+}
+
+mapped_reader * open_mapped_reader_with_bytes(const void * bytes, size_t size, file_endianness endianness)
+{
+    mapped_reader * reader = calloc(1, sizeof(mapped_reader));
+    if (reader) {
+        reader->bytes = bytes;
+        reader->total_size = size;
+        reader->endianness = endianness;
+    }
+    return reader;
+}
+
+int mapped_reader_ensure_remaining(mapped_reader * reader, size_t ensure)
+{
+    return (reader->total_size - reader->offset) >= ensure;
+}
+
+void mapped_reader_advance_to_offset(mapped_reader * reader, size_t offset)
+{
+    if (offset > reader->total_size) {
+        // Invalid offset
+        return;
+    }
+    if (offset <= reader->offset) {
+        // We don't rewind this reader, so if the proposed offset is earlier
+        // than the current one, ignore this request.
+        return;
+    }
+    reader->offset = offset;
+}
+
+// Returns a pointer to count bytes at offset, or NULL if they aren't all in the file.
+const uint8_t * mapped_reader_span(mapped_reader * reader, size_t offset, size_t count)
+{
+    if (offset > reader->total_size || reader->total_size - offset < count) {
+        return NULL;
+    }
+    return &reader->bytes[offset];
+}
+
+void close_mapped_reader(mapped_reader * reader)
+{
+    if (reader->mapping) {
+        munmap(reader->mapping, reader->total_size);
+    }
+    free(reader->owned_buffer);
+    free(reader);
+}
+
+uint8_t read_uint8(mapped_reader * reader)
+{
+    const uint8_t * p = read_span(reader, sizeof(uint8_t));
+    if (!p) {
+        return 0;
+    }
+    return p[0];
+}
+
+uint16_t read_uint16(mapped_reader * reader)
+{
+    const uint8_t * p = read_span(reader, sizeof(uint16_t));
+    if (!p) {
+        return 0;
+    }
+    uint8_t one = p[0];
+    uint8_t two = p[1];
+    uint16_t u16;
+    if (reader->endianness == file_endianness_little) {
+        u16 = (two << 8) | one;
+    } else {
+        u16 = (one << 8) | two;
+    }
+    return u16;
+}
+
+uint32_t read_uint32(mapped_reader * reader)
+{
+    const uint8_t * p = read_span(reader, sizeof(uint32_t));
+    if (!p) {
+        return 0;
+    }
+    uint32_t one = p[0];
+    uint32_t two = p[1];
+    uint32_t three = p[2];
+    uint32_t four = p[3];
+    uint32_t u32;
+    if (reader->endianness == file_endianness_little) {
+        u32 = (four << 24) | (three << 16) | (two << 8) | one;
+    } else {
+        u32 = (one << 24) | (two << 16) | (three << 8) | four;
+    }
+    return u32;
+}
+
+int8_t read_int8(mapped_reader * reader)
+{
+    return read_uint8(reader);
+}
+
+int16_t read_int16(mapped_reader * reader)
+{
+    return (int16_t)read_uint16(reader);
+}
+
+int32_t read_int32(mapped_reader * reader)
+{
+    return (int32_t)read_uint32(reader);
+}
+
+// Returns a pointer to the next count bytes and advances past them, or returns NULL
+// (and doesn't advance) if there aren't that many left.
+const uint8_t * read_span(mapped_reader * reader, size_t count)
+{
+    const uint8_t * p = mapped_reader_span(reader, reader->offset, count);
+    if (p) {
+        reader->offset += count;
+    }
+    return p;
+}
+
+//
+// Private routines
+//
+
+// Returns nonzero on failure.
+static
+int read_whole_file(int fd, uint8_t ** bytes, size_t * size)
+{
+    size_t capacity = 0;
+    size_t length = 0;
+    uint8_t * buffer = NULL;
+    for (;;) {
+        if (length == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            uint8_t * new_buffer = realloc(buffer, capacity);
+            if (!new_buffer) {
+                free(buffer);
+                return -1;
+            }
+            buffer = new_buffer;
+        }
+        ssize_t count = read(fd, &buffer[length], capacity - length);
+        if (count < 0) {
+            free(buffer);
+            return -1;
+        }
+        if (count == 0) {
+            break;
+        }
+        length += count;
+    }
+    *bytes = buffer;
+    *size = length;
+    return 0;
+}
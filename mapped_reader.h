@@ -0,0 +1,49 @@
+//
+// mapped_reader.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module provides a general reader over a memory-mapped file (or a caller's
+// in-memory buffer) that allows reading values with either endianness. Useful for
+// parsing packed formatted file data. Larger regions can be accessed in place as
+// bounds-checked spans, without copying them out.
+//
+
+#ifndef mapped_reader_h
+#define mapped_reader_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef enum _file_endianness {
+    file_endianness_little,
+    file_endianness_big
+} file_endianness;
+
+typedef struct _mapped_reader {
+    const uint8_t * bytes;
+    size_t total_size;
+    size_t offset;
+    file_endianness endianness;
+    void * mapping;         // Non-NULL if we own a file mapping
+    void * owned_buffer;    // Non-NULL if the file couldn't be mapped and was read in
+} mapped_reader;
+
+mapped_reader * open_mapped_reader(const char * path, file_endianness endianness);
+mapped_reader * open_mapped_reader_with_bytes(const void * bytes, size_t size, file_endianness endianness);
+int mapped_reader_ensure_remaining(mapped_reader * reader, size_t ensure);
+void mapped_reader_advance_to_offset(mapped_reader * reader, size_t offset);
+const uint8_t * mapped_reader_span(mapped_reader * reader, size_t offset, size_t count);
+void close_mapped_reader(mapped_reader * reader);
+
+uint8_t read_uint8(mapped_reader * reader);
+uint16_t read_uint16(mapped_reader * reader);
+uint32_t read_uint32(mapped_reader * reader);
+int8_t read_int8(mapped_reader * reader);
+int16_t read_int16(mapped_reader * reader);
+int32_t read_int32(mapped_reader * reader);
+const uint8_t * read_span(mapped_reader * reader, size_t count);
+
+#endif /* mapped_reader_h */
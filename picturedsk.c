@@ -0,0 +1,1290 @@
+//
+// picturedsk.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "picturedsk.h"
+#include "bmp_bitmap.h"
+#include "apple_gcr.h"
+#include "woz_image.h"
+#include "polar_map.h"
+#include "track_kernel.h"
+#include "work_pool.h"
+#include "dither.h"
+#include "crc32.h"
+#include "hash64.h"
+#include "woz_cache.h"
+#include "mapped_reader.h"
+#include "woz_reader.h"
+#include "flux_preview.h"
+#include "stats.h"
+
+#define SCREEN_BITMAP_DIMENSION     147
+#define SCREEN_BITMAP_STRIDE_BYTES  (SCREEN_BITMAP_DIMENSION / 7)
+#define DISPLAY_MESSAGE_OFFSET      177
+
+#define CREATOR_NAME        "PictureDSK"
+#define MAX_MESSAGE_LEN     PICTUREDSK_MAX_MESSAGE_LEN
+
+#define TRACKS_PER_DISK     46
+#define SECTORS_PER_TRACK   16
+#define BYTES_PER_SECTOR    256
+#define BYTES_PER_TRACK     (SECTORS_PER_TRACK * BYTES_PER_SECTOR)
+
+#define BITS_BLOCKS_PER_TRACK       13
+#define BITS_BLOCK_SIZE             512
+#define BITS_TRACK_SIZE             (BITS_BLOCKS_PER_TRACK * BITS_BLOCK_SIZE)
+#define BITS_SECTOR_CONTENTS_SIZE   343
+
+#define DOS_VOLUME_NUMBER           254
+#define TRACK_LEADER_SYNC_COUNT     64
+
+// This is based on the output PNG files from the current version of Applesauce.
+#define FLUX_OUTER_RADIUS           0.5
+#define FLUX_INNER_RADIUS           0.1415
+// Track 1, the first flux ring, is written at quarter-track 4 and each track after it
+// 3 quarter-tracks further in, one ring spacing apart.
+#define FLUX_OUTER_QUARTER_TRACK        4
+#define FLUX_QUARTER_TRACKS_PER_RING    3
+
+// Previews are shared out to the track pool in bands of this many rows.
+#define PREVIEW_BAND_ROWS           8
+
+// Every disk has the same layout, so the WOZ file is always the same size.
+#define WOZ_HEADER_SIZE             12
+#define WOZ_CHUNK_HEADER_SIZE       8
+#define INFO_CHUNK_SIZE             60
+#define TMAP_CHUNK_SIZE             160
+#define TRKS_CHUNK_SIZE             (1280 + TRACKS_PER_DISK * BITS_TRACK_SIZE)
+#define WRIT_CHUNK_SIZE             (TRACKS_PER_DISK * 20)
+#define WOZ_FILE_SIZE               (WOZ_HEADER_SIZE + 4 * WOZ_CHUNK_HEADER_SIZE + INFO_CHUNK_SIZE + \
+                                     TMAP_CHUNK_SIZE + TRKS_CHUNK_SIZE + WRIT_CHUNK_SIZE)
+
+// Where the track bits start in the file. TRKS addresses them in 512-byte blocks from
+// the start of the file, so this has to fall on a block boundary.
+#define TRKS_BITS_FILE_OFFSET       (WOZ_HEADER_SIZE + 3 * WOZ_CHUNK_HEADER_SIZE + INFO_CHUNK_SIZE + \
+                                     TMAP_CHUNK_SIZE + 1280)
+_Static_assert(TRKS_BITS_FILE_OFFSET % BITS_BLOCK_SIZE == 0, "TRKS bits must start on a block boundary");
+
+// Where each chunk's header is in the file.
+#define INFO_CHUNK_FILE_OFFSET      WOZ_HEADER_SIZE
+#define TMAP_CHUNK_FILE_OFFSET      (INFO_CHUNK_FILE_OFFSET + WOZ_CHUNK_HEADER_SIZE + INFO_CHUNK_SIZE)
+#define TRKS_CHUNK_FILE_OFFSET      (TMAP_CHUNK_FILE_OFFSET + WOZ_CHUNK_HEADER_SIZE + TMAP_CHUNK_SIZE)
+#define WRIT_CHUNK_FILE_OFFSET      (TRKS_CHUNK_FILE_OFFSET + WOZ_CHUNK_HEADER_SIZE + TRKS_CHUNK_SIZE)
+
+// Everything up to the end of track 0's bits: all that restamping needs, but WRIT.
+#define RESTAMP_HEAD_SIZE           (TRKS_BITS_FILE_OFFSET + BITS_TRACK_SIZE)
+
+struct _picturedsk_context {
+    polar_map_cache * maps;
+    work_pool * track_pool;         // Renders the tracks of one disk in parallel, if not NULL
+    pthread_mutex_t spare_lock;
+    woz_file ** spare_wozs;         // Arenas of finished disks, kept for reuse
+    int spare_count;
+    int spare_capacity;
+    woz_cache * outputs;            // Finished disks, if not NULL
+};
+
+//
+// Helper types and routines.
+//
+
+// One disk's worth of track rendering work. Each track is rendered straight into its
+// slot in the TRKS chunk.
+typedef struct _track_render {
+    uint8_t * bits;             // TRACKS_PER_DISK tracks of BITS_TRACK_SIZE bytes
+    uint32_t * crcs;            // And the CRC of each
+    uint8_t * track_0;          // .DSK-format contents of track 0
+    const luma_bitmap * luma;
+    const luma_sums * sums;     // For box sampling, else NULL
+    const polar_map * map;
+    dither_mode dither;
+    job_stats * stats;          // The building thread's, so pool threads count into it too
+} track_render;
+
+// Disks are cached under a hash of everything they're made from. The tracks key leaves
+// out the message, since the message can be changed by restamping.
+typedef struct _woz_cache_keys {
+    uint64_t disk;
+    uint64_t tracks;
+} woz_cache_keys;
+
+typedef struct _preview_render {
+    const flux_preview * preview;
+    uint8_t * pixels;
+    int size;
+} preview_render;
+
+// Change this whenever the same image and options start to make a different disk.
+#define WOZ_CACHE_KEY_VERSION       1
+
+static picturedsk_status build_woz(picturedsk_context * context, const luma_bitmap * luma,
+                                   const picturedsk_options * options, woz_file ** result);
+static picturedsk_status woz_to_buffer(woz_file * woz, void * buffer, size_t capacity, size_t * size);
+static picturedsk_status status_for_bmp_error(bmp_error error);
+static luma_bitmap * luma_from_image(const picturedsk_image * image);
+static void render_track(void * context, int index);
+static void render_diffused_tracks(track_render * render);
+static void sample_ring(const track_render * render, int ring, uint8_t * lumas);
+static dither_mode dither_mode_for_option(picturedsk_dither dither);
+static int hgr_span(int index, int size, int * start);
+static picturedsk_status bmp_file_to_cached_woz_file(picturedsk_context * context, const char * bmp_path,
+                                                     const char * woz_path, const picturedsk_options * options);
+static woz_cache_keys make_woz_cache_keys(const void * bmp, size_t bmp_size, const picturedsk_options * options);
+static int open_cached_woz(picturedsk_context * context, const woz_cache_keys * keys, const char * message,
+                           woz_cache_entry * kind);
+static void add_to_woz_cache(picturedsk_context * context, const woz_cache_keys * keys, uint8_t * woz,
+                             const char * message);
+static picturedsk_status render_preview(picturedsk_context * context, const woz_reader * reader, int size,
+                                        uint8_t * pixels);
+static void render_preview_band(void * context, int index);
+static picturedsk_status status_for_woz_error(woz_error error);
+static woz_file * acquire_woz(picturedsk_context * context);
+static void release_woz(picturedsk_context * context, woz_file * woz);
+
+static void prepare_track_0_template(void);
+static void stamp_message(uint8_t * sector, const char * message);
+static picturedsk_status restamp_woz_spans(uint8_t * head, uint8_t * writ_chunk, const char * message,
+                                           size_t * field_offset, size_t * field_count);
+static int restamp_chunk_is_valid(const uint8_t * chunk, const char * name, uint32_t size);
+static int pread_fully(int fd, void * bytes, size_t count, off_t offset);
+static int pwrite_fully(int fd, const void * bytes, size_t count, off_t offset);
+static uint16_t load_le16(const uint8_t * p);
+static uint32_t load_le32(const uint8_t * p);
+static void store_le32(uint8_t * p, uint32_t value);
+
+static const uint8_t boot_1_sector_0[BYTES_PER_SECTOR];
+static const uint8_t boot_2_sector_F[BYTES_PER_SECTOR];
+
+// Track 0's layout is the same on every disk, so its fixed bits are encoded just once.
+static gcr_track_template track_0_template;
+static pthread_once_t track_0_template_once = PTHREAD_ONCE_INIT;
+
+//
+// Public routines
+//
+
+picturedsk_context * picturedsk_create_context(const char * map_cache_dir, int thread_count)
+{
+    picturedsk_context * context = calloc(1, sizeof(picturedsk_context));
+    if (!context) {
+        return NULL;
+    }
+    pthread_mutex_init(&context->spare_lock, NULL);
+    context->maps = create_polar_map_cache(map_cache_dir);
+    if (thread_count > 1) {
+        context->track_pool = create_work_pool(thread_count);
+    }
+    if (!context->maps || (thread_count > 1 && !context->track_pool)) {
+        picturedsk_free_context(context);
+        return NULL;
+    }
+    return context;
+}
+
+void picturedsk_free_context(picturedsk_context * context)
+{
+    if (context) {
+        free_work_pool(context->track_pool);
+        free_polar_map_cache(context->maps);
+        for (int i = 0; i < context->spare_count; i++) {
+            free_woz_file(context->spare_wozs[i]);
+        }
+        free(context->spare_wozs);
+        free_woz_cache(context->outputs);
+        pthread_mutex_destroy(&context->spare_lock);
+        free(context);
+    }
+}
+
+picturedsk_status picturedsk_set_woz_cache(picturedsk_context * context, const char * cache_dir, uint64_t max_size)
+{
+    if (!context || !cache_dir) {
+        return picturedsk_error_invalid_argument;
+    }
+    woz_cache * outputs = create_woz_cache(cache_dir, max_size);
+    if (!outputs) {
+        return picturedsk_error_output_open_failed;
+    }
+    free_woz_cache(context->outputs);
+    context->outputs = outputs;
+    return picturedsk_ok;
+}
+
+void picturedsk_default_options(picturedsk_options * options)
+{
+    memset(options, 0, sizeof(picturedsk_options));
+}
+
+size_t picturedsk_woz_size(void)
+{
+    return WOZ_FILE_SIZE;
+}
+
+picturedsk_status picturedsk_bmp_to_woz(picturedsk_context * context, const void * bmp, size_t bmp_size,
+                                        const picturedsk_options * options,
+                                        void * woz, size_t woz_capacity, size_t * woz_size)
+{
+    if (!context || !bmp || !woz || !woz_size) {
+        return picturedsk_error_invalid_argument;
+    }
+    picturedsk_options default_options;
+    if (!options) {
+        picturedsk_default_options(&default_options);
+        options = &default_options;
+    }
+
+    // A cached disk is read straight into the caller's buffer.
+    woz_cache_keys keys;
+    if (context->outputs) {
+        if (woz_capacity < WOZ_FILE_SIZE) {
+            return picturedsk_error_buffer_too_small;
+        }
+        keys = make_woz_cache_keys(bmp, bmp_size, options);
+        woz_cache_entry kind;
+        int entry_fd = open_cached_woz(context, &keys, options->message, &kind);
+        if (entry_fd >= 0) {
+            int ok = pread(entry_fd, woz, WOZ_FILE_SIZE, 0) == WOZ_FILE_SIZE &&
+                     (kind == woz_cache_entry_disk ||
+                      picturedsk_restamp_woz(woz, WOZ_FILE_SIZE, options->message) == picturedsk_ok);
+            close(entry_fd);
+            if (ok) {
+                *woz_size = WOZ_FILE_SIZE;
+                return picturedsk_ok;
+            }
+        }
+    }
+
+    bmp_error bmp_error = bmp_error_none;
+    luma_bitmap * luma = load_bmp_bytes_into_luma_bitmap(bmp, bmp_size, &bmp_error);
+    if (!luma) {
+        return status_for_bmp_error(bmp_error);
+    }
+    woz_file * woz_file = NULL;
+    picturedsk_status status = build_woz(context, luma, options, &woz_file);
+    if (status == picturedsk_ok) {
+        status = woz_to_buffer(woz_file, woz, woz_capacity, woz_size);
+    }
+    if (status == picturedsk_ok && context->outputs) {
+        add_to_woz_cache(context, &keys, woz, options->message);
+    }
+    release_woz(context, woz_file);
+    free_luma_bitmap(luma);
+    return status;
+}
+
+picturedsk_status picturedsk_image_to_woz(picturedsk_context * context, const picturedsk_image * image,
+                                          const picturedsk_options * options,
+                                          void * woz, size_t woz_capacity, size_t * woz_size)
+{
+    if (!context || !image || !image->pixels || !woz || !woz_size ||
+        !bitmap_size_is_supported(image->width, image->height) ||
+        (image->format != picturedsk_pixel_format_grey8 && image->format != picturedsk_pixel_format_rgba8) ||
+        image->bytes_per_line < (size_t)image->width * ((image->format == picturedsk_pixel_format_rgba8) ? 4 : 1)) {
+        return picturedsk_error_invalid_argument;
+    }
+    luma_bitmap * luma = luma_from_image(image);
+    if (!luma) {
+        return picturedsk_error_out_of_memory;
+    }
+    woz_file * woz_file = NULL;
+    picturedsk_status status = build_woz(context, luma, options, &woz_file);
+    if (status == picturedsk_ok) {
+        status = woz_to_buffer(woz_file, woz, woz_capacity, woz_size);
+    }
+    release_woz(context, woz_file);
+    free_luma_bitmap(luma);
+    return status;
+}
+
+picturedsk_status picturedsk_bmp_to_woz_alloc(picturedsk_context * context, const void * bmp, size_t bmp_size,
+                                              const picturedsk_options * options,
+                                              uint8_t ** woz, size_t * woz_size)
+{
+    if (!woz) {
+        return picturedsk_error_invalid_argument;
+    }
+    *woz = malloc(WOZ_FILE_SIZE);
+    if (!*woz) {
+        return picturedsk_error_out_of_memory;
+    }
+    picturedsk_status status = picturedsk_bmp_to_woz(context, bmp, bmp_size, options, *woz, WOZ_FILE_SIZE, woz_size);
+    if (status != picturedsk_ok) {
+        free(*woz);
+        *woz = NULL;
+    }
+    return status;
+}
+
+void picturedsk_free_woz(uint8_t * woz)
+{
+    free(woz);
+}
+
+picturedsk_status picturedsk_bmp_file_to_woz_file(picturedsk_context * context, const char * bmp_path,
+                                                  const char * woz_path, const picturedsk_options * options)
+{
+    if (!context || !bmp_path || !woz_path) {
+        return picturedsk_error_invalid_argument;
+    }
+    if (context->outputs) {
+        return bmp_file_to_cached_woz_file(context, bmp_path, woz_path, options);
+    }
+    bmp_error bmp_error = bmp_error_none;
+    luma_bitmap * luma = load_bmp_into_luma_bitmap(bmp_path, &bmp_error);
+    if (!luma) {
+        return status_for_bmp_error(bmp_error);
+    }
+    woz_file * woz = NULL;
+    picturedsk_status status = build_woz(context, luma, options, &woz);
+    if (status == picturedsk_ok) {
+        int result = write_woz_to_file(woz, woz_path);
+        if (result == -1) {
+            status = picturedsk_error_output_open_failed;
+        } else if (result != 0) {
+            status = picturedsk_error_output_write_failed;
+        }
+    }
+    release_woz(context, woz);
+    free_luma_bitmap(luma);
+    return status;
+}
+
+const char * picturedsk_status_string(picturedsk_status status)
+{
+    switch (status) {
+        case picturedsk_ok:
+            return "OK";
+        case picturedsk_error_invalid_argument:
+            return "Invalid argument";
+        case picturedsk_error_out_of_memory:
+            return "Out of memory";
+        case picturedsk_error_buffer_too_small:
+            return "Output buffer too small";
+        case picturedsk_error_image_open_failed:
+            return "Could not open image file";
+        case picturedsk_error_image_invalid:
+            return "Invalid BMP file";
+        case picturedsk_error_image_unsupported:
+            return "Unsupported BMP format (1, 4, 8, 24 and 32 bits per pixel, uncompressed, up to 500 million pixels, are supported)";
+        case picturedsk_error_output_open_failed:
+            return "Failed to open output file";
+        case picturedsk_error_output_write_failed:
+            return "Error writing woz output";
+        case picturedsk_error_woz_invalid:
+            return "Not a valid WOZ image, or not one made by picturedsk";
+    }
+    return "Unknown error";
+}
+
+//
+// Restamping. The message is only in sector F of track 0, so changing it only changes
+// that sector's data field, track 0's CRC in WRIT, and the file CRC. The file is checked
+// against the layout build_woz() makes (and track 0 against its own CRC) before anything
+// is changed, so anything else is rejected untouched.
+//
+
+picturedsk_status picturedsk_restamp_woz(void * woz, size_t woz_size, const char * message)
+{
+    if (!woz) {
+        return picturedsk_error_invalid_argument;
+    }
+    if (woz_size != WOZ_FILE_SIZE) {
+        return picturedsk_error_woz_invalid;
+    }
+    uint8_t * bytes = woz;
+    return restamp_woz_spans(bytes, &bytes[WRIT_CHUNK_FILE_OFFSET], message, NULL, NULL);
+}
+
+// Only the spans restamping looks at are read, and only the bytes it changes are
+// written back.
+picturedsk_status picturedsk_restamp_woz_file(const char * woz_path, const char * message)
+{
+    if (!woz_path) {
+        return picturedsk_error_invalid_argument;
+    }
+    int fd = open(woz_path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return picturedsk_error_output_open_failed;
+    }
+    picturedsk_status status = picturedsk_ok;
+    uint8_t head[RESTAMP_HEAD_SIZE];
+    uint8_t writ[WOZ_CHUNK_HEADER_SIZE + WRIT_CHUNK_SIZE];
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != WOZ_FILE_SIZE ||
+        pread_fully(fd, head, sizeof(head), 0) != 0 ||
+        pread_fully(fd, writ, sizeof(writ), WRIT_CHUNK_FILE_OFFSET) != 0) {
+        status = picturedsk_error_woz_invalid;
+        goto Done;
+    }
+    size_t field_offset;
+    size_t field_count;
+    status = restamp_woz_spans(head, writ, message, &field_offset, &field_count);
+    if (status != picturedsk_ok) {
+        goto Done;
+    }
+    // The header's CRC goes last, so a disk cut short on the way is seen to be bad.
+    size_t writ_crc_offset = WOZ_CHUNK_HEADER_SIZE + 4;
+    if (pwrite_fully(fd, &head[field_offset], field_count, field_offset) != 0 ||
+        pwrite_fully(fd, &writ[writ_crc_offset], 4, WRIT_CHUNK_FILE_OFFSET + writ_crc_offset) != 0 ||
+        pwrite_fully(fd, &head[8], 4, 8) != 0) {
+        status = picturedsk_error_output_write_failed;
+    }
+
+Done:
+    if (close(fd) != 0 && status == picturedsk_ok) {
+        status = picturedsk_error_output_write_failed;
+    }
+    return status;
+}
+
+//
+// Previews.
+//
+
+picturedsk_status picturedsk_woz_to_preview(picturedsk_context * context, const void * woz, size_t woz_size,
+                                            int size, uint8_t * pixels)
+{
+    if (!context || !woz || !pixels || size <= 0 || size > PICTUREDSK_MAX_PREVIEW_SIZE) {
+        return picturedsk_error_invalid_argument;
+    }
+    woz_error error = woz_error_none;
+    woz_reader * reader = open_woz_reader_with_bytes(woz, woz_size, &error);
+    if (!reader) {
+        return status_for_woz_error(error);
+    }
+    picturedsk_status status = render_preview(context, reader, size, pixels);
+    close_woz_reader(reader);
+    return status;
+}
+
+picturedsk_status picturedsk_woz_file_to_preview_bmp_file(picturedsk_context * context, const char * woz_path,
+                                                          const char * bmp_path, int size)
+{
+    if (!context || !woz_path || !bmp_path || size <= 0 || size > PICTUREDSK_MAX_PREVIEW_SIZE) {
+        return picturedsk_error_invalid_argument;
+    }
+    woz_error error = woz_error_none;
+    woz_reader * reader = open_woz_reader(woz_path, &error);
+    if (!reader) {
+        return status_for_woz_error(error);
+    }
+    picturedsk_status status = picturedsk_error_out_of_memory;
+    luma_bitmap * luma = create_luma_bitmap(size, size);
+    if (luma) {
+        status = render_preview(context, reader, size, luma->pixels);
+    }
+    if (status == picturedsk_ok) {
+        int result = write_luma_bitmap_to_bmp(luma, bmp_path);
+        if (result == -1) {
+            status = picturedsk_error_output_open_failed;
+        } else if (result != 0) {
+            status = picturedsk_error_output_write_failed;
+        }
+    }
+    free_luma_bitmap(luma);
+    close_woz_reader(reader);
+    return status;
+}
+
+//
+// Building one disk. Everything this touches is either its own or read-only shared
+// state (the boot sectors, sampling maps and lookup tables), so any number of these can
+// run at once on different threads.
+//
+
+static
+picturedsk_status build_woz(picturedsk_context * context, const luma_bitmap * luma,
+                            const picturedsk_options * options, woz_file ** result)
+{
+    picturedsk_options default_options;
+    if (!options) {
+        picturedsk_default_options(&default_options);
+        options = &default_options;
+    }
+    woz_file * woz = NULL;
+    luma_sums * sums = NULL;
+    dither_mode dither = dither_mode_for_option(options->dither);
+    picturedsk_status status = picturedsk_ok;
+
+    // Box sampling averages over each sample's area, using a summed-area table of the
+    // image so that it costs the same whatever the image size.
+    if (options->filter == picturedsk_filter_box) {
+        STATS_PHASE_START(sums_start);
+        sums = create_luma_sums(luma);
+        if (!sums) {
+            goto OutOfMemory;
+        }
+        STATS_PHASE_END(sums_start, stats_phase_luma_sums, (uint64_t)luma->width * luma->height);
+    }
+
+    //
+    // Sample the bitmap to create a version in the Apple high-res format.
+    //
+    
+    STATS_PHASE_START(hgr_start);
+    int columns[SCREEN_BITMAP_DIMENSION];
+    int column_widths[SCREEN_BITMAP_DIMENSION];
+    for (int x = 0; sums && x < SCREEN_BITMAP_DIMENSION; x++) {
+        column_widths[x] = hgr_span(x, luma->width, &columns[x]);
+    }
+    error_diffuser diffuser;
+    int16_t diffuser_buffer[ERROR_DIFFUSER_BUFFER_COUNT(SCREEN_BITMAP_DIMENSION)];
+    init_error_diffuser(&diffuser, SCREEN_BITMAP_DIMENSION, diffuser_buffer);
+    uint8_t a2_high_res_image[SCREEN_BITMAP_STRIDE_BYTES * SCREEN_BITMAP_DIMENSION];
+    uint8_t * a2_dest_ptr = &a2_high_res_image[0];
+    uint8_t shiftreg = 0x80;
+    int shiftreg_valid = 0;
+    for (int y = 0; y < SCREEN_BITMAP_DIMENSION; y++) {
+        // Sample the row's greys, then dither them down to one bit each.
+        uint8_t greys[SCREEN_BITMAP_DIMENSION];
+        int row = 0;
+        int row_height = sums ? hgr_span(y, luma->height, &row) : 0;
+        for (int x = 0; x < SCREEN_BITMAP_DIMENSION; x++) {
+            if (sums) {
+                greys[x] = sample_luma_sums(sums, columns[x], row, columns[x] + column_widths[x], row + row_height);
+            } else {
+                float u = x / (float)SCREEN_BITMAP_DIMENSION;
+                float v = y / (float)SCREEN_BITMAP_DIMENSION;
+                greys[x] = sample_luma_bitmap(luma, u, v);
+            }
+        }
+        uint8_t light[SCREEN_BITMAP_DIMENSION];
+        if (dither == dither_mode_diffusion) {
+            error_diffuse_row(&diffuser, greys, light);
+        } else {
+            uint8_t thresholds[SCREEN_BITMAP_DIMENSION];
+            dither_threshold_row(dither, y, thresholds, SCREEN_BITMAP_DIMENSION);
+            for (int x = 0; x < SCREEN_BITMAP_DIMENSION; x++) {
+                light[x] = (greys[x] >= thresholds[x]);
+            }
+        }
+
+        for (int x = 0; x < SCREEN_BITMAP_DIMENSION; x++) {
+            uint8_t bit = 1 << shiftreg_valid;
+            if (light[x]) {
+                shiftreg |= bit;
+            }
+            if (++shiftreg_valid == 7) {
+                *a2_dest_ptr++ = shiftreg;
+                shiftreg = 0x80;
+                shiftreg_valid = 0;
+            }
+        }
+    }
+    
+    //
+    // Build the .DSK-format data for the first (and sole valid) track on the disk.
+    // Shuffle the image data into the interleaved disk sectors, so it'll end
+    // up loaded consecutively at $B100. The boot1 boot loader goes in
+    // sector 0, and the boot2 code goes in sector F.
+    //
+
+    uint8_t track_0[SECTORS_PER_TRACK * BYTES_PER_SECTOR];
+    memset(track_0, 0, SECTORS_PER_TRACK * BYTES_PER_SECTOR);
+    memcpy(&track_0[0x000], boot_1_sector_0, BYTES_PER_SECTOR);
+    memcpy(&track_0[0x800], &a2_high_res_image[0x000], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x100], &a2_high_res_image[0x100], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x900], &a2_high_res_image[0x200], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x200], &a2_high_res_image[0x300], BYTES_PER_SECTOR);
+    memcpy(&track_0[0xA00], &a2_high_res_image[0x400], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x300], &a2_high_res_image[0x500], BYTES_PER_SECTOR);
+    memcpy(&track_0[0xB00], &a2_high_res_image[0x600], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x400], &a2_high_res_image[0x700], BYTES_PER_SECTOR);
+    memcpy(&track_0[0xC00], &a2_high_res_image[0x800], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x500], &a2_high_res_image[0x900], BYTES_PER_SECTOR);
+    memcpy(&track_0[0xD00], &a2_high_res_image[0xA00], BYTES_PER_SECTOR);
+    memcpy(&track_0[0x600], &a2_high_res_image[0xB00], BYTES_PER_SECTOR);
+    memcpy(&track_0[0xE00], &a2_high_res_image[0xC00], 15); // This is how many valid bytes are left in the image.
+    memcpy(&track_0[0xF00], boot_2_sector_F, BYTES_PER_SECTOR);
+    
+    // Fixup the custom display string if one is supplied
+    stamp_message(&track_0[0xF00], options->message);
+    STATS_PHASE_END(hgr_start, stats_phase_hgr_sample, sizeof(a2_high_res_image));
+    
+    //
+    // Lay out the WOZ file. Everything in it but the track bits (and their CRCs) is
+    // known already, and the tracks are then rendered straight into their slots.
+    //
+    
+    STATS_PHASE_START(layout_start);
+    woz = acquire_woz(context);
+    if (!woz) {
+        goto OutOfMemory;
+    }
+    
+    // Build INFO chunk
+    chunk_write_uint8(woz->info, 2); // INFO v2
+    chunk_write_uint8(woz->info, 1); // 5.25" image
+    chunk_write_uint8(woz->info, 1); // Write protected
+    chunk_write_uint8(woz->info, 1); // Synchronized
+    chunk_write_uint8(woz->info, 1); // Cleaned
+    chunk_write_utf8(woz->info, CREATOR_NAME, 32); // Creator
+    chunk_write_uint8(woz->info, 1); // 1 disk side
+    chunk_write_uint8(woz->info, 1); // 16-sector format
+    chunk_write_uint8(woz->info, 32); // 4uS standard bit timing
+    chunk_write_uint16(woz->info, 0x7F); // Should work on the whole ][ series (?)
+    chunk_write_uint16(woz->info, 64); // I think this requires 64k (?)
+    chunk_write_uint16(woz->info, BITS_BLOCKS_PER_TRACK); // Largest track size (all are same)
+    chunk_set_mark(woz->info, INFO_CHUNK_SIZE); // The rest of the chunk is reserved, as zeros
+    
+    // Build TMAP chunk
+    //
+    // Track 0 appears at its normal location with its normal bleed-over into 0.25, with the
+    // normal gap at 0.5. The rest of the tracks are all side-by-each starting at position 1.0,
+    // with no gap between the sets of three "detected" bits. The rest of the chunk gets the 0xFF
+    // nothing-marker (not zeros which would indicate something else).
+    chunk_write_uint8(woz->tmap, 0);
+    chunk_write_uint8(woz->tmap, 0);
+    chunk_write_uint8(woz->tmap, 0xFF);
+    int tmap_nominal_track = 0; // start at 0 so the first loop increments to 1
+    for (int i = 3; i < 160; i++) {
+        if (i % 3 == 0) tmap_nominal_track++;
+        if (tmap_nominal_track < TRACKS_PER_DISK) {
+            chunk_write_uint8(woz->tmap, tmap_nominal_track);
+        } else {
+            chunk_write_uint8(woz->tmap, 0xFF);
+        }
+    }
+    
+    // Build TRKS chunk
+    // !!! starting_block is relative to the start of the file !!! This means we rely on
+    // writing the chunks in a fixed order up to this point (INFO, TMAP, TRKS, ...).
+    uint16_t starting_block = TRKS_BITS_FILE_OFFSET / BITS_BLOCK_SIZE;
+    for (int i = 0 ; i < TRACKS_PER_DISK; i++) {
+        chunk_write_uint16(woz->trks, starting_block);
+        chunk_write_uint16(woz->trks, BITS_BLOCKS_PER_TRACK);
+        chunk_write_uint32(woz->trks, (uint32_t)BITS_TRACK_SIZE * 8);
+        starting_block += BITS_BLOCKS_PER_TRACK;
+    }
+    chunk_set_mark(woz->trks, 1280);
+    uint8_t * track_bits = chunk_reserve_bytes(woz->trks, TRACKS_PER_DISK * BITS_TRACK_SIZE);
+    STATS_PHASE_END(layout_start, stats_phase_chunk_assembly, woz_size_on_disk(woz) - TRACKS_PER_DISK * BITS_TRACK_SIZE);
+
+    //
+    // Render all of the disk's tracks.
+    //
+    
+    // All tracks on the disk are the same size (13 WOZ blocks). Track 0 is the one "valid"
+    // track, and the rest are a polar coordinate texture sampling of the input bitmap
+    // image. The sample positions only depend on the image size, so they come from a
+    // shared map.
+    polar_geometry geometry;
+    geometry.ring_count = TRACKS_PER_DISK - 1;
+    geometry.samples_per_ring = BITS_TRACK_SIZE;
+    geometry.outer_radius = FLUX_OUTER_RADIUS;
+    geometry.inner_radius = FLUX_INNER_RADIUS;
+    geometry.sampling = sums ? polar_sampling_box : polar_sampling_point;
+    const polar_map * map = polar_map_for_image(context->maps, &geometry, luma->width, luma->height);
+    if (!map) {
+        goto OutOfMemory;
+    }
+
+    // Every track only writes its own slot and CRC, so they're rendered in parallel on the
+    // track pool (if there is one), with the same result in any order. Error diffusion
+    // carries on from each track to the next, though, so then the flux tracks are
+    // rendered in order on this thread.
+    uint32_t track_crcs[TRACKS_PER_DISK];
+    track_render render;
+    render.bits = track_bits;
+    render.crcs = track_crcs;
+    render.track_0 = track_0;
+    render.luma = luma;
+    render.sums = sums;
+    render.map = map;
+    render.dither = dither;
+    render.stats = current_job_stats;
+    if (dither == dither_mode_diffusion) {
+        render_track(&render, 0);
+        render_diffused_tracks(&render);
+    } else {
+        work_pool_run(context->track_pool, TRACKS_PER_DISK, render_track, &render);
+    }
+
+    // The tracks' CRCs are reused for the file CRC.
+    STATS_PHASE_START(writ_start);
+    for (int i = 0 ; i < TRACKS_PER_DISK; i++) {
+        chunk_note_crc(woz->trks, 1280 + (size_t)i * BITS_TRACK_SIZE, BITS_TRACK_SIZE, track_crcs[i]);
+    }
+
+    // Build WRIT chunk
+    int subtrack_index = 0;
+    for (int i = 0; i < TRACKS_PER_DISK; i++) {
+        // Track 0 is written at subtrack 0.0. skip to track 1.0 for track 1, but then every 3
+        // after that.
+        chunk_write_uint8(woz->writ, subtrack_index);
+        subtrack_index += ((i == 0) ? 4 : 3);
+        chunk_write_uint8(woz->writ, 1);        // 1 command in this set
+        chunk_write_uint8(woz->writ, 0x01);     // Clear first
+        chunk_write_uint8(woz->writ, 0);        // Reserved (0)
+        chunk_write_uint32(woz->writ, track_crcs[i]);  // BITS checksum
+        chunk_write_uint32(woz->writ, 0);       // Don't write leader
+        chunk_write_uint32(woz->writ, (uint32_t)BITS_TRACK_SIZE * 8);
+        chunk_write_uint8(woz->writ, 0x00);     // Leader nibble
+        chunk_write_uint8(woz->writ, 0);        // Leader nibble count
+        chunk_write_uint8(woz->writ, 0);        // Leader count
+        chunk_write_uint8(woz->writ, 0);        // Reserved (0)
+    }
+    STATS_PHASE_END(writ_start, stats_phase_chunk_assembly, WRIT_CHUNK_SIZE);
+    
+    goto Done;
+
+OutOfMemory:
+    status = picturedsk_error_out_of_memory;
+    release_woz(context, woz);
+    woz = NULL;
+
+Done:
+    free_luma_sums(sums);
+    *result = woz;
+    return status;
+}
+
+static
+void render_track(void * context, int index)
+{
+    track_render * render = context;
+    uint8_t * bits = &render->bits[(size_t)index * BITS_TRACK_SIZE];
+    job_stats * previous_stats = stats_attach(render->stats);
+    STATS_PHASE_START(render_start);
+    if (index == 0) {
+        pthread_once(&track_0_template_once, prepare_track_0_template);
+        gcr_encode_track_from_template(bits, &track_0_template, render->track_0);
+        STATS_PHASE_END(render_start, stats_phase_gcr_encode, BITS_TRACK_SIZE);
+    } else {
+        // The rows of the dither mask run around the tracks, one row per track.
+        uint8_t thresholds[BITS_TRACK_SIZE];
+        dither_threshold_row(render->dither, index - 1, thresholds, BITS_TRACK_SIZE);
+        if (render->sums) {
+            track_kernel_render_boxes(bits, render->sums->sums, LUMA_SUMS_STRIDE(render->sums),
+                                      POLAR_MAP_BOX_RING(render->map, index - 1), thresholds, BITS_TRACK_SIZE);
+        } else {
+            track_kernel_render(bits, render->luma->pixels, POLAR_MAP_RING(render->map, index - 1),
+                                thresholds, BITS_TRACK_SIZE);
+        }
+        STATS_PHASE_END(render_start, stats_phase_flux_sample, BITS_TRACK_SIZE);
+    }
+
+    // Each track's CRC is needed for its WRIT entry, and is also reused for the file CRC.
+    STATS_PHASE_START(crc_start);
+    render->crcs[index] = woz_crc32(bits, BITS_TRACK_SIZE);
+    STATS_PHASE_END(crc_start, stats_phase_crc, BITS_TRACK_SIZE);
+    stats_attach(previous_stats);
+}
+
+// Renders every flux track in order from the outside in, diffusing each track's errors
+// into the next.
+static
+void render_diffused_tracks(track_render * render)
+{
+    error_diffuser diffuser;
+    int16_t diffuser_buffer[ERROR_DIFFUSER_BUFFER_COUNT(BITS_TRACK_SIZE)];
+    init_error_diffuser(&diffuser, BITS_TRACK_SIZE, diffuser_buffer);
+    uint8_t light[BITS_TRACK_SIZE];
+    for (int index = 1; index < TRACKS_PER_DISK; index++) {
+        uint8_t * bits = &render->bits[(size_t)index * BITS_TRACK_SIZE];
+        STATS_PHASE_START(render_start);
+        sample_ring(render, index - 1, light);
+        error_diffuse_row(&diffuser, light, light);
+        for (int i = 0; i < BITS_TRACK_SIZE; i++) {
+            bits[i] = light[i] ? TRACK_NIBBLE_LIGHT : TRACK_NIBBLE_DARK;
+        }
+        STATS_PHASE_END(render_start, stats_phase_flux_sample, BITS_TRACK_SIZE);
+
+        STATS_PHASE_START(crc_start);
+        render->crcs[index] = woz_crc32(bits, BITS_TRACK_SIZE);
+        STATS_PHASE_END(crc_start, stats_phase_crc, BITS_TRACK_SIZE);
+    }
+}
+
+static
+void sample_ring(const track_render * render, int ring, uint8_t * lumas)
+{
+    if (render->sums) {
+        track_kernel_sample_boxes(lumas, render->sums->sums, LUMA_SUMS_STRIDE(render->sums),
+                                  POLAR_MAP_BOX_RING(render->map, ring), BITS_TRACK_SIZE);
+    } else {
+        track_kernel_sample(lumas, render->luma->pixels, POLAR_MAP_RING(render->map, ring), BITS_TRACK_SIZE);
+    }
+}
+
+//
+// Helpers
+//
+
+// Writes the message into the boot2 sector, if there is one; otherwise the sector keeps
+// its default message.
+static
+void stamp_message(uint8_t * sector, const char * message)
+{
+    if (!message) {
+        return;
+    }
+    int message_len = (int)strlen(message);
+    if (message_len > MAX_MESSAGE_LEN) message_len = MAX_MESSAGE_LEN;
+    char * message_base = (char *)&sector[DISPLAY_MESSAGE_OFFSET];
+    for (int i = 0; i < message_len; i++) {
+        char ch = message[i];
+        if (ch >= 'a' && ch <= 'z') {
+            ch -= 0x20;
+        }
+        if (ch < ' ' || ch > '_') {
+            ch = ' ';
+        }
+        message_base[i] = ch;
+    }
+    // Two newlines and the terminal nul.
+    message_base[message_len] = 0x0D;
+    message_base[message_len + 1] = 0x0D;
+    message_base[message_len + 2] = 0x00;
+}
+
+// Restamps a disk given its first RESTAMP_HEAD_SIZE bytes and its WRIT chunk, which is
+// all it needs. If field_offset isn't NULL, the changed bytes of track 0 are reported
+// there; the others are the file CRC and track 0's WRIT checksum.
+static
+picturedsk_status restamp_woz_spans(uint8_t * head, uint8_t * writ_chunk, const char * message,
+                                    size_t * field_offset, size_t * field_count)
+{
+    const uint8_t magic[8] = { 'W', 'O', 'Z', '2', 0xFF, '\n', '\r', '\n' };
+    if (memcmp(head, magic, sizeof(magic)) != 0 ||
+        !restamp_chunk_is_valid(&head[INFO_CHUNK_FILE_OFFSET], "INFO", INFO_CHUNK_SIZE) ||
+        !restamp_chunk_is_valid(&head[TMAP_CHUNK_FILE_OFFSET], "TMAP", TMAP_CHUNK_SIZE) ||
+        !restamp_chunk_is_valid(&head[TRKS_CHUNK_FILE_OFFSET], "TRKS", TRKS_CHUNK_SIZE) ||
+        !restamp_chunk_is_valid(writ_chunk, "WRIT", WRIT_CHUNK_SIZE)) {
+        return picturedsk_error_woz_invalid;
+    }
+    const uint8_t * info = &head[INFO_CHUNK_FILE_OFFSET + WOZ_CHUNK_HEADER_SIZE];
+    const uint8_t * trks = &head[TRKS_CHUNK_FILE_OFFSET + WOZ_CHUNK_HEADER_SIZE];
+    uint8_t * writ = &writ_chunk[WOZ_CHUNK_HEADER_SIZE];
+    if (memcmp(&info[5], CREATOR_NAME, strlen(CREATOR_NAME)) != 0 ||
+        load_le16(&trks[0]) != TRKS_BITS_FILE_OFFSET / BITS_BLOCK_SIZE ||
+        load_le16(&trks[2]) != BITS_BLOCKS_PER_TRACK) {
+        return picturedsk_error_woz_invalid;
+    }
+    uint8_t * track = &head[TRKS_BITS_FILE_OFFSET];
+    uint32_t track_crc = load_le32(&writ[4]);
+    if (woz_crc32(track, BITS_TRACK_SIZE) != track_crc) {
+        return picturedsk_error_woz_invalid;
+    }
+
+    // Encode the new sector F into a copy of the bytes its data field spans.
+    pthread_once(&track_0_template_once, prepare_track_0_template);
+    int physical_sector = 0;
+    while (track_0_template.logical_sectors[physical_sector] != 0x0F) {
+        physical_sector++;
+    }
+    size_t bit_index = track_0_template.data_field_bit_offsets[physical_sector];
+    size_t first = bit_index / 8;
+    size_t count = (bit_index + GCR_ENCODED_SECTOR_SIZE * 8 + 7) / 8 - first;
+    uint8_t sector[BYTES_PER_SECTOR];
+    memcpy(sector, boot_2_sector_F, BYTES_PER_SECTOR);
+    stamp_message(sector, message);
+    uint8_t field[GCR_ENCODED_SECTOR_SIZE + 1];
+    memcpy(field, &track[first], count);
+    gcr_encode_sector_at(field, bit_index % 8, sector);
+
+    // Patch the CRCs for the changed bytes, then change them.
+    size_t field_file_offset = TRKS_BITS_FILE_OFFSET + first;
+    size_t writ_crc_offset = WRIT_CHUNK_FILE_OFFSET + WOZ_CHUNK_HEADER_SIZE + 4;
+    uint8_t new_track_crc[4];
+    store_le32(new_track_crc, crc32_patch(track_crc, &track[first], field, count, BITS_TRACK_SIZE - first - count));
+    uint32_t file_crc = load_le32(&head[8]);
+    file_crc = crc32_patch(file_crc, &head[field_file_offset], field, count, WOZ_FILE_SIZE - field_file_offset - count);
+    file_crc = crc32_patch(file_crc, &writ[4], new_track_crc, 4, WOZ_FILE_SIZE - writ_crc_offset - 4);
+    memcpy(&track[first], field, count);
+    memcpy(&writ[4], new_track_crc, 4);
+    store_le32(&head[8], file_crc);
+    if (field_offset) {
+        *field_offset = field_file_offset;
+        *field_count = count;
+    }
+    return picturedsk_ok;
+}
+
+static
+int restamp_chunk_is_valid(const uint8_t * chunk, const char * name, uint32_t size)
+{
+    return memcmp(chunk, name, 4) == 0 && load_le32(&chunk[4]) == size;
+}
+
+// These return 0 on success, or -1 on an error or a short read or write.
+static
+int pread_fully(int fd, void * bytes, size_t count, off_t offset)
+{
+    uint8_t * p = bytes;
+    while (count > 0) {
+        ssize_t got = pread(fd, p, count, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        offset += got;
+        count -= got;
+    }
+    return 0;
+}
+
+static
+int pwrite_fully(int fd, const void * bytes, size_t count, off_t offset)
+{
+    const uint8_t * p = bytes;
+    while (count > 0) {
+        ssize_t written = pwrite(fd, p, count, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        p += written;
+        offset += written;
+        count -= written;
+    }
+    return 0;
+}
+
+static
+uint16_t load_le16(const uint8_t * p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static
+uint32_t load_le32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+void store_le32(uint8_t * p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+static
+void prepare_track_0_template(void)
+{
+    gcr_prepare_track_template(&track_0_template, 0, dsk_sector_format_dos_3_3);
+}
+
+static
+picturedsk_status woz_to_buffer(woz_file * woz, void * buffer, size_t capacity, size_t * size)
+{
+    *size = woz_size_on_disk(woz);
+    if (write_woz_to_buffer(woz, buffer, capacity) != 0) {
+        return picturedsk_error_buffer_too_small;
+    }
+    return picturedsk_ok;
+}
+
+static
+picturedsk_status status_for_bmp_error(bmp_error error)
+{
+    switch (error) {
+        case bmp_error_open_failed:
+            return picturedsk_error_image_open_failed;
+        case bmp_error_unsupported_version:
+        case bmp_error_unsupported_depth:
+        case bmp_error_unsupported_format:
+        case bmp_error_too_large:
+            return picturedsk_error_image_unsupported;
+        case bmp_error_out_of_memory:
+            return picturedsk_error_out_of_memory;
+        default:
+            return picturedsk_error_image_invalid;
+    }
+}
+
+// Copies a caller's pixel buffer into a padded luma plane.
+static
+luma_bitmap * luma_from_image(const picturedsk_image * image)
+{
+    luma_bitmap * luma = create_luma_bitmap(image->width, image->height);
+    if (!luma) {
+        return NULL;
+    }
+    for (int y = 0; y < image->height; y++) {
+        const uint8_t * src = image->pixels + (size_t)y * image->bytes_per_line;
+        uint8_t * dest = &luma->pixels[LUMA_PIXEL_BASE(luma, (size_t)0, (size_t)y)];
+        if (image->format == picturedsk_pixel_format_grey8) {
+            memcpy(dest, src, image->width);
+        } else {
+            for (int x = 0; x < image->width; x++) {
+                dest[x] = rgb_to_luma(src[0], src[1], src[2]);
+                src += 4;
+            }
+        }
+    }
+    return luma;
+}
+
+static
+dither_mode dither_mode_for_option(picturedsk_dither dither)
+{
+    switch (dither) {
+        case picturedsk_dither_bayer:
+            return dither_mode_bayer;
+        case picturedsk_dither_blue_noise:
+            return dither_mode_blue_noise;
+        case picturedsk_dither_diffusion:
+            return dither_mode_diffusion;
+        default:
+            return dither_mode_none;
+    }
+}
+
+// The pixels that one row or column of the boot screen covers, along an axis of the image
+// size pixels long. Always at least the one pixel that point sampling would use.
+static
+int hgr_span(int index, int size, int * start)
+{
+    int first = (int)((int64_t)index * size / SCREEN_BITMAP_DIMENSION);
+    int end = (int)((int64_t)(index + 1) * size / SCREEN_BITMAP_DIMENSION);
+    *start = first;
+    return (end > first) ? end - first : 1;
+}
+
+// As picturedsk_bmp_file_to_woz_file(), but the input file is hashed first, and a cached
+// disk is copied out (sharing its blocks, where the file system can) rather than made.
+static
+picturedsk_status bmp_file_to_cached_woz_file(picturedsk_context * context, const char * bmp_path,
+                                              const char * woz_path, const picturedsk_options * options)
+{
+    picturedsk_options default_options;
+    if (!options) {
+        picturedsk_default_options(&default_options);
+        options = &default_options;
+    }
+    mapped_reader * reader = open_mapped_reader(bmp_path, file_endianness_little);
+    if (!reader) {
+        return picturedsk_error_image_open_failed;
+    }
+    woz_cache_keys keys = make_woz_cache_keys(reader->bytes, reader->total_size, options);
+    picturedsk_status status = picturedsk_ok;
+    woz_cache_entry kind;
+    int entry_fd = open_cached_woz(context, &keys, options->message, &kind);
+    if (entry_fd >= 0) {
+        close_mapped_reader(reader);
+        int fd = open(woz_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            close(entry_fd);
+            return picturedsk_error_output_open_failed;
+        }
+        int error = woz_cache_copy_entry(entry_fd, fd, WOZ_FILE_SIZE);
+        error = (close(fd) != 0) || error;
+        close(entry_fd);
+        if (error) {
+            return picturedsk_error_output_write_failed;
+        }
+        if (kind == woz_cache_entry_tracks) {
+            status = picturedsk_restamp_woz_file(woz_path, options->message);
+        }
+        return status;
+    }
+
+    bmp_error bmp_error = bmp_error_none;
+    luma_bitmap * luma = load_bmp_bytes_into_luma_bitmap(reader->bytes, reader->total_size, &bmp_error);
+    close_mapped_reader(reader);
+    if (!luma) {
+        return status_for_bmp_error(bmp_error);
+    }
+    woz_file * woz = NULL;
+    status = build_woz(context, luma, options, &woz);
+    if (status == picturedsk_ok) {
+        int result = write_woz_to_file(woz, woz_path);
+        if (result == -1) {
+            status = picturedsk_error_output_open_failed;
+        } else if (result != 0) {
+            status = picturedsk_error_output_write_failed;
+        } else if (woz->image) {
+            add_to_woz_cache(context, &keys, woz->image, options->message);
+        }
+    }
+    release_woz(context, woz);
+    free_luma_bitmap(luma);
+    return status;
+}
+
+static
+woz_cache_keys make_woz_cache_keys(const void * bmp, size_t bmp_size, const picturedsk_options * options)
+{
+    uint32_t parameters[3] = { WOZ_CACHE_KEY_VERSION, options->filter, options->dither };
+    woz_cache_keys keys;
+    keys.tracks = hash64(parameters, sizeof(parameters), hash64(bmp, bmp_size, 0));
+    keys.disk = options->message ? hash64(options->message, strlen(options->message), keys.tracks) : keys.tracks;
+    return keys;
+}
+
+// A disk with the default message is only cached as tracks, since that's what it is.
+static
+int open_cached_woz(picturedsk_context * context, const woz_cache_keys * keys, const char * message,
+                    woz_cache_entry * kind)
+{
+    if (message) {
+        int fd = woz_cache_open_entry(context->outputs, woz_cache_entry_disk, keys->disk, WOZ_FILE_SIZE);
+        if (fd >= 0) {
+            *kind = woz_cache_entry_disk;
+            return fd;
+        }
+    }
+    *kind = woz_cache_entry_tracks;
+    return woz_cache_open_entry(context->outputs, woz_cache_entry_tracks, keys->tracks, WOZ_FILE_SIZE);
+}
+
+// The tracks entry is the same disk with the default message. Restamping the disk there
+// and back again is much cheaper than copying it.
+static
+void add_to_woz_cache(picturedsk_context * context, const woz_cache_keys * keys, uint8_t * woz,
+                      const char * message)
+{
+    if (message) {
+        woz_cache_add_entry(context->outputs, woz_cache_entry_disk, keys->disk, woz, WOZ_FILE_SIZE);
+        picturedsk_restamp_woz(woz, WOZ_FILE_SIZE, NULL);
+    }
+    woz_cache_add_entry(context->outputs, woz_cache_entry_tracks, keys->tracks, woz, WOZ_FILE_SIZE);
+    if (message) {
+        picturedsk_restamp_woz(woz, WOZ_FILE_SIZE, message);
+    }
+}
+
+// The preview is laid out like the polar map, so that the flux rings of a picturedsk disk
+// land on the parts of the image they were sampled from.
+static
+picturedsk_status render_preview(picturedsk_context * context, const woz_reader * reader, int size,
+                                 uint8_t * pixels)
+{
+    flux_preview_geometry geometry;
+    geometry.outer_radius = FLUX_OUTER_RADIUS;
+    geometry.outer_quarter_track = FLUX_OUTER_QUARTER_TRACK;
+    geometry.quarter_track_spacing = (FLUX_OUTER_RADIUS - FLUX_INNER_RADIUS) /
+                                     ((TRACKS_PER_DISK - 1) * FLUX_QUARTER_TRACKS_PER_RING);
+    flux_preview * preview = create_flux_preview(reader, &geometry);
+    if (!preview) {
+        return picturedsk_error_out_of_memory;
+    }
+    preview_render render;
+    render.preview = preview;
+    render.pixels = pixels;
+    render.size = size;
+    work_pool_run(context->track_pool, (size + PREVIEW_BAND_ROWS - 1) / PREVIEW_BAND_ROWS, render_preview_band, &render);
+    free_flux_preview(preview);
+    return picturedsk_ok;
+}
+
+static
+void render_preview_band(void * context, int index)
+{
+    preview_render * render = context;
+    int first_row = index * PREVIEW_BAND_ROWS;
+    int row_count = (render->size - first_row < PREVIEW_BAND_ROWS) ? render->size - first_row : PREVIEW_BAND_ROWS;
+    render_flux_preview_rows(render->preview, render->pixels, render->size, render->size, first_row, row_count);
+}
+
+static
+picturedsk_status status_for_woz_error(woz_error error)
+{
+    switch (error) {
+        case woz_error_open_failed:
+            return picturedsk_error_image_open_failed;
+        case woz_error_out_of_memory:
+            return picturedsk_error_out_of_memory;
+        default:
+            return picturedsk_error_woz_invalid;
+    }
+}
+
+// Every disk has exactly the same layout, so a finished disk's arena can be reused as
+// is for the next one.
+static
+woz_file * acquire_woz(picturedsk_context * context)
+{
+    woz_file * woz = NULL;
+    pthread_mutex_lock(&context->spare_lock);
+    if (context->spare_count > 0) {
+        woz = context->spare_wozs[--context->spare_count];
+    }
+    pthread_mutex_unlock(&context->spare_lock);
+    if (woz) {
+        reset_woz_file(woz);
+        return woz;
+    }
+    const size_t chunk_sizes[WOZ_CHUNK_COUNT] = { INFO_CHUNK_SIZE, TMAP_CHUNK_SIZE, TRKS_CHUNK_SIZE, WRIT_CHUNK_SIZE };
+    return create_woz_file_in_arena(chunk_sizes, TRACKS_PER_DISK);
+}
+
+static
+void release_woz(picturedsk_context * context, woz_file * woz)
+{
+    if (!woz) {
+        return;
+    }
+    pthread_mutex_lock(&context->spare_lock);
+    if (context->spare_count == context->spare_capacity) {
+        int new_capacity = context->spare_capacity ? context->spare_capacity * 2 : 4;
+        woz_file ** spares = realloc(context->spare_wozs, new_capacity * sizeof(woz_file *));
+        if (spares) {
+            context->spare_wozs = spares;
+            context->spare_capacity = new_capacity;
+        }
+    }
+    if (context->spare_count < context->spare_capacity) {
+        context->spare_wozs[context->spare_count++] = woz;
+        woz = NULL;
+    }
+    pthread_mutex_unlock(&context->spare_lock);
+    free_woz_file(woz);
+}
+
+static
+const uint8_t boot_1_sector_0[BYTES_PER_SECTOR] = {
+    0x01, 0xA5, 0x27, 0xC9, 0x09, 0xD0, 0x18, 0xA5, 0x2B, 0x4A, 0x4A, 0x4A, 0x4A, 0x09, 0xC0, 0x85,
+    0x3F, 0xA9, 0x5C, 0x85, 0x3E, 0x18, 0xAD, 0x5C, 0x08, 0x6D, 0x5D, 0x08, 0x8D, 0x5C, 0x08, 0xAE,
+    0x5D, 0x08, 0x30, 0x15, 0xBD, 0x4B, 0x08, 0x85, 0x5D, 0xCE, 0x5D, 0x08, 0xAD, 0x5C, 0x08, 0x85,
+    0x27, 0xCE, 0x5C, 0x08, 0xA6, 0x2B, 0x6C, 0x3E, 0x00, 0xEE, 0x5C, 0x08, 0xEE, 0x5C, 0x08, 0x20,
+    0x89, 0xFE, 0x20, 0x93, 0xFE, 0x20, 0x2F, 0xFB, 0x4C, 0x00, 0xB0, 0x00, 0x0D, 0x0B, 0x09, 0x07,
+    0x05, 0x03, 0x01, 0x0E, 0x0C, 0x0A, 0x08, 0x06, 0x04, 0x02, 0x0F, 0x00, 0xB0, 0x0E, 0xB0, 0x0E,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x54, 0x68, 0x69, 0x73, 0x20, 0x69, 0x73, 0x20, 0x61, 0x20, 0x50, 0x69, 0x63, 0x74, 0x75, 0x72,
+    0x65, 0x44, 0x53, 0x4B, 0x20, 0x28, 0x74, 0x6D, 0x29, 0x20, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x43, 0x6F, 0x70, 0x79, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x28, 0x63, 0x29, 0x20, 0x42, 0x65,
+    0x6E, 0x20, 0x5A, 0x6F, 0x74, 0x74, 0x6F, 0x20, 0x32, 0x30, 0x32, 0x31, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static
+const uint8_t boot_2_sector_F[BYTES_PER_SECTOR] = {
+    0xA2, 0x60, 0xBD, 0x88, 0xC0, 0xA2, 0x50, 0xBD, 0x88, 0xC0, 0xA9, 0x17, 0x85, 0x25, 0x20, 0xE2,
+    0xF3, 0xA2, 0x07, 0x20, 0xF0, 0xF6, 0x20, 0x57, 0xF4, 0x20, 0xF6, 0xF3, 0xA9, 0xB1, 0x85, 0x09,
+    0xA9, 0x00, 0x85, 0x08, 0x85, 0xFB, 0xAE, 0x52, 0xB0, 0x20, 0x53, 0xB0, 0xA0, 0x09, 0x84, 0xFA,
+    0xA4, 0xFB, 0xB1, 0x08, 0xC8, 0xD0, 0x03, 0xEE, 0x09, 0x00, 0x84, 0xFB, 0xA4, 0xFA, 0x91, 0x06,
+    0xC8, 0xC0, 0x1E, 0xD0, 0xE9, 0xEE, 0x52, 0xB0, 0xA0, 0x99, 0xCC, 0x52, 0xB0, 0xF0, 0x4E, 0x4C,
+    0x26, 0xB0, 0x06, 0x8A, 0x4A, 0x4A, 0x4A, 0x18, 0x0A, 0xA8, 0xB9, 0x75, 0xB0, 0x48, 0xC8, 0xB9,
+    0x75, 0xB0, 0x48, 0x8A, 0x29, 0x07, 0x18, 0x0A, 0x0A, 0x85, 0x07, 0x68, 0x18, 0x65, 0x07, 0x85,
+    0x07, 0x68, 0x85, 0x06, 0x60, 0x00, 0x20, 0x80, 0x20, 0x00, 0x21, 0x80, 0x21, 0x00, 0x22, 0x80,
+    0x22, 0x00, 0x23, 0x80, 0x23, 0x28, 0x20, 0xA8, 0x20, 0x28, 0x21, 0xA8, 0x21, 0x28, 0x22, 0xA8,
+    0x22, 0x28, 0x23, 0xA8, 0x23, 0x50, 0x20, 0xD0, 0x20, 0x50, 0x21, 0xD0, 0x21, 0xA2, 0x00, 0xBD,
+    0xB0, 0xB0, 0xF0, 0x09, 0x09, 0x80, 0x20, 0xF0, 0xFD, 0xE8, 0x4C, 0x9F, 0xB0, 0x4C, 0xAD, 0xB0,
+    0x0A, 0x46, 0x4C, 0x55, 0x58, 0x2D, 0x49, 0x4D, 0x41, 0x47, 0x45, 0x20, 0x54, 0x48, 0x49, 0x53,
+    0x20, 0x44, 0x49, 0x53, 0x4B, 0x20, 0x46, 0x4F, 0x52, 0x20, 0x41, 0x20, 0x53, 0x55, 0x52, 0x50,
+    0x52, 0x49, 0x53, 0x45, 0x0D, 0x3D, 0x29, 0x0D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A
+};
@@ -0,0 +1,139 @@
+//
+// picturedsk.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This is the embeddable interface to picturedsk. It turns an image (BMP file bytes, or
+// an already decoded pixel buffer) into the bytes of a WOZ disk image, in memory. A
+// context holds the state worth keeping warm between disks: the polar sampling maps,
+// and optionally a pool of threads for rendering tracks and a cache of finished disks.
+// The cache lives in a directory that other contexts and processes may share; it is
+// only ever changed by renaming complete files into it, and trimmed by whichever one
+// holds its lock. There is no other mutable shared state, so any number of calls can
+// run at once from different threads, on the same context or on different ones.
+//
+// Build with "make lib" for libpicturedsk.a and libpicturedsk.so.
+//
+
+#ifndef picturedsk_h
+#define picturedsk_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PICTUREDSK_API  __attribute__((visibility("default")))
+
+#define PICTUREDSK_MAX_MESSAGE_LEN  40
+#define PICTUREDSK_MAX_PREVIEW_SIZE 8192
+
+typedef enum _picturedsk_status {
+    picturedsk_ok = 0,
+    picturedsk_error_invalid_argument,
+    picturedsk_error_out_of_memory,
+    picturedsk_error_buffer_too_small,
+    picturedsk_error_image_open_failed,
+    picturedsk_error_image_invalid,
+    picturedsk_error_image_unsupported,
+    picturedsk_error_output_open_failed,
+    picturedsk_error_output_write_failed,
+    picturedsk_error_woz_invalid
+} picturedsk_status;
+
+typedef enum _picturedsk_pixel_format {
+    picturedsk_pixel_format_grey8 = 0,  // One sRGB grey byte per pixel
+    picturedsk_pixel_format_rgba8       // Red, green, blue and (ignored) alpha bytes
+} picturedsk_pixel_format;
+
+// A decoded image. Rows are top row first, bytes_per_line apart.
+typedef struct _picturedsk_image {
+    const uint8_t * pixels;
+    int width;
+    int height;
+    size_t bytes_per_line;
+    picturedsk_pixel_format format;
+} picturedsk_image;
+
+// How the image is sampled, both for the boot screen and for the flux tracks.
+typedef enum _picturedsk_filter {
+    picturedsk_filter_nearest = 0,      // Each sample takes the one pixel under it
+    picturedsk_filter_box               // Each sample takes the mean of the pixels its area covers
+} picturedsk_filter;
+
+// How the sampled greys are reduced to black and white, on the boot screen and in the
+// flux tracks. Each is done in the target's own grid: the screen's pixels, or the nibbles
+// around each track with one row per track.
+typedef enum _picturedsk_dither {
+    picturedsk_dither_none = 0,         // Plain threshold at mid grey
+    picturedsk_dither_bayer,            // Ordered, with an 8x8 Bayer matrix
+    picturedsk_dither_blue_noise,       // Ordered, with an even, patternless mask
+    picturedsk_dither_diffusion         // Floyd-Steinberg error diffusion; tracks are then rendered one at a time
+} picturedsk_dither;
+
+typedef struct _picturedsk_options {
+    const char * message;       // Shown when the disk boots, up to 40 characters; NULL for the default
+    picturedsk_filter filter;
+    picturedsk_dither dither;
+} picturedsk_options;
+
+typedef struct _picturedsk_context picturedsk_context;
+
+// map_cache_dir may be NULL. A thread_count above 1 renders each disk's tracks on that
+// many threads; the output is the same either way.
+PICTUREDSK_API picturedsk_context * picturedsk_create_context(const char * map_cache_dir, int thread_count);
+PICTUREDSK_API void picturedsk_free_context(picturedsk_context * context);
+PICTUREDSK_API void picturedsk_default_options(picturedsk_options * options);
+
+// Keeps the disks the context makes from BMP files or BMP bytes in cache_dir, keyed by a
+// hash of the BMP bytes, the message and every option, and returns them from there when
+// asked for them again. Disks made by picturedsk_image_to_woz() don't use the cache.
+// A disk that differs only in its message is made from a cached one by restamping it.
+// The directory is kept to about max_size bytes by removing the least recently used
+// disks, and can be shared by any number of processes. Call this before the context is
+// first used.
+PICTUREDSK_API picturedsk_status picturedsk_set_woz_cache(picturedsk_context * context, const char * cache_dir,
+                                                          uint64_t max_size);
+
+// The size of every WOZ image this library makes.
+PICTUREDSK_API size_t picturedsk_woz_size(void);
+
+// Write the WOZ image into the caller's buffer, which must have room for
+// picturedsk_woz_size() bytes. On success *woz_size is the number of bytes written.
+PICTUREDSK_API picturedsk_status picturedsk_bmp_to_woz(picturedsk_context * context, const void * bmp, size_t bmp_size,
+                                                       const picturedsk_options * options,
+                                                       void * woz, size_t woz_capacity, size_t * woz_size);
+PICTUREDSK_API picturedsk_status picturedsk_image_to_woz(picturedsk_context * context, const picturedsk_image * image,
+                                                         const picturedsk_options * options,
+                                                         void * woz, size_t woz_capacity, size_t * woz_size);
+
+// As above, but the buffer is allocated by the library. Release it with picturedsk_free_woz().
+PICTUREDSK_API picturedsk_status picturedsk_bmp_to_woz_alloc(picturedsk_context * context, const void * bmp, size_t bmp_size,
+                                                             const picturedsk_options * options,
+                                                             uint8_t ** woz, size_t * woz_size);
+PICTUREDSK_API void picturedsk_free_woz(uint8_t * woz);
+
+// Reads a BMP file and streams the WOZ image straight out to a file.
+PICTUREDSK_API picturedsk_status picturedsk_bmp_file_to_woz_file(picturedsk_context * context, const char * bmp_path,
+                                                                 const char * woz_path, const picturedsk_options * options);
+
+// Changes the boot message of a WOZ image made by this library, in place, without making
+// the disk again. Only the sector holding the message is encoded again, and the CRCs
+// are patched for the changed bytes rather than computed over the whole image. Images
+// that aren't picturedsk's own are left alone, with picturedsk_error_woz_invalid. A NULL
+// message restores the default one.
+PICTUREDSK_API picturedsk_status picturedsk_restamp_woz(void * woz, size_t woz_size, const char * message);
+PICTUREDSK_API picturedsk_status picturedsk_restamp_woz_file(const char * woz_path, const char * message);
+
+// Renders a size x size greyscale picture of the flux on a disk, as a flux imager would
+// show it: concentric rings, one per quarter-track, lighter where there are more flux
+// transitions. Any WOZ 2 image will do, but it's laid out so that the rings of one of
+// picturedsk's own disks line up with the image it was made from. pixels gets size
+// rows of size greys, top row first. The rows are rendered on the context's threads.
+PICTUREDSK_API picturedsk_status picturedsk_woz_to_preview(picturedsk_context * context, const void * woz, size_t woz_size,
+                                                           int size, uint8_t * pixels);
+// As above, from a WOZ file to an 8-bit greyscale BMP file.
+PICTUREDSK_API picturedsk_status picturedsk_woz_file_to_preview_bmp_file(picturedsk_context * context, const char * woz_path,
+                                                                         const char * bmp_path, int size);
+
+PICTUREDSK_API const char * picturedsk_status_string(picturedsk_status status);
+
+#endif /* picturedsk_h */
@@ -0,0 +1,368 @@
+//
+// polar_map.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "polar_map.h"
+#include "bitmap.h"
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define POLAR_MAP_FILE_MAGIC        "PDSKPMAP"
+#define POLAR_MAP_FILE_VERSION      2
+#define POLAR_MAP_FILE_HEADER_SIZE  64
+
+// The on-disk cache file is this header (padded out to POLAR_MAP_FILE_HEADER_SIZE)
+// followed immediately by the raw offsets (or boxes) table, so it can be mapped and
+// used in place. These files are a local cache only, and are written in native byte
+// order.
+typedef struct _polar_map_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    polar_geometry geometry;
+    int32_t image_width;
+    int32_t image_height;
+} polar_map_file_header;
+
+//
+// Private declarations
+//
+
+static polar_map * build_polar_map(const polar_geometry * geometry, int width, int height);
+static polar_box footprint_box(float u, float v, float half_width, float half_height, int width, int height);
+static int footprint_span(float center, float half_extent, int size, int * start);
+static int table_is_valid(const void * table, const polar_geometry * geometry, int width, int height);
+static polar_map * load_polar_map(const char * path, const polar_geometry * geometry, int width, int height);
+static void save_polar_map(const polar_map * map, const char * path);
+static void free_polar_map(polar_map * map);
+static size_t polar_map_table_size(const polar_geometry * geometry);
+static int geometry_equal(const polar_geometry * a, const polar_geometry * b);
+
+// Jobs running on different threads share these maps, so the list is only touched
+// under the lock. A map being built holds the lock, so a second job that needs the same
+// map waits for it rather than building its own copy.
+struct _polar_map_cache {
+    pthread_mutex_t lock;
+    polar_map * maps;
+    char * cache_dir;
+};
+
+//
+// Public routines
+//
+
+polar_map_cache * create_polar_map_cache(const char * cache_dir)
+{
+    polar_map_cache * cache = calloc(1, sizeof(polar_map_cache));
+    if (!cache) {
+        return NULL;
+    }
+    if (cache_dir) {
+        cache->cache_dir = strdup(cache_dir);
+        if (!cache->cache_dir) {
+            free(cache);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void free_polar_map_cache(polar_map_cache * cache)
+{
+    if (!cache) {
+        return;
+    }
+    while (cache->maps) {
+        polar_map * next = cache->maps->next;
+        free_polar_map(cache->maps);
+        cache->maps = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->cache_dir);
+    free(cache);
+}
+
+const polar_map * polar_map_for_image(polar_map_cache * cache, const polar_geometry * geometry, int width, int height)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (polar_map * map = cache->maps; map; map = map->next) {
+        if (map->image_width == width && map->image_height == height &&
+            geometry_equal(&map->geometry, geometry)) {
+            pthread_mutex_unlock(&cache->lock);
+            return map;
+        }
+    }
+
+    polar_map * map = NULL;
+    const char * cache_dir = cache->cache_dir;
+    char path[1024];
+    if (cache_dir) {
+        snprintf(path, sizeof(path), "%s/polar-%dx%d-%g-%g%s-%dx%d.map", cache_dir,
+                 geometry->ring_count, geometry->samples_per_ring,
+                 geometry->outer_radius, geometry->inner_radius,
+                 (geometry->sampling == polar_sampling_box) ? "-box" : "", width, height);
+        map = load_polar_map(path, geometry, width, height);
+    }
+    if (!map) {
+        map = build_polar_map(geometry, width, height);
+        if (map && cache_dir) {
+            save_polar_map(map, path);
+        }
+    }
+    if (map) {
+        map->next = cache->maps;
+        cache->maps = map;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return map;
+}
+
+//
+// Private routines
+//
+
+static
+polar_map * build_polar_map(const polar_geometry * geometry, int width, int height)
+{
+    int rings = geometry->ring_count;
+    int samples = geometry->samples_per_ring;
+    int box_sampling = (geometry->sampling == polar_sampling_box);
+
+    polar_map * map = calloc(1, sizeof(polar_map));
+    void * table = malloc(polar_map_table_size(geometry));
+    float * cosines = malloc(sizeof(float) * samples);
+    float * sines = malloc(sizeof(float) * samples);
+    if (!map || !table || !cosines || !sines) {
+        free(map);
+        free(table);
+        free(cosines);
+        free(sines);
+        return NULL;
+    }
+
+    // The angle of each sample is the same on every ring, so only do the trig once per
+    // sample position. Sample 0 is at 12 o'clock and the samples proceed clockwise.
+    double arc_segment = (2.0 * M_PI) / (double)samples;
+    for (int s = 0; s < samples; s++) {
+        cosines[s] = cosf(M_PI_2 + arc_segment * (samples - s));
+        sines[s] = sinf(M_PI_2 + arc_segment * (samples - s));
+    }
+
+    // This is based on the output PNG files from the current version of Applesauce.
+    float radius_per_ring = (geometry->outer_radius - geometry->inner_radius) / (float)rings;
+    for (int ring = 0; ring < rings; ring++) {
+        float r = geometry->outer_radius - (ring * radius_per_ring);
+        float arc_length = r * arc_segment;
+        for (int s = 0; s < samples; s++) {
+            float u = r * cosines[s];
+            float v = r * sines[s];
+            // Translate (u,v) from the center, to the origin.
+            u += 0.5;
+            v = 0.5 - v;
+            size_t index = (size_t)ring * samples + s;
+            if (box_sampling) {
+                // The footprint runs radially for one ring and tangentially for one arc
+                // segment; these are the half extents of its bounding box.
+                float c = fabsf(cosines[s]);
+                float n = fabsf(sines[s]);
+                float half_width = 0.5f * (radius_per_ring * c + arc_length * n);
+                float half_height = 0.5f * (radius_per_ring * n + arc_length * c);
+                ((polar_box *)table)[index] = footprint_box(u, v, half_width, half_height, width, height);
+            } else {
+                ((uint32_t *)table)[index] = bitmap_texcoord_offset(width, height, u, v);
+            }
+        }
+    }
+
+    free(cosines);
+    free(sines);
+
+    map->geometry = *geometry;
+    map->image_width = width;
+    map->image_height = height;
+    if (box_sampling) {
+        map->boxes = table;
+    } else {
+        map->offsets = table;
+    }
+    return map;
+}
+
+static
+polar_box footprint_box(float u, float v, float half_width, float half_height, int width, int height)
+{
+    int x0, y0;
+    polar_box box;
+    box.width = footprint_span(u, half_width, width, &x0);
+    box.height = footprint_span(v, half_height, height, &y0);
+    box.origin = (uint32_t)y0 * (uint32_t)(width + 1) + (uint32_t)x0;
+    return box;
+}
+
+// The pixels from *start that the extent around center covers, in texcoords along an
+// axis of size pixels. Always at least the one pixel that point sampling would use.
+static
+int footprint_span(float center, float half_extent, int size, int * start)
+{
+    int first = (int)lroundf((center - half_extent) * size);
+    int end = (int)lroundf((center + half_extent) * size);
+    if (first < 0) { first = 0; }
+    if (end > size) { end = size; }
+    if (end - first > UINT16_MAX) { end = first + UINT16_MAX; }
+    if (end <= first) {
+        first = bitmap_texcoord_offset(size, 1, center, 0.0);
+        end = first + 1;
+    }
+    *start = first;
+    return end - first;
+}
+
+static
+polar_map * load_polar_map(const char * path, const polar_geometry * geometry, int width, int height)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    size_t expected_size = POLAR_MAP_FILE_HEADER_SIZE + polar_map_table_size(geometry);
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != expected_size) {
+        close(fd);
+        return NULL;
+    }
+    void * mapping = mmap(NULL, expected_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    const polar_map_file_header * header = mapping;
+    if (memcmp(header->magic, POLAR_MAP_FILE_MAGIC, 8) != 0 ||
+        header->version != POLAR_MAP_FILE_VERSION ||
+        header->header_size != POLAR_MAP_FILE_HEADER_SIZE ||
+        header->image_width != width || header->image_height != height ||
+        !geometry_equal(&header->geometry, geometry)) {
+        munmap(mapping, expected_size);
+        return NULL;
+    }
+
+    // Don't trust the file contents blindly; a bad entry would read outside the image.
+    const void * table = (const uint8_t *)mapping + POLAR_MAP_FILE_HEADER_SIZE;
+    if (!table_is_valid(table, geometry, width, height)) {
+        munmap(mapping, expected_size);
+        return NULL;
+    }
+
+    polar_map * map = calloc(1, sizeof(polar_map));
+    if (!map) {
+        munmap(mapping, expected_size);
+        return NULL;
+    }
+    map->geometry = *geometry;
+    map->image_width = width;
+    map->image_height = height;
+    if (geometry->sampling == polar_sampling_box) {
+        map->boxes = table;
+    } else {
+        map->offsets = table;
+    }
+    map->mapping = mapping;
+    map->mapping_size = expected_size;
+    return map;
+}
+
+// Best effort only: if the cache can't be written, we just build the map again next time.
+// The file is written under a temporary name and renamed into place so that a
+// concurrent reader never sees a partial file.
+static
+void save_polar_map(const polar_map * map, const char * path)
+{
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.%p.tmp", path, (int)getpid(), (const void *)map);
+    FILE * file = fopen(temp_path, "wb");
+    if (!file) {
+        return;
+    }
+
+    uint8_t header_bytes[POLAR_MAP_FILE_HEADER_SIZE];
+    memset(header_bytes, 0, sizeof(header_bytes));
+    polar_map_file_header * header = (polar_map_file_header *)header_bytes;
+    memcpy(header->magic, POLAR_MAP_FILE_MAGIC, 8);
+    header->version = POLAR_MAP_FILE_VERSION;
+    header->header_size = POLAR_MAP_FILE_HEADER_SIZE;
+    header->geometry = map->geometry;
+    header->image_width = map->image_width;
+    header->image_height = map->image_height;
+
+    size_t table_size = polar_map_table_size(&map->geometry);
+    int ok = fwrite(header_bytes, 1, sizeof(header_bytes), file) == sizeof(header_bytes) &&
+             fwrite(map->offsets ? (const void *)map->offsets : (const void *)map->boxes, 1, table_size, file) == table_size;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+    }
+}
+
+static
+void free_polar_map(polar_map * map)
+{
+    if (map->mapping) {
+        munmap(map->mapping, map->mapping_size);
+    } else {
+        free((void *)map->offsets);
+        free((void *)map->boxes);
+    }
+    free(map);
+}
+
+static
+size_t polar_map_table_size(const polar_geometry * geometry)
+{
+    size_t entry_size = (geometry->sampling == polar_sampling_box) ? sizeof(polar_box) : sizeof(uint32_t);
+    return entry_size * (size_t)geometry->ring_count * geometry->samples_per_ring;
+}
+
+static
+int table_is_valid(const void * table, const polar_geometry * geometry, int width, int height)
+{
+    size_t count = (size_t)geometry->ring_count * geometry->samples_per_ring;
+    if (geometry->sampling == polar_sampling_box) {
+        const polar_box * boxes = table;
+        uint32_t stride = (uint32_t)width + 1;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t x = boxes[i].origin % stride;
+            uint32_t y = boxes[i].origin / stride;
+            if (boxes[i].width == 0 || boxes[i].height == 0 ||
+                x + boxes[i].width > (uint32_t)width || y + boxes[i].height > (uint32_t)height) {
+                return 0;
+            }
+        }
+    } else {
+        const uint32_t * offsets = table;
+        uint32_t pixel_count = (uint32_t)width * (uint32_t)height;
+        for (size_t i = 0; i < count; i++) {
+            if (offsets[i] >= pixel_count) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static
+int geometry_equal(const polar_geometry * a, const polar_geometry * b)
+{
+    return a->ring_count == b->ring_count &&
+           a->samples_per_ring == b->samples_per_ring &&
+           a->outer_radius == b->outer_radius &&
+           a->inner_radius == b->inner_radius &&
+           a->sampling == b->sampling;
+}
@@ -0,0 +1,72 @@
+//
+// polar_map.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module provides precomputed polar sampling maps. A map holds, for every sample
+// position around every ring of a disk, the offset of the source image pixel that
+// the sample lands on, or for box sampling, the box of pixels that the sample's
+// footprint covers. The geometry only depends on the ring layout and the image
+// dimensions, so a map is built once and reused for every image of that size. Built
+// maps are kept in a polar_map_cache, and can optionally be persisted in a cache
+// directory and mapped back in directly.
+//
+
+#ifndef polar_map_h
+#define polar_map_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef enum _polar_sampling {
+    polar_sampling_point = 0,   // The single pixel under each sample
+    polar_sampling_box          // The pixels under each sample's footprint (see below)
+} polar_sampling;
+
+typedef struct _polar_geometry {
+    int ring_count;             // Number of sampled rings (tracks)
+    int samples_per_ring;       // Number of samples (nibbles) around each ring
+    double outer_radius;        // Radius of the first ring, in texcoord units
+    double inner_radius;        // Radius at the innermost edge, in texcoord units
+    polar_sampling sampling;
+} polar_geometry;
+
+// A box of image pixels, addressed in the image's summed-area table (see luma_sums in
+// bitmap.h): origin is the sums entry of the box's top left pixel. A sample's footprint
+// spans one arc segment around its ring and one ring spacing across it, and the box is
+// the pixel-aligned bounding box of that, centered on the sample. Footprints smaller
+// than a pixel get the single pixel under the sample, as with point sampling.
+typedef struct _polar_box {
+    uint32_t origin;
+    uint16_t width;
+    uint16_t height;
+} polar_box;
+
+typedef struct _polar_map {
+    polar_geometry geometry;
+    int image_width;
+    int image_height;
+    const uint32_t * offsets;   // Point sampling: ring_count rows of samples_per_ring pixel offsets
+    const polar_box * boxes;    // Box sampling: the same, but boxes; the other table is NULL
+    void * mapping;             // Backing file mapping, if loaded from a cache file
+    size_t mapping_size;
+    struct _polar_map * next;
+} polar_map;
+
+typedef struct _polar_map_cache polar_map_cache;
+
+#define POLAR_MAP_RING(m, ring)     (&(m)->offsets[(size_t)(ring) * (m)->geometry.samples_per_ring])
+#define POLAR_MAP_BOX_RING(m, ring) (&(m)->boxes[(size_t)(ring) * (m)->geometry.samples_per_ring])
+
+// cache_dir may be NULL, in which case maps are only kept in memory.
+polar_map_cache * create_polar_map_cache(const char * cache_dir);
+void free_polar_map_cache(polar_map_cache * cache);
+
+// Returns the cache's map for this geometry and image size, building it (or loading it
+// from the cache directory) the first time it's requested. The returned map belongs to
+// the cache, and stays valid until the cache is freed. Safe to call from several
+// threads at once.
+const polar_map * polar_map_for_image(polar_map_cache * cache, const polar_geometry * geometry, int width, int height);
+
+#endif /* polar_map_h */
@@ -0,0 +1,373 @@
+//
+// server.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#define _GNU_SOURCE             // accept4() and pipe2()
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVER_LISTEN_BACKLOG       64
+#define SERVER_IO_TIMEOUT_SECONDS   30
+
+typedef struct _server {
+    int listen_fd;
+    int shutdown_fd;            // Becomes (and stays) readable once we're shutting down
+    picturedsk_context * context;
+    const picturedsk_options * options;
+} server;
+
+// Each worker keeps its buffers for its whole life, so a warm worker doesn't allocate.
+typedef struct _worker_buffers {
+    uint8_t * image;
+    size_t image_capacity;
+    uint8_t * woz;
+    size_t woz_capacity;
+    char message[SERVER_MAX_MESSAGE_LENGTH + 1];
+} worker_buffers;
+
+static void * worker_main(void * arg);
+static void serve_connection(server * server, int fd, worker_buffers * buffers);
+static void set_deadline(struct timespec * deadline, int seconds);
+static int wait_ready(int fd, short events, int shutdown_fd, const struct timespec * deadline);
+static int read_fully(int fd, int shutdown_fd, void * bytes, size_t count, const struct timespec * deadline);
+static int write_fully(int fd, const void * bytes, size_t count, const struct timespec * deadline);
+static int send_response(int fd, uint32_t status, const void * payload, size_t length);
+static int send_error(int fd, picturedsk_status status);
+static void handle_shutdown_signal(int signal_number);
+static uint32_t load_le32(const uint8_t * p);
+static void store_le32(uint8_t * p, uint32_t value);
+
+// Written to by the signal handler, which is why it has to be global.
+static int shutdown_pipe[2] = { -1, -1 };
+
+//
+// Public routines
+//
+
+int serve_unix_socket(const char * socket_path, picturedsk_context * context, const picturedsk_options * options,
+                      int worker_count)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    // A socket left behind by an earlier run is replaced, but nothing else is.
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("%s exists and is not a socket\n", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    server server;
+    server.context = context;
+    server.options = options;
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (server.listen_fd < 0) {
+        printf("Could not create socket\n");
+        return -1;
+    }
+    if (bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server.listen_fd, SERVER_LISTEN_BACKLOG) != 0) {
+        printf("Could not listen on %s\n", socket_path);
+        close(server.listen_fd);
+        return -1;
+    }
+    if (pipe2(shutdown_pipe, O_CLOEXEC) != 0) {
+        printf("Could not create shutdown pipe\n");
+        close(server.listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
+    server.shutdown_fd = shutdown_pipe[0];
+
+    struct sigaction action;
+    struct sigaction old_int_action;
+    struct sigaction old_term_action;
+    struct sigaction old_pipe_action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_shutdown_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_int_action);
+    sigaction(SIGTERM, &action, &old_term_action);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, &old_pipe_action);
+
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    pthread_t * workers = calloc(worker_count, sizeof(pthread_t));
+    int started_count = 0;
+    for (int i = 0; workers && i < worker_count; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, &server) != 0) {
+            break;
+        }
+        started_count++;
+    }
+    if (started_count > 0) {
+        printf("Serving on %s with %d workers.\n", socket_path, started_count);
+        fflush(stdout);
+    } else {
+        printf("Could not start any workers\n");
+        handle_shutdown_signal(0);
+    }
+    for (int i = 0; i < started_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    sigaction(SIGINT, &old_int_action, NULL);
+    sigaction(SIGTERM, &old_term_action, NULL);
+    sigaction(SIGPIPE, &old_pipe_action, NULL);
+    close(server.listen_fd);
+    unlink(socket_path);
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
+    shutdown_pipe[0] = shutdown_pipe[1] = -1;
+    return (started_count > 0) ? 0 : -1;
+}
+
+//
+// Workers. Each one waits for a connection, serves it until the client hangs up, and
+// goes back for another. The listening socket is non-blocking, so when several workers
+// wake up for one connection, the ones that lose the race just go back to waiting.
+//
+
+static
+void * worker_main(void * arg)
+{
+    server * server = arg;
+    worker_buffers buffers;
+    memset(&buffers, 0, sizeof(buffers));
+    buffers.woz_capacity = picturedsk_woz_size();
+    buffers.woz = malloc(buffers.woz_capacity);
+    if (!buffers.woz) {
+        return NULL;
+    }
+
+    while (wait_ready(server->listen_fd, POLLIN, server->shutdown_fd, NULL)) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        serve_connection(server, fd, &buffers);
+        close(fd);
+    }
+
+    free(buffers.image);
+    free(buffers.woz);
+    return NULL;
+}
+
+static
+void serve_connection(server * server, int fd, worker_buffers * buffers)
+{
+    // Don't let one stalled client hold a worker (or the shutdown) forever. A client
+    // gets SERVER_IO_TIMEOUT_SECONDS to start each request, the same again to send all
+    // of it, and the same again to take the response, however it trickles the bytes.
+    // A shutdown abandons a request that's still arriving, but one that has arrived is
+    // finished and answered.
+    struct timespec deadline;
+    set_deadline(&deadline, SERVER_IO_TIMEOUT_SECONDS);
+    while (wait_ready(fd, POLLIN, server->shutdown_fd, &deadline)) {
+        set_deadline(&deadline, SERVER_IO_TIMEOUT_SECONDS);
+        uint8_t header[SERVER_REQUEST_HEADER_SIZE];
+        if (read_fully(fd, server->shutdown_fd, header, sizeof(header), &deadline) != 0) {
+            return;
+        }
+        uint32_t flags = load_le32(&header[4]);
+        uint32_t message_length = load_le32(&header[8]);
+        uint32_t image_length = load_le32(&header[12]);
+        if (memcmp(header, SERVER_REQUEST_MAGIC, 4) != 0 ||
+            message_length > SERVER_MAX_MESSAGE_LENGTH || image_length > SERVER_MAX_IMAGE_LENGTH) {
+            send_error(fd, picturedsk_error_invalid_argument);
+            return;
+        }
+
+        if (image_length > buffers->image_capacity) {
+            uint8_t * image = realloc(buffers->image, image_length);
+            if (!image) {
+                send_error(fd, picturedsk_error_out_of_memory);
+                return;
+            }
+            buffers->image = image;
+            buffers->image_capacity = image_length;
+        }
+        if (read_fully(fd, server->shutdown_fd, buffers->message, message_length, &deadline) != 0 ||
+            read_fully(fd, server->shutdown_fd, buffers->image, image_length, &deadline) != 0) {
+            return;
+        }
+        buffers->message[message_length] = '\0';
+
+        picturedsk_options options = *server->options;
+        options.message = NULL;
+        if (flags & SERVER_REQUEST_HAS_MESSAGE) {
+            options.message = buffers->message;
+        }
+        size_t woz_size = 0;
+        picturedsk_status status = picturedsk_bmp_to_woz(server->context, buffers->image, image_length, &options,
+                                                         buffers->woz, buffers->woz_capacity, &woz_size);
+        int error = (status == picturedsk_ok) ?
+                    send_response(fd, status, buffers->woz, woz_size) :
+                    send_error(fd, status);
+        if (error) {
+            return;
+        }
+        set_deadline(&deadline, SERVER_IO_TIMEOUT_SECONDS);
+    }
+}
+
+//
+// Helpers
+//
+
+static
+void set_deadline(struct timespec * deadline, int seconds)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += seconds;
+}
+
+// Returns 1 once fd is ready for events, or 0 if we're shutting down (unless shutdown_fd
+// is -1) or the deadline (unless it's NULL) passes first.
+static
+int wait_ready(int fd, short events, int shutdown_fd, const struct timespec * deadline)
+{
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[1].fd = shutdown_fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        int timeout_ms = -1;
+        if (deadline) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long remaining = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+            timeout_ms = (remaining > 0) ? (int)remaining : 0;
+        }
+        fds[0].revents = fds[1].revents = 0;
+        int count = poll(fds, 2, timeout_ms);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0 || fds[1].revents) {
+            return 0;
+        }
+        if (fds[0].revents) {
+            return 1;
+        }
+    }
+}
+
+// These return 0 on success, or -1 on error, end of file, shutdown or the deadline. The
+// socket is only read or written once poll() says it's ready, and then without
+// blocking, so nothing waits past the deadline.
+static
+int read_fully(int fd, int shutdown_fd, void * bytes, size_t count, const struct timespec * deadline)
+{
+    uint8_t * p = bytes;
+    while (count > 0) {
+        if (!wait_ready(fd, POLLIN, shutdown_fd, deadline)) {
+            return -1;
+        }
+        ssize_t got = recv(fd, p, count, MSG_DONTWAIT);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        count -= got;
+    }
+    return 0;
+}
+
+static
+int write_fully(int fd, const void * bytes, size_t count, const struct timespec * deadline)
+{
+    const uint8_t * p = bytes;
+    while (count > 0) {
+        if (!wait_ready(fd, POLLOUT, -1, deadline)) {
+            return -1;
+        }
+        ssize_t sent = send(fd, p, count, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        p += sent;
+        count -= sent;
+    }
+    return 0;
+}
+
+static
+int send_response(int fd, uint32_t status, const void * payload, size_t length)
+{
+    uint8_t header[SERVER_RESPONSE_HEADER_SIZE];
+    memcpy(header, SERVER_RESPONSE_MAGIC, 4);
+    store_le32(&header[4], status);
+    store_le32(&header[8], (uint32_t)length);
+    struct timespec deadline;
+    set_deadline(&deadline, SERVER_IO_TIMEOUT_SECONDS);
+    return write_fully(fd, header, sizeof(header), &deadline) || write_fully(fd, payload, length, &deadline);
+}
+
+static
+int send_error(int fd, picturedsk_status status)
+{
+    const char * description = picturedsk_status_string(status);
+    return send_response(fd, status, description, strlen(description));
+}
+
+static
+void handle_shutdown_signal(int signal_number)
+{
+    (void)signal_number;
+    // Only async-signal-safe calls in here. The byte is never read, so the pipe stays
+    // readable and every worker sees it.
+    int saved_errno = errno;
+    if (write(shutdown_pipe[1], "x", 1) < 0) {
+        // Nothing useful to do about it.
+    }
+    errno = saved_errno;
+}
+
+static
+uint32_t load_le32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+void store_le32(uint8_t * p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
@@ -0,0 +1,52 @@
+//
+// server.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module runs picturedsk as a long-lived service on a Unix domain socket, so each
+// disk costs neither process startup nor table and map setup. A client connects, and
+// then sends any number of requests on the connection, each answered in turn. A
+// connection left idle for 30 seconds between requests is closed by the server.
+//
+// All integers are little-endian uint32. A request is:
+//
+//     "PDRQ"  flags  message_length  image_length
+//     message bytes (message_length of them)
+//     BMP file bytes (image_length of them)
+//
+// If flags has SERVER_REQUEST_HAS_MESSAGE set, the message is used (even if it's
+// empty); otherwise the disk gets the default message. Every other option is the
+// server's own, as it was started. A response is:
+//
+//     "PDRS"  status  payload_length
+//     payload bytes
+//
+// status is a picturedsk_status. On success the payload is the WOZ image, and
+// otherwise it's a short text description of the error. A request that can't be
+// parsed gets an error response, and then the connection is closed.
+//
+
+#ifndef server_h
+#define server_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "picturedsk.h"
+
+#define SERVER_REQUEST_MAGIC            "PDRQ"
+#define SERVER_RESPONSE_MAGIC           "PDRS"
+#define SERVER_REQUEST_HEADER_SIZE      16
+#define SERVER_RESPONSE_HEADER_SIZE     12
+#define SERVER_REQUEST_HAS_MESSAGE      0x1
+
+#define SERVER_MAX_MESSAGE_LENGTH       1024
+#define SERVER_MAX_IMAGE_LENGTH         (256 * 1024 * 1024)
+
+// Serves requests on socket_path with worker_count threads, each handling one
+// connection at a time, until SIGINT or SIGTERM. Each disk is made with options (apart
+// from the message). Requests in progress are finished before it returns. Returns 0
+// after a clean shutdown, or -1 if the socket couldn't be set up.
+int serve_unix_socket(const char * socket_path, picturedsk_context * context, const picturedsk_options * options,
+                      int worker_count);
+
+#endif /* server_h */
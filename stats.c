@@ -0,0 +1,86 @@
+//
+// stats.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+__thread job_stats * current_job_stats = NULL;
+
+static const char * phase_names[STATS_PHASE_COUNT] = {
+    "bmp_decode",
+    "luma_sums",
+    "hgr_sample",
+    "flux_sample",
+    "gcr_encode",
+    "chunk_assembly",
+    "crc",
+    "write"
+};
+
+job_stats * stats_begin_job(job_stats * stats)
+{
+    memset(stats, 0, sizeof(job_stats));
+    stats->start_ns = stats_clock_ns();
+    return stats_attach(stats);
+}
+
+void stats_end_job(job_stats * stats, job_stats * previous)
+{
+    stats->wall_ns = stats_clock_ns() - stats->start_ns;
+    stats_attach(previous);
+}
+
+job_stats * stats_attach(job_stats * stats)
+{
+    job_stats * previous = current_job_stats;
+    current_job_stats = stats;
+    return previous;
+}
+
+uint64_t stats_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Phases can be recorded from several track pool threads at once, hence the atomics.
+void stats_record_phase(job_stats * stats, stats_phase phase, uint64_t start_ns, uint64_t bytes)
+{
+    phase_stats * p = &stats->phases[phase];
+    __atomic_fetch_add(&p->nanoseconds, stats_clock_ns() - start_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->calls, 1, __ATOMIC_RELAXED);
+}
+
+// Allocations are only counted on the job's own thread, so these don't need atomics.
+void stats_record_alloc(job_stats * stats, uint64_t bytes)
+{
+    stats->allocation_count++;
+    stats->current_bytes += bytes;
+    if (stats->current_bytes > stats->peak_bytes) {
+        stats->peak_bytes = stats->current_bytes;
+    }
+}
+
+void stats_record_free(job_stats * stats, uint64_t bytes)
+{
+    stats->current_bytes = (bytes < stats->current_bytes) ? stats->current_bytes - bytes : 0;
+}
+
+void print_stats_json_members(FILE * file, const job_stats * stats)
+{
+    fprintf(file, "\"wall_ms\": %.3f, \"allocations\": %llu, \"peak_bytes\": %llu, \"phases\": {",
+            stats->wall_ns / 1e6, (unsigned long long)stats->allocation_count,
+            (unsigned long long)stats->peak_bytes);
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        const phase_stats * p = &stats->phases[i];
+        fprintf(file, "%s\"%s\": {\"ms\": %.3f, \"bytes\": %llu, \"calls\": %llu}", i ? ", " : "",
+                phase_names[i], p->nanoseconds / 1e6, (unsigned long long)p->bytes, (unsigned long long)p->calls);
+    }
+    fprintf(file, "}");
+}
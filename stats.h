@@ -0,0 +1,76 @@
+//
+// stats.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module keeps optional per-job timing and memory statistics. A thread opts in by
+// attaching a job_stats record with stats_attach(); everything the library does on that
+// thread is then counted in it, until it's detached again. With no record attached, each
+// instrumentation point costs a thread-local load and a branch.
+//
+// Phase times are summed across threads, so when a disk's tracks are rendered on a pool
+// they can add up to more than the job's wall time. Allocations are counted only for the
+// large per-job buffers (images, tracks and WOZ chunks), and only on the attached thread.
+//
+
+#ifndef stats_h
+#define stats_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum _stats_phase {
+    stats_phase_bmp_decode = 0,
+    stats_phase_luma_sums,
+    stats_phase_hgr_sample,
+    stats_phase_flux_sample,
+    stats_phase_gcr_encode,
+    stats_phase_chunk_assembly,
+    stats_phase_crc,
+    stats_phase_write,
+    STATS_PHASE_COUNT
+} stats_phase;
+
+typedef struct _phase_stats {
+    uint64_t nanoseconds;
+    uint64_t bytes;
+    uint64_t calls;
+} phase_stats;
+
+typedef struct _job_stats {
+    uint64_t start_ns;
+    uint64_t wall_ns;
+    phase_stats phases[STATS_PHASE_COUNT];
+    uint64_t allocation_count;
+    uint64_t current_bytes;
+    uint64_t peak_bytes;
+} job_stats;
+
+extern __thread job_stats * current_job_stats;
+
+// Clears stats and attaches it to this thread, returning whatever was attached before.
+job_stats * stats_begin_job(job_stats * stats);
+// Records the job's wall time and reattaches the previous record.
+void stats_end_job(job_stats * stats, job_stats * previous);
+// Attaches stats (which may be NULL) to this thread as is, returning the previous record.
+job_stats * stats_attach(job_stats * stats);
+
+uint64_t stats_clock_ns(void);
+void stats_record_phase(job_stats * stats, stats_phase phase, uint64_t start_ns, uint64_t bytes);
+void stats_record_alloc(job_stats * stats, uint64_t bytes);
+void stats_record_free(job_stats * stats, uint64_t bytes);
+
+// Writes the stats as the members of a JSON object (without the enclosing braces).
+void print_stats_json_members(FILE * file, const job_stats * stats);
+
+// The instrumentation points. A phase is bracketed by STATS_PHASE_START() and
+// STATS_PHASE_END(), which must be in the same scope.
+#define STATS_PHASE_START(var)  uint64_t var = current_job_stats ? stats_clock_ns() : 0
+#define STATS_PHASE_END(var, phase, bytes) \
+    do { if (current_job_stats) { stats_record_phase(current_job_stats, (phase), (var), (bytes)); } } while (0)
+#define STATS_ALLOC(bytes) \
+    do { if (current_job_stats) { stats_record_alloc(current_job_stats, (bytes)); } } while (0)
+#define STATS_FREE(bytes) \
+    do { if (current_job_stats) { stats_record_free(current_job_stats, (bytes)); } } while (0)
+
+#endif /* stats_h */
@@ -0,0 +1,154 @@
+//
+// track_kernel.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "track_kernel.h"
+#include "bitmap.h"
+#include <pthread.h>
+
+#if CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
+
+static void render_scalar(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets, const uint8_t * thresholds, size_t count);
+#if CPU_FEATURES_X86
+static void render_sse4_1(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets, const uint8_t * thresholds, size_t count);
+static void render_avx2(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets, const uint8_t * thresholds, size_t count);
+#endif
+static void choose_best_kernel(void);
+
+static track_kernel_fn best_kernel = NULL;
+static pthread_once_t best_kernel_once = PTHREAD_ONCE_INIT;
+
+//
+// Public routines
+//
+
+void track_kernel_render(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets,
+                         const uint8_t * thresholds, size_t count)
+{
+    pthread_once(&best_kernel_once, choose_best_kernel);
+    best_kernel(dest, plane, offsets, thresholds, count);
+}
+
+track_kernel_fn track_kernel_for_level(simd_level level)
+{
+#if CPU_FEATURES_X86
+    switch (level) {
+        case simd_level_avx2:
+            return render_avx2;
+        case simd_level_sse4_1:
+            return render_sse4_1;
+        default:
+            break;
+    }
+#endif
+    return render_scalar;
+}
+
+// A box is light when its mean luma, rounded down, is at least its threshold, which is
+// when its total is at least the threshold per pixel. So there's no division.
+void track_kernel_render_boxes(uint8_t * dest, const uint32_t * sums, size_t stride, const polar_box * boxes,
+                               const uint8_t * thresholds, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const polar_box * box = &boxes[i];
+        uint32_t total = luma_sums_box_total(sums, stride, box->origin, box->width, box->height);
+        uint32_t threshold = (uint32_t)thresholds[i] * box->width * box->height;
+        dest[i] = (total >= threshold) ? TRACK_NIBBLE_LIGHT : TRACK_NIBBLE_DARK;
+    }
+}
+
+void track_kernel_sample(uint8_t * lumas, const uint8_t * plane, const uint32_t * offsets, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        lumas[i] = plane[offsets[i]];
+    }
+}
+
+void track_kernel_sample_boxes(uint8_t * lumas, const uint32_t * sums, size_t stride, const polar_box * boxes,
+                               size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const polar_box * box = &boxes[i];
+        uint32_t total = luma_sums_box_total(sums, stride, box->origin, box->width, box->height);
+        lumas[i] = total / ((uint32_t)box->width * box->height);
+    }
+}
+
+static
+void choose_best_kernel(void)
+{
+    best_kernel = track_kernel_for_level(cpu_simd_level());
+}
+
+//
+// Implementations. Lumas and thresholds are both unsigned bytes; the vector versions
+// test luma >= threshold as max(luma, threshold) == luma.
+//
+
+static
+void render_scalar(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets, const uint8_t * thresholds, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        dest[i] = (plane[offsets[i]] >= thresholds[i]) ? TRACK_NIBBLE_LIGHT : TRACK_NIBBLE_DARK;
+    }
+}
+
+#if CPU_FEATURES_X86
+
+// 16 nibbles at a time. There's no byte gather, so the lumas are loaded individually
+// and then compared and selected as one vector.
+__attribute__((target("sse4.1")))
+static
+void render_sse4_1(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets, const uint8_t * thresholds, size_t count)
+{
+    const __m128i light = _mm_set1_epi8((char)TRACK_NIBBLE_LIGHT);
+    const __m128i dark = _mm_set1_epi8((char)TRACK_NIBBLE_DARK);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const uint32_t * o = &offsets[i];
+        __m128i lumas = _mm_setr_epi8(plane[o[0]], plane[o[1]], plane[o[2]], plane[o[3]],
+                                      plane[o[4]], plane[o[5]], plane[o[6]], plane[o[7]],
+                                      plane[o[8]], plane[o[9]], plane[o[10]], plane[o[11]],
+                                      plane[o[12]], plane[o[13]], plane[o[14]], plane[o[15]]);
+        __m128i limits = _mm_loadu_si128((const __m128i *)&thresholds[i]);
+        __m128i is_light = _mm_cmpeq_epi8(_mm_max_epu8(lumas, limits), lumas);
+        _mm_storeu_si128((__m128i *)&dest[i], _mm_blendv_epi8(dark, light, is_light));
+    }
+    render_scalar(&dest[i], plane, &offsets[i], &thresholds[i], count - i);
+}
+
+// 32 nibbles at a time, using four 8-lane dword gathers. Each lane's low byte is the
+// luma, which is masked off and packed down to bytes (the in-lane packs scramble the
+// dword order, which the permute undoes) to compare against the thresholds.
+__attribute__((target("avx2")))
+static
+void render_avx2(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets, const uint8_t * thresholds, size_t count)
+{
+    const __m256i light_bits = _mm256_set1_epi8((char)(TRACK_NIBBLE_LIGHT ^ TRACK_NIBBLE_DARK));
+    const __m256i dark = _mm256_set1_epi8((char)TRACK_NIBBLE_DARK);
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i unscramble = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const int * base = (const int *)plane;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i l[4];
+        for (int g = 0; g < 4; g++) {
+            __m256i index = _mm256_loadu_si256((const __m256i *)&offsets[i + g * 8]);
+            __m256i words = _mm256_i32gather_epi32(base, index, 1);
+            l[g] = _mm256_and_si256(words, low_byte);
+        }
+        __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(l[0], l[1]), _mm256_packus_epi32(l[2], l[3]));
+        __m256i lumas = _mm256_permutevar8x32_epi32(packed, unscramble);
+        __m256i limits = _mm256_loadu_si256((const __m256i *)&thresholds[i]);
+        __m256i is_light = _mm256_cmpeq_epi8(_mm256_max_epu8(lumas, limits), lumas);
+        __m256i nibbles = _mm256_or_si256(dark, _mm256_and_si256(is_light, light_bits));
+        _mm256_storeu_si256((__m256i *)&dest[i], nibbles);
+    }
+    render_scalar(&dest[i], plane, &offsets[i], &thresholds[i], count - i);
+}
+
+#endif
@@ -0,0 +1,50 @@
+//
+// track_kernel.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module renders the nibbles of one flux track from a luma plane and a row of
+// precomputed sample offsets (see polar_map.h). Each nibble is 0xFF where the sampled
+// luma is light, at or above its threshold, and 0x96 where it's dark. The thresholds
+// come from a row of the dither mask (see dither.h), one for each nibble. Vectorized
+// versions are picked at runtime and produce exactly the same bytes as the scalar
+// version.
+//
+// With box sampling, each nibble instead comes from the mean luma over a box of pixels,
+// taken from the image's summed-area table (see luma_sums in bitmap.h). That's four
+// lookups per nibble, whatever the size of the box.
+//
+// The AVX2 version reads whole 32-bit words at each sample offset, so the luma plane
+// must have at least LUMA_BITMAP_PADDING readable bytes after its last pixel. Luma
+// bitmaps from create_luma_bitmap() always do.
+//
+
+#ifndef track_kernel_h
+#define track_kernel_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu_features.h"
+#include "polar_map.h"
+
+#define TRACK_NIBBLE_LIGHT  0xFF
+#define TRACK_NIBBLE_DARK   0x96
+
+typedef void (*track_kernel_fn)(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets,
+                                const uint8_t * thresholds, size_t count);
+
+void track_kernel_render(uint8_t * dest, const uint8_t * plane, const uint32_t * offsets,
+                         const uint8_t * thresholds, size_t count);
+track_kernel_fn track_kernel_for_level(simd_level level);
+
+// sums is the image's summed-area table, with stride entries per row.
+void track_kernel_render_boxes(uint8_t * dest, const uint32_t * sums, size_t stride, const polar_box * boxes,
+                               const uint8_t * thresholds, size_t count);
+
+// The sampled lumas themselves, for dithering that needs more than a threshold. Box
+// sampling gives each box's mean luma, rounded down.
+void track_kernel_sample(uint8_t * lumas, const uint8_t * plane, const uint32_t * offsets, size_t count);
+void track_kernel_sample_boxes(uint8_t * lumas, const uint32_t * sums, size_t stride, const polar_box * boxes,
+                               size_t count);
+
+#endif /* track_kernel_h */
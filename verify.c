@@ -0,0 +1,167 @@
+//
+// verify.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "verify.h"
+#include "woz_reader.h"
+#include "work_pool.h"
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+typedef struct _verify_list {
+    char ** paths;
+    woz_error * errors;
+    int count;
+    int capacity;
+} verify_list;
+
+static int collect_paths(verify_list * list, const char * path, int named);
+static int add_path(verify_list * list, const char * path);
+static int is_woz_name(const char * name);
+static int compare_paths(const void * a, const void * b);
+static void verify_item(void * context, int index);
+
+//
+// Public routines
+//
+
+// The files are all found first, so they can be shared out evenly between the threads.
+// Nothing is printed until they're all checked, so the report is in the same order
+// however many threads there are.
+int verify_woz_paths(const char * const * paths, int path_count, int thread_count)
+{
+    int result = -1;
+    verify_list list;
+    memset(&list, 0, sizeof(list));
+    work_pool * pool = NULL;
+    for (int i = 0; i < path_count; i++) {
+        if (collect_paths(&list, paths[i], 1) != 0) {
+            goto OutOfMemory;
+        }
+    }
+    qsort(list.paths, list.count, sizeof(char *), compare_paths);
+    list.errors = calloc(list.count ? list.count : 1, sizeof(woz_error));
+    if (!list.errors) {
+        goto OutOfMemory;
+    }
+
+    if (thread_count > list.count) {
+        thread_count = list.count;
+    }
+    if (thread_count > 1) {
+        pool = create_work_pool(thread_count);
+        if (!pool) {
+            goto OutOfMemory;
+        }
+    }
+    work_pool_run(pool, list.count, verify_item, &list);
+
+    int failures = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (list.errors[i] != woz_error_none) {
+            printf("%s: %s\n", list.paths[i], woz_error_string(list.errors[i]));
+            failures++;
+        }
+    }
+    printf("%d of %d WOZ files OK.\n", list.count - failures, list.count);
+    result = failures ? -2 : 0;
+    goto Done;
+
+OutOfMemory:
+    printf("Out of memory.\n");
+
+Done:
+    free_work_pool(pool);
+    for (int i = 0; i < list.count; i++) {
+        free(list.paths[i]);
+    }
+    free(list.paths);
+    free(list.errors);
+    return result;
+}
+
+//
+// Private routines
+//
+
+// A path named on the command line is checked whatever it's called (and reported if it
+// can't be opened); in a directory, only .woz files are. Returns nonzero if out of memory.
+static
+int collect_paths(verify_list * list, const char * path, int named)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return (named || is_woz_name(path)) ? add_path(list, path) : 0;
+    }
+    DIR * dir = opendir(path);
+    if (!dir) {
+        return add_path(list, path);
+    }
+    int error = 0;
+    struct dirent * dirent;
+    while (!error && (dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        size_t length = strlen(path) + strlen(dirent->d_name) + 2;
+        char * child = malloc(length);
+        if (!child) {
+            error = -1;
+            break;
+        }
+        snprintf(child, length, "%s/%s", path, dirent->d_name);
+        if (dirent->d_type == DT_DIR || dirent->d_type == DT_UNKNOWN) {
+            error = collect_paths(list, child, 0);
+        } else if (dirent->d_type == DT_REG && is_woz_name(dirent->d_name)) {
+            error = add_path(list, child);
+        }
+        free(child);
+    }
+    closedir(dir);
+    return error;
+}
+
+static
+int add_path(verify_list * list, const char * path)
+{
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        char ** paths = realloc(list->paths, capacity * sizeof(char *));
+        if (!paths) {
+            return -1;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    char * copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    list->paths[list->count++] = copy;
+    return 0;
+}
+
+static
+int is_woz_name(const char * name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(&name[length - 4], ".woz") == 0;
+}
+
+static
+int compare_paths(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static
+void verify_item(void * context, int index)
+{
+    verify_list * list = context;
+    list->errors[index] = verify_woz_file(list->paths[index]);
+}
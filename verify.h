@@ -0,0 +1,20 @@
+//
+// verify.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module checks WOZ files in bulk, for QA over an archive of disks. Each file's
+// structure and CRCs are checked with woz_reader, many files at once.
+//
+
+#ifndef verify_h
+#define verify_h
+
+#include <stdio.h>
+
+// Checks each file in paths, and every .woz file in each directory in paths (and in
+// their subdirectories), on thread_count threads. Each bad file is printed with what's
+// wrong with it, in path order, and then a count. Returns 0 if every file is good.
+int verify_woz_paths(const char * const * paths, int path_count, int thread_count);
+
+#endif /* verify_h */
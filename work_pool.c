@@ -0,0 +1,176 @@
+//
+// work_pool.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "work_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+struct _work_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t batch_ready;         // Signalled when a batch starts, or on shutdown
+    pthread_cond_t batch_done;          // Signalled when the last worker leaves a batch
+    pthread_mutex_t run_lock;           // Held by the thread whose batch is running
+    pthread_t * threads;
+    int worker_count;                   // Threads started by the pool (not the caller)
+    int started_count;
+
+    // The current batch. Guarded by lock, except next_item.
+    work_item_fn fn;
+    void * context;
+    int item_count;
+    atomic_int next_item;
+    unsigned long generation;
+    int busy_workers;
+    int shutting_down;
+};
+
+static void * worker_main(void * arg);
+static void run_items(work_pool * pool, work_item_fn fn, void * context, int item_count);
+
+//
+// Public routines
+//
+
+work_pool * create_work_pool(int thread_count)
+{
+    work_pool * pool = calloc(1, sizeof(work_pool));
+    if (!pool) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->batch_ready, NULL);
+    pthread_cond_init(&pool->batch_done, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    atomic_init(&pool->next_item, 0);
+
+    pool->worker_count = (thread_count > 1) ? thread_count - 1 : 0;
+    if (pool->worker_count > 0) {
+        pool->threads = calloc(pool->worker_count, sizeof(pthread_t));
+        if (!pool->threads) {
+            free_work_pool(pool);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            break;
+        }
+        pool->started_count++;
+    }
+    // If some threads couldn't be started, carry on with the ones that were.
+    pool->worker_count = pool->started_count;
+    return pool;
+}
+
+void free_work_pool(work_pool * pool)
+{
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->batch_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->started_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->batch_ready);
+    pthread_cond_destroy(&pool->batch_done);
+    pthread_mutex_destroy(&pool->run_lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int work_pool_thread_count(const work_pool * pool)
+{
+    return pool ? pool->worker_count + 1 : 1;
+}
+
+void work_pool_run(work_pool * pool, int item_count, work_item_fn fn, void * context)
+{
+    if (!pool || pool->worker_count == 0 || item_count <= 1 ||
+        pthread_mutex_trylock(&pool->run_lock) != 0) {
+        for (int i = 0; i < item_count; i++) {
+            fn(context, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->context = context;
+    pool->item_count = item_count;
+    atomic_store(&pool->next_item, 0);
+    pool->busy_workers = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->batch_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_items(pool, fn, context, item_count);
+
+    // Every worker checks in for every batch, even if there was nothing left for it to do
+    // by the time it woke up, so the batch can't be replaced under a slow worker.
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy_workers > 0) {
+        pthread_cond_wait(&pool->batch_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+int default_thread_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+}
+
+//
+// Private routines
+//
+
+static
+void * worker_main(void * arg)
+{
+    work_pool * pool = arg;
+    unsigned long seen_generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutting_down && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->batch_ready, &pool->lock);
+        }
+        if (pool->shutting_down) {
+            break;
+        }
+        seen_generation = pool->generation;
+        work_item_fn fn = pool->fn;
+        void * context = pool->context;
+        int item_count = pool->item_count;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_items(pool, fn, context, item_count);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_workers == 0) {
+            pthread_cond_signal(&pool->batch_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static
+void run_items(work_pool * pool, work_item_fn fn, void * context, int item_count)
+{
+    for (;;) {
+        int index = atomic_fetch_add(&pool->next_item, 1);
+        if (index >= item_count) {
+            break;
+        }
+        fn(context, index);
+    }
+}
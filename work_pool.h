@@ -0,0 +1,35 @@
+//
+// work_pool.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module provides a fixed-size pool of worker threads for running a batch of
+// independent work items in parallel. The threads are started once and reused for
+// every batch. The calling thread works on the batch too, so a pool of N threads
+// starts N - 1 of its own, and a pool of 1 just runs everything inline.
+//
+
+#ifndef work_pool_h
+#define work_pool_h
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef void (*work_item_fn)(void * context, int index);
+
+typedef struct _work_pool work_pool;
+
+work_pool * create_work_pool(int thread_count);
+void free_work_pool(work_pool * pool);
+int work_pool_thread_count(const work_pool * pool);
+
+// Calls fn(context, i) once for every i in [0, item_count), in no particular order, and
+// returns once all of them have finished. If the pool is already running a batch (from
+// another thread, or from inside one of its own work items), the items just run on the
+// calling thread instead, so nested and concurrent use is safe. A NULL pool runs inline.
+void work_pool_run(work_pool * pool, int item_count, work_item_fn fn, void * context);
+
+// The number of online processors, which is a sensible default pool size.
+int default_thread_count(void);
+
+#endif /* work_pool_h */
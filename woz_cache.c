@@ -0,0 +1,336 @@
+//
+// woz_cache.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#define _GNU_SOURCE             // copy_file_range()
+#include "woz_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#define WOZ_CACHE_LOCK_NAME         "lock"
+#define WOZ_CACHE_STALE_SECONDS     3600    // Temporary files older than this were abandoned
+#define WOZ_CACHE_COPY_BUFFER_SIZE  65536
+
+// The lock file also holds the directory's total size, in decimal, as of the last scan
+// plus every entry added since. Every add updates it under the lock, so no process has
+// to scan to find out where the directory stands. It's only scanned (and evicted from)
+// when the total passes the limit, or isn't there, and then down to seven eighths of
+// the limit so that scans are rare. An entry that replaces one with the same name is
+// counted twice, which only brings the next scan forward.
+struct _woz_cache {
+    char * cache_dir;
+    uint64_t max_size;
+};
+
+typedef struct _cache_file {
+    struct timespec used;
+    uint64_t size;
+    char name[32];
+} cache_file;
+
+static void entry_path(const woz_cache * cache, woz_cache_entry kind, uint64_t key, char * path, size_t path_size);
+static uint64_t evict_entries(woz_cache * cache);
+static int read_recorded_size(int lock_fd, uint64_t * size);
+static void write_recorded_size(int lock_fd, uint64_t size);
+static int is_entry_name(const char * name);
+static int is_temp_name(const char * name);
+static int compare_used(const void * a, const void * b);
+static int write_all(int fd, const void * bytes, size_t count);
+
+static const char * entry_prefixes[] = { "disk-", "tracks-" };
+
+//
+// Public routines
+//
+
+woz_cache * create_woz_cache(const char * cache_dir, uint64_t max_size)
+{
+    if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    woz_cache * cache = calloc(1, sizeof(woz_cache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->cache_dir = strdup(cache_dir);
+    if (!cache->cache_dir) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_size = max_size;
+    return cache;
+}
+
+void free_woz_cache(woz_cache * cache)
+{
+    if (cache) {
+        free(cache->cache_dir);
+        free(cache);
+    }
+}
+
+int woz_cache_open_entry(woz_cache * cache, woz_cache_entry kind, uint64_t key, size_t size)
+{
+    char path[1024];
+    entry_path(cache, kind, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        close(fd);
+        return -1;
+    }
+    // Mark it recently used.
+    futimens(fd, NULL);
+    return fd;
+}
+
+void woz_cache_add_entry(woz_cache * cache, woz_cache_entry kind, uint64_t key, const void * bytes, size_t size)
+{
+    char path[1024];
+    char temp_path[1100];
+    entry_path(cache, kind, key, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        return;
+    }
+    int ok = fchmod(fd, 0644) == 0 && write_all(fd, bytes, size) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return;
+    }
+
+    // The lock is only held for long when this add takes the directory over its limit.
+    snprintf(path, sizeof(path), "%s/%s", cache->cache_dir, WOZ_CACHE_LOCK_NAME);
+    int lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) {
+        return;
+    }
+    while (flock(lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(lock_fd);
+            return;
+        }
+    }
+    uint64_t total;
+    if (read_recorded_size(lock_fd, &total) == 0 && total + size <= cache->max_size) {
+        write_recorded_size(lock_fd, total + size);
+    } else {
+        write_recorded_size(lock_fd, evict_entries(cache));
+    }
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// A reflink is instant and takes no space until one copy changes, but only some file
+// systems have them, and only within one file system. copy_file_range() can still
+// copy in the kernel (or share blocks) where they don't, and plain reads and writes
+// work everywhere.
+int woz_cache_copy_entry(int entry_fd, int dest_fd, size_t size)
+{
+    if (ioctl(dest_fd, FICLONE, entry_fd) == 0) {
+        return 0;
+    }
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+    size_t remaining = size;
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(entry_fd, &in_offset, dest_fd, &out_offset, remaining, 0);
+        if (copied <= 0) {
+            break;
+        }
+        remaining -= copied;
+    }
+
+    // Carry on by hand from wherever copy_file_range() stopped.
+    uint8_t buffer[WOZ_CACHE_COPY_BUFFER_SIZE];
+    while (remaining > 0) {
+        size_t count = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+        ssize_t got = pread(entry_fd, buffer, count, in_offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0 || lseek(dest_fd, out_offset, SEEK_SET) < 0 || write_all(dest_fd, buffer, got) != 0) {
+            return -1;
+        }
+        in_offset += got;
+        out_offset += got;
+        remaining -= got;
+    }
+    return 0;
+}
+
+//
+// Private routines
+//
+
+static
+void entry_path(const woz_cache * cache, woz_cache_entry kind, uint64_t key, char * path, size_t path_size)
+{
+    snprintf(path, path_size, "%s/%s%016llx.woz", cache->cache_dir, entry_prefixes[kind], (unsigned long long)key);
+}
+
+// Called with the lock held. Entries go oldest first, by the time they were last used.
+// Returns the size of what's left.
+static
+uint64_t evict_entries(woz_cache * cache)
+{
+    cache_file * files = NULL;
+    size_t file_count = 0;
+    size_t file_capacity = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    DIR * dir = opendir(cache->cache_dir);
+    if (!dir) {
+        return 0;
+    }
+
+    struct dirent * dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        int is_entry = is_entry_name(dirent->d_name);
+        struct stat st;
+        if ((!is_entry && !is_temp_name(dirent->d_name)) ||
+            fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (!is_entry) {
+            if (now - st.st_mtime > WOZ_CACHE_STALE_SECONDS) {
+                unlinkat(dirfd(dir), dirent->d_name, 0);
+            }
+            continue;
+        }
+        total += st.st_size;
+        if (file_count == file_capacity) {
+            size_t capacity = file_capacity ? file_capacity * 2 : 64;
+            cache_file * grown = realloc(files, capacity * sizeof(cache_file));
+            if (!grown) {
+                continue;
+            }
+            files = grown;
+            file_capacity = capacity;
+        }
+        cache_file * file = &files[file_count++];
+        file->used = st.st_mtim;
+        file->size = st.st_size;
+        strcpy(file->name, dirent->d_name);
+    }
+
+    if (total > cache->max_size) {
+        uint64_t target = cache->max_size - cache->max_size / 8;
+        qsort(files, file_count, sizeof(cache_file), compare_used);
+        for (size_t i = 0; i < file_count && total > target; i++) {
+            if (unlinkat(dirfd(dir), files[i].name, 0) == 0 || errno == ENOENT) {
+                total -= files[i].size;
+            }
+        }
+    }
+    free(files);
+    closedir(dir);
+    return total;
+}
+
+// Returns 0 and the size recorded in the lock file, or -1 if there isn't one.
+static
+int read_recorded_size(int lock_fd, uint64_t * size)
+{
+    char text[32];
+    ssize_t got = pread(lock_fd, text, sizeof(text) - 1, 0);
+    if (got <= 0) {
+        return -1;
+    }
+    text[got] = '\0';
+    char * end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\n') {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+static
+void write_recorded_size(int lock_fd, uint64_t size)
+{
+    char text[32];
+    int length = snprintf(text, sizeof(text), "%llu\n", (unsigned long long)size);
+    // If this fails part way, the next add finds the number unreadable and scans. Any
+    // digits left after the newline by a failed truncate are ignored.
+    if (pwrite(lock_fd, text, length, 0) == length && ftruncate(lock_fd, length) != 0) {
+        // Nothing useful to do about it.
+    }
+}
+
+// "disk-" or "tracks-", 16 hex digits and ".woz".
+static
+int is_entry_name(const char * name)
+{
+    for (int i = 0; i < 2; i++) {
+        size_t prefix_length = strlen(entry_prefixes[i]);
+        if (strncmp(name, entry_prefixes[i], prefix_length) == 0) {
+            return strlen(name) == prefix_length + 16 + 4 && strcmp(&name[prefix_length + 16], ".woz") == 0;
+        }
+    }
+    return 0;
+}
+
+// An entry's name with the six characters mkstemp() adds.
+static
+int is_temp_name(const char * name)
+{
+    size_t length = strlen(name);
+    if (length < 7 || name[length - 7] != '.') {
+        return 0;
+    }
+    char entry_name[32];
+    if (length - 7 >= sizeof(entry_name)) {
+        return 0;
+    }
+    memcpy(entry_name, name, length - 7);
+    entry_name[length - 7] = '\0';
+    return is_entry_name(entry_name);
+}
+
+static
+int compare_used(const void * a, const void * b)
+{
+    const struct timespec * x = &((const cache_file *)a)->used;
+    const struct timespec * y = &((const cache_file *)b)->used;
+    if (x->tv_sec != y->tv_sec) {
+        return (x->tv_sec < y->tv_sec) ? -1 : 1;
+    }
+    return (x->tv_nsec < y->tv_nsec) ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+
+static
+int write_all(int fd, const void * bytes, size_t count)
+{
+    const uint8_t * p = bytes;
+    while (count > 0) {
+        ssize_t written = write(fd, p, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        count -= written;
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+//
+// woz_cache.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module keeps finished WOZ images in a directory, named by a 64-bit key that the
+// caller makes from everything the image depends on. There are two kinds of entry:
+// whole disks, and disks with the default boot message, whose flux tracks can be reused
+// for any message.
+//
+// The directory can be shared by any number of processes. Entries are written under a
+// temporary name and renamed into place, so they appear complete or not at all, and an
+// entry that's open stays readable even if it's evicted meanwhile. Each hit bumps the
+// entry's modification time, and once the directory grows past its size limit the least
+// recently used entries are removed, by one process at a time under a flock() on the
+// directory's lock file. The lock file also keeps a running total of the directory's
+// size, so it's only scanned when that passes the limit.
+//
+
+#ifndef woz_cache_h
+#define woz_cache_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum _woz_cache_entry {
+    woz_cache_entry_disk = 0,   // The finished disk, message and all
+    woz_cache_entry_tracks      // The disk with the default message
+} woz_cache_entry;
+
+typedef struct _woz_cache woz_cache;
+
+// Creates the directory if need be. Returns NULL if it can't be created.
+woz_cache * create_woz_cache(const char * cache_dir, uint64_t max_size);
+void free_woz_cache(woz_cache * cache);
+
+// Returns a read-only descriptor for the entry if it's present and size bytes long,
+// or -1. The caller closes it.
+int woz_cache_open_entry(woz_cache * cache, woz_cache_entry kind, uint64_t key, size_t size);
+// Best effort only: if the entry can't be written, it's just made again next time.
+void woz_cache_add_entry(woz_cache * cache, woz_cache_entry kind, uint64_t key, const void * bytes, size_t size);
+// Copies size bytes of entry_fd to the start of dest_fd, sharing the blocks (a reflink)
+// where the file system can. Returns 0 on success.
+int woz_cache_copy_entry(int entry_fd, int dest_fd, size_t size);
+
+#endif /* woz_cache_h */
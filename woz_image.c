@@ -5,14 +5,28 @@
 //
 
 #include "woz_image.h"
+#include "crc32.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #define CHUNK_INITIAL_BUFFER 4096
+#define CHUNK_INITIAL_SPANS  16
 #define WOZ_HEADER_SIZE      12
 //
 // Private routine declarations.
 //
 static void verify_writable_buffer(woz_chunk * chunk, size_t min);
-static size_t serialize_chunk_to_buffer(woz_chunk * chunk, uint8_t * dest);
+static int write_chunk(int fd, woz_chunk * chunk);
+static int write_fully(int fd, const void * bytes, size_t count);
+static void chunk_header_bytes(woz_chunk * chunk, uint8_t * dest);
+static int image_is_complete(woz_file * woz);
+static uint32_t finish_image(woz_file * woz);
+static size_t chunk_hashed_size(const woz_chunk * chunk);
+static size_t image_hashed_size(woz_file * woz);
+static void init_chunk(woz_chunk * chunk, const char * name);
 
 //
 // Public routines.
@@ -22,12 +36,14 @@ woz_file * create_empty_woz_file(void)
 {
     woz_file * woz = malloc(sizeof(woz_file));
     if (woz) {
+        woz->image = NULL;
+        woz->image_size = 0;
         woz->info = create_woz_chunk("INFO");
         woz->tmap = create_woz_chunk("TMAP");
         woz->trks = create_woz_chunk("TRKS");
         woz->writ = create_woz_chunk("WRIT");
     }
-    if (!woz || !woz->info || !woz->tmap || !woz->writ) {
+    if (!woz || !woz->info || !woz->tmap || !woz->trks || !woz->writ) {
         goto Error;
     }
     
@@ -42,73 +58,178 @@ Done:
     return woz;
 }
 
+woz_file * create_woz_file_in_arena(const size_t chunk_sizes[WOZ_CHUNK_COUNT], int crc_span_capacity)
+{
+    // One block: the file and chunk structures, each chunk's CRC spans, and then the
+    // bytes of the file itself, chunk headers and all.
+    size_t image_size = WOZ_HEADER_SIZE;
+    for (int i = 0; i < WOZ_CHUNK_COUNT; i++) {
+        image_size += 8 + chunk_sizes[i];
+    }
+    size_t spans_offset = sizeof(woz_file) + WOZ_CHUNK_COUNT * sizeof(woz_chunk);
+    size_t image_offset = spans_offset + WOZ_CHUNK_COUNT * crc_span_capacity * sizeof(woz_crc_span);
+    uint8_t * arena = malloc(image_offset + image_size);
+    if (!arena) {
+        return NULL;
+    }
+    STATS_ALLOC(image_size);
+
+    woz_file * woz = (woz_file *)arena;
+    woz_chunk * chunks = (woz_chunk *)(arena + sizeof(woz_file));
+    woz_crc_span * spans = (woz_crc_span *)(arena + spans_offset);
+    woz->image = arena + image_offset;
+    woz->image_size = image_size;
+    woz->info = &chunks[0];
+    woz->tmap = &chunks[1];
+    woz->trks = &chunks[2];
+    woz->writ = &chunks[3];
+    const char * names[WOZ_CHUNK_COUNT] = { "INFO", "TMAP", "TRKS", "WRIT" };
+    uint8_t * data = woz->image + WOZ_HEADER_SIZE;
+    for (int i = 0; i < WOZ_CHUNK_COUNT; i++) {
+        woz_chunk * chunk = &chunks[i];
+        init_chunk(chunk, names[i]);
+        chunk->data = data + 8;
+        chunk->buffer_size = chunk_sizes[i];
+        chunk->data_in_arena = 1;
+        chunk->crc_spans = &spans[i * crc_span_capacity];
+        chunk->crc_span_capacity = crc_span_capacity;
+        chunk->spans_in_arena = 1;
+        data += 8 + chunk_sizes[i];
+    }
+    return woz;
+}
+
+void reset_woz_file(woz_file * woz)
+{
+    woz_chunk * chunks[] = { woz->info, woz->tmap, woz->trks, woz->writ };
+    for (int i = 0; i < WOZ_CHUNK_COUNT; i++) {
+        chunks[i]->mark = 0;
+        chunks[i]->crc_span_count = 0;
+    }
+}
+
 int write_woz_to_file(woz_file * woz, const char * path)
 {
-    FILE * file = fopen(path, "wb");
-    if (!file) {
-        printf("Failed to open output file %s", path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         return -1;
     }
-    
-    // Calculate the total size needed to write each actual chunk.
-    size_t total_file_size = WOZ_HEADER_SIZE;
-    total_file_size += chunk_size_on_disk(woz->info);
-    total_file_size += chunk_size_on_disk(woz->tmap);
-    total_file_size += chunk_size_on_disk(woz->trks);
-    total_file_size += chunk_size_on_disk(woz->writ);
-    
-    uint8_t * file_buffer = malloc(total_file_size);
-    if (!file_buffer) {
-        printf("Out of memory.\n");
-        fclose(file);
+
+    // An arena file goes out in one piece.
+    if (image_is_complete(woz)) {
+        STATS_PHASE_START(crc_start);
+        finish_image(woz);
+        STATS_PHASE_END(crc_start, stats_phase_crc, image_hashed_size(woz));
+        STATS_PHASE_START(write_start);
+        int error = write_fully(fd, woz->image, woz->image_size);
+        error = (close(fd) != 0) || error;
+        STATS_PHASE_END(write_start, stats_phase_write, woz->image_size);
+        return error ? -2 : 0;
+    }
+
+    // The chunks are streamed straight out of their own buffers. The header goes out
+    // first with a zero CRC, which is patched in at offset 8 once everything after it
+    // has been written (and folded into the CRC on the way).
+    uint8_t header[WOZ_HEADER_SIZE] = { 'W', 'O', 'Z', '2', 0xFF, '\n', '\r', '\n', 0, 0, 0, 0 };
+    woz_chunk * chunks[] = { woz->info, woz->tmap, woz->trks, woz->writ };
+    uint32_t crc = 0;
+    STATS_PHASE_START(write_start);
+    int error = write_fully(fd, header, sizeof(header));
+    STATS_PHASE_END(write_start, stats_phase_write, sizeof(header));
+    for (int i = 0; i < 4 && !error; i++) {
+        STATS_PHASE_START(chunk_start);
+        error = write_chunk(fd, chunks[i]);
+        STATS_PHASE_END(chunk_start, stats_phase_write, chunk_size_on_disk(chunks[i]));
+        STATS_PHASE_START(crc_start);
+        crc = chunk_crc32(chunks[i], crc);
+        STATS_PHASE_END(crc_start, stats_phase_crc, chunk_hashed_size(chunks[i]));
+    }
+    STATS_PHASE_START(finish_start);
+    if (!error) {
+        uint8_t crc_bytes[4] = { crc & 0xFF, (crc >> 8) & 0xFF, (crc >> 16) & 0xFF, (crc >> 24) & 0xFF };
+        error = pwrite(fd, crc_bytes, sizeof(crc_bytes), 8) != sizeof(crc_bytes);
+    }
+    error = (close(fd) != 0) || error;
+    STATS_PHASE_END(finish_start, stats_phase_write, 4);
+
+    if (error) {
         return -2;
     }
-    
-    file_buffer[0] = 'W';
-    file_buffer[1] = 'O';
-    file_buffer[2] = 'Z';
-    file_buffer[3] = '2';
-    file_buffer[4] = 0xFF;
-    file_buffer[5] = '\n';
-    file_buffer[6] = '\r';
-    file_buffer[7] = '\n';
-    // (CRC goes here at offset 8)
-    size_t byte_index = WOZ_HEADER_SIZE;
-    byte_index += serialize_chunk_to_buffer(woz->info, &file_buffer[byte_index]);
-    byte_index += serialize_chunk_to_buffer(woz->tmap, &file_buffer[byte_index]);
-    byte_index += serialize_chunk_to_buffer(woz->trks, &file_buffer[byte_index]);
-    /* byte_index += */ serialize_chunk_to_buffer(woz->writ, &file_buffer[byte_index]);
-
-    // Compute the overall CRC of everthing after the header, and write it in.
-    uint32_t crc = woz_crc32(&file_buffer[WOZ_HEADER_SIZE], total_file_size - WOZ_HEADER_SIZE);
-    file_buffer[8] = crc & 0xFF;
-    file_buffer[9] = (crc >> 8) & 0xFF;
-    file_buffer[10] = (crc >> 16) & 0xFF;
-    file_buffer[11] = (crc >> 24) & 0xFF;
-
-    // Write to disk.
-    size_t bytes_written = fwrite(file_buffer, 1, total_file_size, file);
-
-    fclose(file);
-    free(file_buffer);
-
-    if (bytes_written != total_file_size) {
-        printf("Error writing woz output.\n");
+
+    return 0;
+}
+
+size_t woz_size_on_disk(woz_file * woz)
+{
+    return WOZ_HEADER_SIZE + chunk_size_on_disk(woz->info) + chunk_size_on_disk(woz->tmap) +
+           chunk_size_on_disk(woz->trks) + chunk_size_on_disk(woz->writ);
+}
+
+int write_woz_to_buffer(woz_file * woz, uint8_t * buffer, size_t capacity)
+{
+    if (capacity < woz_size_on_disk(woz)) {
         return -1;
     }
-    
+
+    if (image_is_complete(woz)) {
+        STATS_PHASE_START(crc_start);
+        finish_image(woz);
+        STATS_PHASE_END(crc_start, stats_phase_crc, image_hashed_size(woz));
+        STATS_PHASE_START(copy_start);
+        memcpy(buffer, woz->image, woz->image_size);
+        STATS_PHASE_END(copy_start, stats_phase_write, woz->image_size);
+        return 0;
+    }
+
+    uint8_t * dest = buffer;
+    const uint8_t header[WOZ_HEADER_SIZE - 4] = { 'W', 'O', 'Z', '2', 0xFF, '\n', '\r', '\n' };
+    memcpy(dest, header, sizeof(header));
+    dest += WOZ_HEADER_SIZE;
+    woz_chunk * chunks[] = { woz->info, woz->tmap, woz->trks, woz->writ };
+    uint32_t crc = 0;
+    for (int i = 0; i < 4; i++) {
+        STATS_PHASE_START(copy_start);
+        chunk_header_bytes(chunks[i], dest);
+        memcpy(dest + 8, chunks[i]->data, chunks[i]->mark);
+        dest += chunk_size_on_disk(chunks[i]);
+        STATS_PHASE_END(copy_start, stats_phase_write, chunk_size_on_disk(chunks[i]));
+        STATS_PHASE_START(crc_start);
+        crc = chunk_crc32(chunks[i], crc);
+        STATS_PHASE_END(crc_start, stats_phase_crc, chunk_hashed_size(chunks[i]));
+    }
+    buffer[8] = crc & 0xFF;
+    buffer[9] = (crc >> 8) & 0xFF;
+    buffer[10] = (crc >> 16) & 0xFF;
+    buffer[11] = (crc >> 24) & 0xFF;
     return 0;
 }
 
 void free_woz_file(woz_file * woz)
 {
-    if (woz) {
-        if (woz->info) { free_chunk(woz->info); }
-        if (woz->tmap) { free_chunk(woz->tmap); }
-        if (woz->trks) { free_chunk(woz->trks); }
-        if (woz->writ) { free_chunk(woz->writ); }
+    if (!woz) {
+        return;
+    }
+    if (woz->image) {
+        // The chunks are part of the arena, but may have outgrown it.
+        woz_chunk * chunks[] = { woz->info, woz->tmap, woz->trks, woz->writ };
+        for (int i = 0; i < WOZ_CHUNK_COUNT; i++) {
+            if (!chunks[i]->data_in_arena) {
+                STATS_FREE(chunks[i]->buffer_size);
+                free(chunks[i]->data);
+            }
+            if (!chunks[i]->spans_in_arena) {
+                free(chunks[i]->crc_spans);
+            }
+        }
+        STATS_FREE(woz->image_size);
         free(woz);
+        return;
     }
+    if (woz->info) { free_chunk(woz->info); }
+    if (woz->tmap) { free_chunk(woz->tmap); }
+    if (woz->trks) { free_chunk(woz->trks); }
+    if (woz->writ) { free_chunk(woz->writ); }
+    free(woz);
 }
 
 woz_chunk * create_woz_chunk(const char * name)
@@ -117,19 +238,21 @@ woz_chunk * create_woz_chunk(const char * name)
     if (!chunk) {
         return NULL;
     }
+    init_chunk(chunk, name);
     chunk->data = calloc(CHUNK_INITIAL_BUFFER, 1);
     if (!chunk->data) {
         free(chunk);
         return NULL;
     }
-    memcpy(chunk->name, name, 4);
+    STATS_ALLOC(CHUNK_INITIAL_BUFFER);
     chunk->buffer_size = CHUNK_INITIAL_BUFFER;
-    chunk->mark = 0;
     return chunk;
 }
 
 void free_chunk(woz_chunk * chunk)
 {
+    STATS_FREE(chunk->buffer_size);
+    free(chunk->crc_spans);
     free(chunk->data);
     free(chunk);
 }
@@ -184,6 +307,15 @@ void chunk_write_bytes(woz_chunk * chunk, const uint8_t * bytes, size_t n)
     chunk->mark += n;
 }
 
+uint8_t * chunk_reserve_bytes(woz_chunk * chunk, size_t n)
+{
+    verify_writable_buffer(chunk, n);
+    uint8_t * bytes = &chunk->data[chunk->mark];
+    chunk->mark += n;
+    return bytes;
+}
+
+// Moving the mark forward leaves zeros in the bytes skipped over.
 void chunk_set_mark(woz_chunk * chunk, size_t mark)
 {
     if (mark <= chunk->mark) {
@@ -191,6 +323,7 @@ void chunk_set_mark(woz_chunk * chunk, size_t mark)
         return;
     }
     verify_writable_buffer(chunk, mark - chunk->mark);
+    memset(&chunk->data[chunk->mark], 0, mark - chunk->mark);
     chunk->mark = mark;
 }
 
@@ -200,10 +333,87 @@ void chunk_advance_mark(woz_chunk * chunk, int offset)
     chunk_set_mark(chunk, new_mark);
 }
 
+// Records that the CRC of the chunk data at [offset, offset + length) is already known.
+// Spans must be noted in ascending order and must not overlap, and the data they cover
+// must not change afterwards. A span that can't be used is simply ignored, and that
+// data is scanned normally instead.
+void chunk_note_crc(woz_chunk * chunk, size_t offset, size_t length, uint32_t crc)
+{
+    if (chunk->crc_span_count > 0) {
+        woz_crc_span * last = &chunk->crc_spans[chunk->crc_span_count - 1];
+        if (offset < last->offset + last->length) {
+            return;
+        }
+    }
+    if (chunk->crc_span_count == chunk->crc_span_capacity) {
+        int new_capacity = chunk->crc_span_capacity ? chunk->crc_span_capacity * 2 : CHUNK_INITIAL_SPANS;
+        woz_crc_span * new_spans = chunk->spans_in_arena ? malloc(new_capacity * sizeof(woz_crc_span)) :
+                                   realloc(chunk->crc_spans, new_capacity * sizeof(woz_crc_span));
+        if (!new_spans) {
+            return;
+        }
+        if (chunk->spans_in_arena) {
+            memcpy(new_spans, chunk->crc_spans, chunk->crc_span_count * sizeof(woz_crc_span));
+            chunk->spans_in_arena = 0;
+        }
+        chunk->crc_spans = new_spans;
+        chunk->crc_span_capacity = new_capacity;
+    }
+    woz_crc_span * span = &chunk->crc_spans[chunk->crc_span_count++];
+    span->offset = offset;
+    span->length = length;
+    span->crc = crc;
+}
+
+// Continues the given CRC over the chunk as it's written to disk (name, size, data).
+uint32_t chunk_crc32(woz_chunk * chunk, uint32_t crc)
+{
+    uint8_t header[8];
+    chunk_header_bytes(chunk, header);
+    crc = crc32_update(crc, header, sizeof(header));
+
+    size_t position = 0;
+    for (int i = 0; i < chunk->crc_span_count; i++) {
+        woz_crc_span * span = &chunk->crc_spans[i];
+        if (span->offset < position || span->offset + span->length > chunk->mark) {
+            continue;
+        }
+        crc = crc32_update(crc, &chunk->data[position], span->offset - position);
+        crc = crc32_combine(crc, span->crc, span->length);
+        position = span->offset + span->length;
+    }
+    return crc32_update(crc, &chunk->data[position], chunk->mark - position);
+}
+
 //
 // Private helper routines.
 //
 
+// The bytes chunk_crc32() actually reads: the spans whose CRCs were noted while they
+// were written are combined rather than read, and are counted where they were hashed.
+static
+size_t chunk_hashed_size(const woz_chunk * chunk)
+{
+    size_t size = 8 + chunk->mark;
+    size_t position = 0;
+    for (int i = 0; i < chunk->crc_span_count; i++) {
+        const woz_crc_span * span = &chunk->crc_spans[i];
+        if (span->offset < position || span->offset + span->length > chunk->mark) {
+            continue;
+        }
+        size -= span->length;
+        position = span->offset + span->length;
+    }
+    return size;
+}
+
+static
+size_t image_hashed_size(woz_file * woz)
+{
+    return chunk_hashed_size(woz->info) + chunk_hashed_size(woz->tmap) +
+           chunk_hashed_size(woz->trks) + chunk_hashed_size(woz->writ);
+}
+
 static
 void verify_writable_buffer(woz_chunk * chunk, size_t min)
 {
@@ -218,15 +428,118 @@ void verify_writable_buffer(woz_chunk * chunk, size_t min)
             // Will crash on the memcpy that comes next...
             printf("Out of memory expanding chunk buffer.");
         }
+        STATS_ALLOC(new_size);
         memcpy(new_buffer, chunk->data, chunk->buffer_size);
-        free(chunk->data);
+        // Arena data stays where it is; the chunk just isn't in place any more.
+        if (!chunk->data_in_arena) {
+            STATS_FREE(chunk->buffer_size);
+            free(chunk->data);
+        }
+        chunk->data_in_arena = 0;
         chunk->data = new_buffer;
         chunk->buffer_size = new_size;
     }
 }
 
+// Writes the chunk header and data with a single gathered write where possible.
+// Returns nonzero on error.
+static
+int write_chunk(int fd, woz_chunk * chunk)
+{
+    uint8_t header[8];
+    chunk_header_bytes(chunk, header);
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = chunk->data;
+    iov[1].iov_len = chunk->mark;
+
+    ssize_t written;
+    do {
+        written = writev(fd, iov, 2);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        return -1;
+    }
+    // Finish up after a short write.
+    if ((size_t)written < sizeof(header)) {
+        return write_fully(fd, &header[written], sizeof(header) - written) ||
+               write_fully(fd, chunk->data, chunk->mark);
+    }
+    written -= sizeof(header);
+    return write_fully(fd, &chunk->data[written], chunk->mark - written);
+}
+
+static
+int write_fully(int fd, const void * bytes, size_t count)
+{
+    const uint8_t * p = bytes;
+    while (count > 0) {
+        ssize_t written = write(fd, p, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        count -= written;
+    }
+    return 0;
+}
+
+static
+void init_chunk(woz_chunk * chunk, const char * name)
+{
+    memcpy(chunk->name, name, 4);
+    chunk->mark = 0;
+    chunk->buffer_size = 0;
+    chunk->data = NULL;
+    chunk->crc_spans = NULL;
+    chunk->crc_span_count = 0;
+    chunk->crc_span_capacity = 0;
+    chunk->data_in_arena = 0;
+    chunk->spans_in_arena = 0;
+}
+
+// True if this is an arena file with every chunk still in place and filled to exactly
+// its size, so that its image is the whole file.
 static
-size_t serialize_chunk_to_buffer(woz_chunk * chunk, uint8_t * dest)
+int image_is_complete(woz_file * woz)
+{
+    if (!woz->image) {
+        return 0;
+    }
+    woz_chunk * chunks[] = { woz->info, woz->tmap, woz->trks, woz->writ };
+    for (int i = 0; i < WOZ_CHUNK_COUNT; i++) {
+        if (!chunks[i]->data_in_arena || chunks[i]->mark != chunks[i]->buffer_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Fills in the file and chunk headers of a complete arena image, CRC included.
+static
+uint32_t finish_image(woz_file * woz)
+{
+    const uint8_t header[WOZ_HEADER_SIZE - 4] = { 'W', 'O', 'Z', '2', 0xFF, '\n', '\r', '\n' };
+    memcpy(woz->image, header, sizeof(header));
+    woz_chunk * chunks[] = { woz->info, woz->tmap, woz->trks, woz->writ };
+    uint32_t crc = 0;
+    for (int i = 0; i < WOZ_CHUNK_COUNT; i++) {
+        chunk_header_bytes(chunks[i], chunks[i]->data - 8);
+        crc = chunk_crc32(chunks[i], crc);
+    }
+    woz->image[8] = crc & 0xFF;
+    woz->image[9] = (crc >> 8) & 0xFF;
+    woz->image[10] = (crc >> 16) & 0xFF;
+    woz->image[11] = (crc >> 24) & 0xFF;
+    return crc;
+}
+
+static
+void chunk_header_bytes(woz_chunk * chunk, uint8_t * dest)
 {
     memcpy(dest, &chunk->name, 4);
     size_t size = chunk->mark;
@@ -234,69 +547,14 @@ size_t serialize_chunk_to_buffer(woz_chunk * chunk, uint8_t * dest)
     dest[5] = size >> 8 & 0xFF;
     dest[6] = size >> 16 & 0xFF;
     dest[7] = size >> 24 & 0xFF;
-    memcpy(&dest[8], chunk->data, chunk->mark);
-    return 4 + 4 + chunk->mark;
 }
 
 
 //
-// CRC routine and table.
-// Gary S. Brown, 1986.
-// Copied from https://applesaucefdc.com/woz/reference2/
+// CRC routine. The WOZ reference uses the standard CRC-32, see crc32.c.
 //
 
-static uint32_t crc32_tab[] = {
-    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-};
-
 uint32_t woz_crc32(const void *buf, size_t size)
 {
-    const uint8_t * p = buf;
-    uint32_t crc = 0 ^ ~0U;
-    while (size--) {
-        crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-    }
-    return crc ^ ~0U;
+    return crc32_update(0, buf, size);
 }
@@ -15,23 +15,51 @@
 #include <string.h>
 #include <stdint.h>
 
+// A range of chunk data whose CRC the caller already knows. When the file CRC is
+// computed, these ranges are folded in with crc32_combine() instead of being rescanned.
+typedef struct _woz_crc_span {
+    size_t offset;
+    size_t length;
+    uint32_t crc;
+} woz_crc_span;
+
 typedef struct _woz_chunk {
     char name[4];
     size_t mark;
     size_t buffer_size;
     uint8_t * data;
+    woz_crc_span * crc_spans;
+    int crc_span_count;
+    int crc_span_capacity;
+    int data_in_arena;          // data and crc_spans belong to the file's arena, not
+    int spans_in_arena;         // to the chunk, and can't be grown in place
 } woz_chunk;
 
+#define WOZ_CHUNK_COUNT 4
+
 typedef struct _woz_file {
     woz_chunk * info;
     woz_chunk * tmap;
     woz_chunk * trks;
     woz_chunk * writ;
+    uint8_t * image;            // The whole file, in an arena file; otherwise NULL
+    size_t image_size;
 } woz_file;
 
 woz_file * create_empty_woz_file(void);
+// Makes a file in a single allocation, with the chunk data laid out in place in the
+// file's own bytes. chunk_sizes are the exact data sizes of INFO, TMAP, TRKS and WRIT,
+// and each chunk has room to note crc_span_capacity CRCs. Writing such a file is a
+// single copy or write once every chunk is filled to exactly its size.
+woz_file * create_woz_file_in_arena(const size_t chunk_sizes[WOZ_CHUNK_COUNT], int crc_span_capacity);
+// Empties every chunk, so that an arena file can be reused for another disk.
+void reset_woz_file(woz_file * woz);
 void free_woz_file(woz_file * woz);
+// Returns 0 on success, -1 if the file couldn't be created, or -2 if writing it failed.
 int write_woz_to_file(woz_file * woz, const char * path);
+// Returns 0 on success, or -1 if the buffer is smaller than woz_size_on_disk().
+int write_woz_to_buffer(woz_file * woz, uint8_t * buffer, size_t capacity);
+size_t woz_size_on_disk(woz_file * woz);
 
 woz_chunk * create_woz_chunk(const char * name);
 void free_chunk(woz_chunk * chunk);
@@ -41,8 +69,12 @@ void chunk_write_uint16(woz_chunk * chunk, uint16_t u16);
 void chunk_write_uint32(woz_chunk * chunk, uint32_t u32);
 void chunk_write_utf8(woz_chunk * chunk, const char * utf8string, int n);
 void chunk_write_bytes(woz_chunk * chunk, const uint8_t * bytes, size_t n);
+// Returns the n bytes at the mark for the caller to fill in, and moves the mark past them.
+uint8_t * chunk_reserve_bytes(woz_chunk * chunk, size_t n);
 void chunk_set_mark(woz_chunk * chunk, size_t mark);
 void chunk_advance_mark(woz_chunk * chunk, int offset);
+void chunk_note_crc(woz_chunk * chunk, size_t offset, size_t length, uint32_t crc);
+uint32_t chunk_crc32(woz_chunk * chunk, uint32_t crc);
 
 uint32_t woz_crc32(const void *buf, size_t size);
 
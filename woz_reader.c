@@ -0,0 +1,292 @@
+//
+// woz_reader.c
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+
+#include "woz_reader.h"
+#include "crc32.h"
+
+#define WOZ_HEADER_SIZE             12
+#define WOZ_CHUNK_HEADER_SIZE       8
+#define WOZ_INFO_MIN_SIZE           60
+#define WOZ_TRKS_TABLE_SIZE         (WOZ_TRACK_COUNT * 8)
+#define WOZ_WRIT_ENTRY_SIZE         8
+#define WOZ_WRIT_COMMAND_SIZE       12
+
+//
+// Private declarations
+//
+
+static woz_reader * parse_woz(mapped_reader * mapped, woz_error * error);
+static woz_error check_tracks(const woz_reader * reader);
+static woz_error check_track_map(const woz_reader * reader);
+static uint16_t load_le16(const uint8_t * p);
+static uint32_t load_le32(const uint8_t * p);
+static void set_woz_error(woz_error * error, woz_error value);
+
+//
+// Public routines
+//
+
+woz_reader * open_woz_reader(const char * path, woz_error * error)
+{
+    mapped_reader * mapped = open_mapped_reader(path, file_endianness_little);
+    if (!mapped) {
+        set_woz_error(error, woz_error_open_failed);
+        return NULL;
+    }
+    return parse_woz(mapped, error);
+}
+
+woz_reader * open_woz_reader_with_bytes(const void * bytes, size_t size, woz_error * error)
+{
+    mapped_reader * mapped = open_mapped_reader_with_bytes(bytes, size, file_endianness_little);
+    if (!mapped) {
+        set_woz_error(error, woz_error_out_of_memory);
+        return NULL;
+    }
+    return parse_woz(mapped, error);
+}
+
+void close_woz_reader(woz_reader * reader)
+{
+    if (reader) {
+        close_mapped_reader(reader->reader);
+        free(reader);
+    }
+}
+
+int woz_reader_track(const woz_reader * reader, int index, woz_track * track)
+{
+    if (index < 0 || index >= WOZ_TRACK_COUNT) {
+        return 0;
+    }
+    const uint8_t * entry = &reader->trks[index * 8];
+    uint16_t block_count = load_le16(&entry[2]);
+    if (block_count == 0) {
+        return 0;
+    }
+    track->bits = &reader->bytes[(size_t)load_le16(&entry[0]) * WOZ_BLOCK_SIZE];
+    track->block_count = block_count;
+    track->bit_count = load_le32(&entry[4]);
+    return 1;
+}
+
+int woz_reader_track_index(const woz_reader * reader, int quarter_track)
+{
+    if (quarter_track < 0 || quarter_track >= WOZ_QUARTER_TRACK_COUNT || reader->tmap[quarter_track] == WOZ_NO_TRACK) {
+        return -1;
+    }
+    return reader->tmap[quarter_track];
+}
+
+// A WRIT entry's checksum is the CRC of its track's bits, which means the whole of its
+// blocks for picturedsk and Applesauce. Some writers only cover the bytes that hold
+// bits, so that's accepted too.
+woz_error verify_woz_crcs(const woz_reader * reader)
+{
+    uint32_t file_crc = load_le32(&reader->bytes[8]);
+    if (file_crc != 0 && crc32_update(0, &reader->bytes[WOZ_HEADER_SIZE], reader->size - WOZ_HEADER_SIZE) != file_crc) {
+        return woz_error_bad_file_crc;
+    }
+
+    size_t offset = 0;
+    while (offset < reader->writ_size) {
+        const uint8_t * entry = &reader->writ[offset];
+        if (reader->writ_size - offset < WOZ_WRIT_ENTRY_SIZE) {
+            return woz_error_bad_writ;
+        }
+        size_t entry_size = WOZ_WRIT_ENTRY_SIZE + (size_t)entry[1] * WOZ_WRIT_COMMAND_SIZE;
+        woz_track track;
+        if (reader->writ_size - offset < entry_size ||
+            !woz_reader_track(reader, woz_reader_track_index(reader, entry[0]), &track)) {
+            return woz_error_bad_writ;
+        }
+        for (int i = 0; i < entry[1]; i++) {
+            const uint8_t * command = &entry[WOZ_WRIT_ENTRY_SIZE + i * WOZ_WRIT_COMMAND_SIZE];
+            uint64_t end_bit = (uint64_t)load_le32(&command[0]) + load_le32(&command[4]);
+            if (end_bit > (uint64_t)track.block_count * WOZ_BLOCK_SIZE * 8) {
+                return woz_error_bad_writ;
+            }
+        }
+        uint32_t checksum = load_le32(&entry[4]);
+        size_t block_bytes = (size_t)track.block_count * WOZ_BLOCK_SIZE;
+        size_t bit_bytes = ((size_t)track.bit_count + 7) / 8;
+        uint32_t crc = crc32_update(0, track.bits, block_bytes);
+        if (crc != checksum && (bit_bytes >= block_bytes || crc32_update(0, track.bits, bit_bytes) != checksum)) {
+            return woz_error_bad_track_crc;
+        }
+        offset += entry_size;
+    }
+    return woz_error_none;
+}
+
+woz_error verify_woz_file(const char * path)
+{
+    woz_error error = woz_error_none;
+    woz_reader * reader = open_woz_reader(path, &error);
+    if (!reader) {
+        return error;
+    }
+    error = verify_woz_crcs(reader);
+    close_woz_reader(reader);
+    return error;
+}
+
+const char * woz_error_string(woz_error error)
+{
+    switch (error) {
+        case woz_error_none:
+            return "OK";
+        case woz_error_open_failed:
+            return "Could not open file";
+        case woz_error_not_woz:
+            return "Not a WOZ 2 file";
+        case woz_error_bad_chunk:
+            return "Chunk missing, too small or out of bounds";
+        case woz_error_bad_track:
+            return "TRKS entry out of bounds";
+        case woz_error_bad_track_map:
+            return "TMAP entry refers to a missing track";
+        case woz_error_bad_writ:
+            return "WRIT entry malformed or refers to a missing track";
+        case woz_error_bad_file_crc:
+            return "File CRC mismatch";
+        case woz_error_bad_track_crc:
+            return "Track CRC mismatch";
+        case woz_error_out_of_memory:
+            return "Out of memory";
+    }
+    return "Unknown error";
+}
+
+//
+// Private routines
+//
+
+// Walks the chunk list, keeping the first of each chunk we know, and checks that the
+// views taken of them are all in bounds. Unknown chunks (META, FLUX, ...) are skipped.
+static
+woz_reader * parse_woz(mapped_reader * mapped, woz_error * error)
+{
+    woz_error result = woz_error_none;
+    woz_reader * reader = calloc(1, sizeof(woz_reader));
+    if (!reader) {
+        result = woz_error_out_of_memory;
+        goto Error;
+    }
+    reader->reader = mapped;
+    reader->bytes = mapped->bytes;
+    reader->size = mapped->total_size;
+
+    const uint8_t magic[8] = { 'W', 'O', 'Z', '2', 0xFF, '\n', '\r', '\n' };
+    const uint8_t * header = read_span(mapped, WOZ_HEADER_SIZE);
+    if (!header || memcmp(header, magic, sizeof(magic)) != 0) {
+        result = woz_error_not_woz;
+        goto Error;
+    }
+    uint32_t tmap_size = 0;
+    while (mapped->offset < mapped->total_size) {
+        if (!mapped_reader_ensure_remaining(mapped, WOZ_CHUNK_HEADER_SIZE)) {
+            result = woz_error_bad_chunk;
+            goto Error;
+        }
+        const uint8_t * id = read_span(mapped, 4);
+        uint32_t size = read_uint32(mapped);
+        const uint8_t * data = read_span(mapped, size);
+        if (!data) {
+            result = woz_error_bad_chunk;
+            goto Error;
+        }
+        if (memcmp(id, "INFO", 4) == 0 && !reader->info) {
+            reader->info = data;
+            reader->info_size = size;
+        } else if (memcmp(id, "TMAP", 4) == 0 && !reader->tmap) {
+            reader->tmap = data;
+            tmap_size = size;
+        } else if (memcmp(id, "TRKS", 4) == 0 && !reader->trks) {
+            reader->trks = data;
+            reader->trks_size = size;
+        } else if (memcmp(id, "WRIT", 4) == 0 && !reader->writ) {
+            reader->writ = data;
+            reader->writ_size = size;
+        }
+    }
+    if (!reader->info || reader->info_size < WOZ_INFO_MIN_SIZE ||
+        !reader->tmap || tmap_size < WOZ_QUARTER_TRACK_COUNT ||
+        !reader->trks || reader->trks_size < WOZ_TRKS_TABLE_SIZE) {
+        result = woz_error_bad_chunk;
+        goto Error;
+    }
+    result = check_tracks(reader);
+    if (result == woz_error_none) {
+        result = check_track_map(reader);
+    }
+    if (result != woz_error_none) {
+        goto Error;
+    }
+    return reader;
+
+Error:
+    set_woz_error(error, result);
+    if (reader) {
+        close_woz_reader(reader);
+    } else {
+        close_mapped_reader(mapped);
+    }
+    return NULL;
+}
+
+// Each track's blocks have to be in the TRKS chunk, after its table, and hold its bits.
+static
+woz_error check_tracks(const woz_reader * reader)
+{
+    size_t bits_start = (size_t)(reader->trks - reader->bytes) + WOZ_TRKS_TABLE_SIZE;
+    size_t bits_end = (size_t)(reader->trks - reader->bytes) + reader->trks_size;
+    for (int i = 0; i < WOZ_TRACK_COUNT; i++) {
+        const uint8_t * entry = &reader->trks[i * 8];
+        size_t start = (size_t)load_le16(&entry[0]) * WOZ_BLOCK_SIZE;
+        size_t size = (size_t)load_le16(&entry[2]) * WOZ_BLOCK_SIZE;
+        uint32_t bit_count = load_le32(&entry[4]);
+        if (size == 0) {
+            continue;
+        }
+        if (start < bits_start || start > bits_end || bits_end - start < size || bit_count > size * 8) {
+            return woz_error_bad_track;
+        }
+    }
+    return woz_error_none;
+}
+
+static
+woz_error check_track_map(const woz_reader * reader)
+{
+    woz_track track;
+    for (int i = 0; i < WOZ_QUARTER_TRACK_COUNT; i++) {
+        if (reader->tmap[i] != WOZ_NO_TRACK && !woz_reader_track(reader, reader->tmap[i], &track)) {
+            return woz_error_bad_track_map;
+        }
+    }
+    return woz_error_none;
+}
+
+static
+uint16_t load_le16(const uint8_t * p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static
+uint32_t load_le32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+void set_woz_error(woz_error * error, woz_error value)
+{
+    if (error) {
+        *error = value;
+    }
+}
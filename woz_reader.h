@@ -0,0 +1,77 @@
+//
+// woz_reader.h
+//
+// Copyright (c) 2021 by Ben Zotto
+//
+// This module reads WOZ 2.0 disk images, the other half of woz_image. The file is
+// mapped (through a mapped_reader) and never copied: the reader just holds views of the
+// INFO, TMAP, TRKS and WRIT chunks and of each track's bits in place. Opening a file
+// checks its structure, so that every view is known to lie inside the file; checking
+// the CRCs, which means reading all of it, is left to verify_woz_crcs().
+// Please see https://applesaucefdc.com/woz/reference2/
+//
+
+#ifndef woz_reader_h
+#define woz_reader_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mapped_reader.h"
+
+typedef enum _woz_error {
+    woz_error_none = 0,
+    woz_error_open_failed,
+    woz_error_not_woz,          // No WOZ2 signature
+    woz_error_bad_chunk,        // A chunk runs off the end, or a required one is missing or too small
+    woz_error_bad_track,        // A TRKS entry's bits aren't inside the TRKS chunk
+    woz_error_bad_track_map,    // A TMAP entry refers to a track that isn't there
+    woz_error_bad_writ,         // A WRIT entry runs off the end, or refers to a track that isn't there
+    woz_error_bad_file_crc,
+    woz_error_bad_track_crc,    // A WRIT entry's checksum doesn't match its track's bits
+    woz_error_out_of_memory
+} woz_error;
+
+#define WOZ_QUARTER_TRACK_COUNT     160
+#define WOZ_TRACK_COUNT             160
+#define WOZ_NO_TRACK                0xFF    // TMAP entry for a quarter-track with no data
+#define WOZ_BLOCK_SIZE              512
+
+// One TRKS entry. bits points into the file, and has block_count blocks.
+typedef struct _woz_track {
+    const uint8_t * bits;
+    uint32_t bit_count;
+    uint16_t block_count;
+} woz_track;
+
+typedef struct _woz_reader {
+    mapped_reader * reader;
+    const uint8_t * bytes;      // The whole file
+    size_t size;
+    const uint8_t * info;       // Chunk data, or NULL for a missing optional chunk
+    uint32_t info_size;
+    const uint8_t * tmap;
+    const uint8_t * trks;
+    uint32_t trks_size;
+    const uint8_t * writ;
+    uint32_t writ_size;
+} woz_reader;
+
+// These return NULL on failure, with the reason in *error (if error is non-NULL). The
+// bytes passed to open_woz_reader_with_bytes() must outlive the reader.
+woz_reader * open_woz_reader(const char * path, woz_error * error);
+woz_reader * open_woz_reader_with_bytes(const void * bytes, size_t size, woz_error * error);
+void close_woz_reader(woz_reader * reader);
+
+// Returns 1 and fills in track if TRKS entry index has bits, else 0.
+int woz_reader_track(const woz_reader * reader, int index, woz_track * track);
+// Returns the TRKS index for a quarter-track, or -1 if it has no data.
+int woz_reader_track_index(const woz_reader * reader, int quarter_track);
+
+// Checks the file CRC (unless it's zero, which means it wasn't computed) and each WRIT
+// entry's checksum of its track.
+woz_error verify_woz_crcs(const woz_reader * reader);
+// Opens, checks and closes a file. Safe to call from several threads at once.
+woz_error verify_woz_file(const char * path);
+const char * woz_error_string(woz_error error);
+
+#endif /* woz_reader_h */